@@ -32,13 +32,128 @@
 *******************************************************************************
 */
 #include "algorithm_by_RF.h"
+#include "rf_kernels.h"
 #include <math.h>
+#include <string.h>
 
-const float sum_X2                    = 83325; // WARNING: you MUST recalculate this sum if you changed either ST or FS 
 const float min_autocorrelation_ratio = 0.5;
-const float mean_X                    = (float)(BUFFER_SIZE-1)/2.0; // Mean value of the set of integers from 0 to BUFFER_SIZE-1. For ST=4 and FS=25 it's equal to 49.5.
 const float min_pearson_correlation   = 0.8;
 
+static void rf_estimate(rf_context *pctx, int32_t n_size, float f_ir_mean, float f_red_mean,
+                        float f_x_ac, float f_y_ac, float f_ir_sumsq, int b_aut_ready, float *pn_spo2, int8_t *pch_spo2_valid,
+                        int32_t *pn_heart_rate, int8_t *pch_hr_valid, float *ratio, float *correl);
+static void rf_invalidate(float *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid,
+                          float *ratio, float *correl);
+static void rf_periodicity_climb(float *pn_x, int32_t n_size, float *pn_aut, int32_t n_lag_first, int32_t *p_last_periodicity,
+                                 int32_t n_min_distance, int32_t n_max_distance, float min_aut_ratio, float aut_lag0, float *ratio);
+static void rf_stream_autocorrelation_sequence(rf_stream *ps, double f_ir_mean, double beta_ir);
+static double rf_stream_detrended_sumsq(int32_t n_size, int64_t n_sumsq, int64_t n_sum, double beta, double sum_X2);
+
+// Autocorrelation at n_lag, from the precomputed sequence if there is one
+static inline float rf_aut_at(float *pn_x, int32_t n_size, float *pn_aut, int32_t n_lag_first, int32_t n_lag)
+{
+    return pn_aut ? pn_aut[n_lag-n_lag_first] : rf_autocorrelation(pn_x, n_size, n_lag);
+}
+
+// Context behind rf_heart_rate_and_oxygen_saturation, for callers that process a single channel
+static rf_context rf_default_context;
+static float rf_default_scratch[2*BUFFER_SIZE];
+static int rf_default_context_ready=0;
+
+/**
+* \brief        Default configuration
+* \par          Details
+*               Fills pcfg with the settable parameters defined at the top of algorithm_by_RF.h,
+*               so callers only need to override what differs for their channel.
+*
+* \param[out]   *pcfg   - Configuration to fill
+*
+* \retval       None
+*/
+void rf_config_default(rf_config *pcfg)
+{
+    pcfg->f_min_autocorrelation_ratio=min_autocorrelation_ratio;
+    pcfg->f_min_pearson_correlation=min_pearson_correlation;
+    pcfg->n_periodicity_search=RF_PERIODICITY_HILL_CLIMB;
+    rf_configure(pcfg, FS, ST);
+}
+
+/**
+* \brief        Set sampling frequency and sampling time
+* \par          Details
+*               Computes the parameters derived from FS and ST once, in closed form. In particular
+*               the sum of squares of the N=FS*ST mean-centered point indices is
+*               sum_X2 = N*(N^2-1)/12, e.g. 83325 for the default ST=4 and FS=25.
+*
+* \param[in,out] *pcfg  - Configuration to update
+* \param[in]    n_fs    - Sampling frequency in Hz, 1 to RF_MAX_FS
+* \param[in]    n_st    - Sampling time in s, 1 to RF_MAX_ST
+*
+* \retval       1 on success, 0 if the parameters are out of range and pcfg is left unchanged
+*/
+int rf_configure(rf_config *pcfg, int32_t n_fs, int32_t n_st)
+{
+    double n_size;
+
+    if(n_fs<1 || n_fs>RF_MAX_FS || n_st<1 || n_st>RF_MAX_ST || n_fs*60/MAX_HR<1)
+        return 0;
+    n_size=(double)n_fs*n_st;
+    pcfg->n_fs=n_fs;
+    pcfg->n_st=n_st;
+    pcfg->n_buffer_size=n_fs*n_st;
+    pcfg->n_fs60=n_fs*60;
+    pcfg->f_mean_X=(float)((n_size-1.0)/2.0);
+    pcfg->f_sum_X2=(float)(n_size*(n_size*n_size-1.0)/12.0);
+    pcfg->n_lowest_period=pcfg->n_fs60/MAX_HR;
+    pcfg->n_highest_period=pcfg->n_fs60/MIN_HR;
+    pcfg->n_init_interval=pcfg->n_fs60/TYPICAL_HR;
+    // The periodicity search looks one lag beyond either limit
+    pcfg->n_aut_first=pcfg->n_lowest_period-1;
+    pcfg->n_aut_last=pcfg->n_highest_period+1;
+    return 1;
+}
+
+/**
+* \brief        Scratch space of an algorithm context
+* \par          Details
+*               Size of the buffer rf_init needs for the detrended IR and red windows.
+*
+* \param[in]    *pcfg   - Configuration, or NULL for rf_config_default
+*
+* \retval       Size in bytes
+*/
+size_t rf_scratch_size(const rf_config *pcfg)
+{
+    int32_t n_size=pcfg ? pcfg->n_buffer_size : BUFFER_SIZE;
+    return 2*(size_t)n_size*sizeof(float);
+}
+
+/**
+* \brief        Initialize an algorithm context
+* \par          Details
+*               A context holds everything that used to be hidden function-level state: the
+*               periodicity tracked from window to window, the scratch buffers and the
+*               configuration. One context per sensor channel lets several channels be processed
+*               in turn without interfering, and without any allocation per call.
+*
+* \param[out]   *pctx       - Context to initialize
+* \param[in]    *pcfg       - Configuration, or NULL for rf_config_default
+* \param[in]    *pf_scratch - Scratch space of rf_scratch_size(pcfg) bytes, owned by the caller for
+*                             the lifetime of the context
+*
+* \retval       None
+*/
+void rf_init(rf_context *pctx, const rf_config *pcfg, float *pf_scratch)
+{
+    if(pcfg)
+        pctx->cfg=*pcfg;
+    else
+        rf_config_default(&pctx->cfg);
+    pctx->n_last_peak_interval=pctx->cfg.n_init_interval;
+    pctx->an_x=pf_scratch;
+    pctx->an_y=pf_scratch ? pf_scratch+pctx->cfg.n_buffer_size : NULL;
+}
+
 /**
 * \brief        Calculate the heart rate and SpO2 level, Robert Fraczkiewicz version
 * \par          Details
@@ -63,14 +178,63 @@ void rf_heart_rate_and_oxygen_saturation(
     int32_t *pn_heart_rate, 
     int8_t *pch_hr_valid, 
     float *ratio, float *correl)
+{
+    if(!rf_default_context_ready) {
+        rf_init(&rf_default_context, NULL, rf_default_scratch);
+        rf_default_context_ready=1;
+        }
+    rf_process(&rf_default_context, pun_ir_buffer, n_ir_buffer_length, pun_red_buffer,
+               pn_spo2, pch_spo2_valid, pn_heart_rate, pch_hr_valid, ratio, correl);
+}
+
+/**
+* \brief        Forget the state of rf_heart_rate_and_oxygen_saturation
+* \par          Details
+*               The next call starts from the initial periodicity again, as after a reset, so
+*               its results do not depend on the signal processed before.
+*
+* \retval       None
+*/
+void rf_reset_default_context(void)
+{
+    rf_default_context_ready=0;
+}
+
+/**
+* \brief        Calculate the heart rate and SpO2 level for one channel
+* \par          Details
+*               Reentrant version of rf_heart_rate_and_oxygen_saturation: all state and scratch
+*               space lives in pctx. n_ir_buffer_length must be the configured n_buffer_size, the
+*               length the regression constants are computed for.
+*
+* \param[in,out] *pctx                  - Context of the channel, see rf_init
+* \param[in]    *pun_ir_buffer .. *correl - see rf_heart_rate_and_oxygen_saturation
+*
+* \retval       None
+*/
+void rf_process(
+    rf_context *pctx,
+    uint32_t *pun_ir_buffer, 
+    int32_t n_ir_buffer_length, 
+    uint32_t *pun_red_buffer, 
+    float *pn_spo2, 
+    int8_t *pch_spo2_valid,
+    int32_t *pn_heart_rate, 
+    int8_t *pch_hr_valid, 
+    float *ratio, float *correl)
 {
     int32_t k;  
-    static int32_t n_last_peak_interval=INIT_INTERVAL;
     float f_ir_mean,f_red_mean,f_ir_sumsq,f_red_sumsq;
-    float f_y_ac, f_x_ac, xy_ratio;
+    float f_y_ac, f_x_ac;
     float beta_ir, beta_red, x;
-    float an_x[BUFFER_SIZE], *ptr_x; //ir
-    float an_y[BUFFER_SIZE], *ptr_y; //red
+    float *an_x=pctx->an_x, *ptr_x; //ir
+    float *an_y=pctx->an_y, *ptr_y; //red
+    const float mean_X=pctx->cfg.f_mean_X, sum_X2=pctx->cfg.f_sum_X2;
+
+    if(n_ir_buffer_length!=pctx->cfg.n_buffer_size) {
+        rf_invalidate(pn_spo2, pch_spo2_valid, pn_heart_rate, pch_hr_valid, ratio, correl);
+        return;
+        }
 
     // calculates DC mean and subtracts DC from ir and red
     f_ir_mean=0.0; 
@@ -102,18 +266,53 @@ void rf_heart_rate_and_oxygen_saturation(
 
     // Calculate Pearson correlation between red and IR
     *correl=rf_Pcorrelation(an_x, an_y, n_ir_buffer_length)/sqrt(f_red_sumsq*f_ir_sumsq);
-    if(*correl>=min_pearson_correlation) {
+    rf_estimate(pctx, n_ir_buffer_length, f_ir_mean, f_red_mean, f_x_ac, f_y_ac, f_ir_sumsq, 0,
+                pn_spo2, pch_spo2_valid, pn_heart_rate, pch_hr_valid, ratio, correl);
+}
+
+/**
+* \brief        Heart rate and SpO2 from the statistics of a detrended window
+* \par          Details
+*               Common tail of the batch and streaming estimators. Finds the periodicity of the
+*               detrended IR signal if red and IR are well correlated, then derives the heart rate
+*               from it and SpO2 from the AC/DC ratio of both signals.
+*
+* \param[in,out] *pctx                  - Context holding the detrended IR signal in an_x and the
+*                                         periodicity found in the previous window
+* \param[in]    n_size                  - Number of samples in an_x
+* \param[in]    f_ir_mean, f_red_mean   - DC level of the IR and red signals
+* \param[in]    f_x_ac, f_y_ac          - RMS of the detrended IR and red signals
+* \param[in]    f_ir_sumsq              - Mean square of the detrended IR signal
+* \param[in]    b_aut_ready             - 1 if an_aut already holds the autocorrelation sequence of the
+*                                         detrended IR signal, see RF_PERIODICITY_SEQUENCE
+*
+* \retval       None
+*/
+static void rf_estimate(rf_context *pctx, int32_t n_size, float f_ir_mean, float f_red_mean,
+                        float f_x_ac, float f_y_ac, float f_ir_sumsq, int b_aut_ready, float *pn_spo2, int8_t *pch_spo2_valid,
+                        int32_t *pn_heart_rate, int8_t *pch_hr_valid, float *ratio, float *correl)
+{
+    const rf_config *pcfg=&pctx->cfg;
+    float xy_ratio;
+
+    if(*correl>=pcfg->f_min_pearson_correlation) {
         // RF, If correlation os good, then find average periodicity of the IR signal. If aperiodic, return periodicity of 0
-        rf_signal_periodicity(an_x, BUFFER_SIZE, &n_last_peak_interval, LOWEST_PERIOD, HIGHEST_PERIOD, min_autocorrelation_ratio, f_ir_sumsq, ratio);
+        if(pcfg->n_periodicity_search==RF_PERIODICITY_SEQUENCE) {
+            if(!b_aut_ready)
+                rf_autocorrelation_sequence(pctx->an_x, n_size, pcfg->n_aut_first, pcfg->n_aut_last, pctx->an_aut);
+            rf_signal_periodicity_sequence(pctx->an_aut, pcfg->n_aut_first, &pctx->n_last_peak_interval, pcfg->n_lowest_period, pcfg->n_highest_period, pcfg->f_min_autocorrelation_ratio, f_ir_sumsq, ratio);
+            }
+        else
+            rf_signal_periodicity(pctx->an_x, n_size, &pctx->n_last_peak_interval, pcfg->n_lowest_period, pcfg->n_highest_period, pcfg->f_min_autocorrelation_ratio, f_ir_sumsq, ratio);
         } 
     else 
-        n_last_peak_interval=0;
-    if(n_last_peak_interval!=0) {
-        *pn_heart_rate = (int32_t)(FS60/n_last_peak_interval);
+        pctx->n_last_peak_interval=0;
+    if(pctx->n_last_peak_interval!=0) {
+        *pn_heart_rate = (int32_t)(pcfg->n_fs60/pctx->n_last_peak_interval);
         *pch_hr_valid  = 1;
         } 
     else {
-        n_last_peak_interval=FS;
+        pctx->n_last_peak_interval=pcfg->n_fs;
         *pn_heart_rate = -999; // unable to calculate because signal looks aperiodic
         *pch_hr_valid  = 0;
         *pn_spo2 =  -999 ; // do not use SPO2 from this corrupt signal
@@ -133,22 +332,37 @@ void rf_heart_rate_and_oxygen_saturation(
         }
 }
 
+/**
+* \brief        Mark all outputs invalid
+* \par          Details
+*               Used when a window cannot be evaluated at all, e.g. it is incomplete or flat.
+*
+* \retval       None
+*/
+static void rf_invalidate(float *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid,
+                          float *ratio, float *correl)
+{
+    *pn_heart_rate = -999;
+    *pch_hr_valid  = 0;
+    *pn_spo2 =  -999 ;
+    *pch_spo2_valid  = 0;
+    *ratio = 0.0;
+    *correl = 0.0;
+}
+
 /**
 * \brief        Coefficient beta of linear regression 
 * \par          Details
 *               Compute directional coefficient, beta, of a linear regression of pn_x against mean-centered
-*               point index values (0 to BUFFER_SIZE-1). xmean must equal to (BUFFER_SIZE-1)/2! sum_x2 is 
-*               the sum of squares of the mean-centered index values. 
+*               point index values (0 to n-1). xmean must equal to (n-1)/2, it also gives the length n of pn_x! 
+*               sum_x2 is the sum of squares of the mean-centered index values. 
 *               Robert Fraczkiewicz, 12/22/2017
 * \retval       Beta
 */
 float rf_linear_regression_beta(float *pn_x, float xmean, float sum_x2)
 {
-    float x,beta,*pn_ptr;
-    beta=0.0;
-    for(x=-xmean,pn_ptr=pn_x;x<=xmean;++x,++pn_ptr)
-        beta+=x*(*pn_ptr);
-    return beta/sum_x2;
+    int32_t n_size=(int32_t)(2.0f*xmean+1.5f);
+    return rf_kernel_ramp_dot(pn_x, n_size, -xmean)/sum_x2;
 }
 
 /**
@@ -160,13 +374,37 @@ float rf_linear_regression_beta(float *pn_x, float xmean, float sum_x2)
 */
 float rf_autocorrelation(float *pn_x, int32_t n_size, int32_t n_lag) 
 {
-    int16_t i, n_temp=n_size-n_lag;
-    float sum=0.0,*pn_ptr;
-    if(n_temp<=0) return sum;
-    for (i=0,pn_ptr=pn_x; i<n_temp; ++i,++pn_ptr) {
-        sum += (*pn_ptr)*(*(pn_ptr+n_lag));
+    int32_t n_temp=n_size-n_lag;
+    if(n_temp<=0) return 0.0;
+    return rf_kernel_dot(pn_x, pn_x+n_lag, n_temp)/n_temp;
+}
+
+/**
+* \brief        Autocorrelation sequence
+* \par          Details
+*               Compute the autocorrelation sequence of pn_x for lags n_lag_first to n_lag_last in
+*               one pass over the data: each sample is loaded once and multiplied with the samples
+*               up to n_lag_last behind it, accumulating every lag at once. The cost is
+*               O(n_size*(n_lag_last-n_lag_first+1)) whatever the signal.
+*
+* \param[in]    *pn_x                   - Series
+* \param[in]    n_size                  - Number of samples in pn_x
+* \param[in]    n_lag_first, n_lag_last - Lag range
+* \param[out]   *pn_aut                 - Autocorrelation, pn_aut[k-n_lag_first] for lag k, as rf_autocorrelation
+*
+* \retval       None
+*/
+void rf_autocorrelation_sequence(float *pn_x, int32_t n_size, int32_t n_lag_first, int32_t n_lag_last, float *pn_aut)
+{
+    int32_t i, k, n_last;
+    for(k=n_lag_first; k<=n_lag_last; ++k)
+        pn_aut[k-n_lag_first]=0.0;
+    for(i=0; i+n_lag_first<n_size; ++i) {
+        n_last=(n_lag_last<n_size-1-i) ? n_lag_last : n_size-1-i;
+        rf_kernel_axpy(pn_aut, pn_x+i+n_lag_first, pn_x[i], n_last-n_lag_first+1);
         }
-    return sum/n_temp;
+    for(k=n_lag_first; k<=n_lag_last && k<n_size; ++k)
+        pn_aut[k-n_lag_first]/=n_size-k;
 }
 
 /**
@@ -180,19 +418,52 @@ float rf_autocorrelation(float *pn_x, int32_t n_size, int32_t n_lag)
 * \retval       Average distance between peaks
 */
 void rf_signal_periodicity(float *pn_x, int32_t n_size, int32_t *p_last_periodicity, int32_t n_min_distance, int32_t n_max_distance, float min_aut_ratio, float aut_lag0, float *ratio)
+{
+    rf_periodicity_climb(pn_x, n_size, NULL, 0, p_last_periodicity, n_min_distance, n_max_distance, min_aut_ratio, aut_lag0, ratio);
+}
+
+/**
+* \brief        Signal periodicity from a precomputed autocorrelation sequence
+* \par          Details
+*               Same search as rf_signal_periodicity, over the sequence computed by
+*               rf_autocorrelation_sequence for lags n_min_distance-1 to n_max_distance+1. A last
+*               periodicity outside n_min_distance..n_max_distance starts the search at the
+*               nearest limit.
+*
+* \retval       Average distance between peaks
+*/
+void rf_signal_periodicity_sequence(float *pn_aut, int32_t n_lag_first, int32_t *p_last_periodicity, int32_t n_min_distance, int32_t n_max_distance, float min_aut_ratio, float aut_lag0, float *ratio)
+{
+    if(*p_last_periodicity<n_min_distance)
+        *p_last_periodicity=n_min_distance;
+    else if(*p_last_periodicity>n_max_distance)
+        *p_last_periodicity=n_max_distance;
+    rf_periodicity_climb(NULL, 0, pn_aut, n_lag_first, p_last_periodicity, n_min_distance, n_max_distance, min_aut_ratio, aut_lag0, ratio);
+}
+
+/**
+* \brief        Hill climb over the autocorrelation sequence
+* \par          Details
+*               Common search of rf_signal_periodicity and rf_signal_periodicity_sequence. The
+*               autocorrelation at a lag is taken from pn_aut if given, else computed from pn_x.
+*
+* \retval       Average distance between peaks
+*/
+static void rf_periodicity_climb(float *pn_x, int32_t n_size, float *pn_aut, int32_t n_lag_first, int32_t *p_last_periodicity,
+                                 int32_t n_min_distance, int32_t n_max_distance, float min_aut_ratio, float aut_lag0, float *ratio)
 {
     int32_t n_lag;
     float aut,aut_left,aut_right,aut_save;
     int left_limit_reached=0;
     // Start from the last periodicity computing the corresponding autocorrelation
     n_lag=*p_last_periodicity;
-    aut_save=aut=rf_autocorrelation(pn_x, n_size, n_lag);
+    aut_save=aut=rf_aut_at(pn_x, n_size, pn_aut, n_lag_first, n_lag);
     // Is autocorrelation one lag to the left greater?
     aut_left=aut;
     do {
         aut=aut_left;
         n_lag--;
-        aut_left=rf_autocorrelation(pn_x, n_size, n_lag);
+        aut_left=rf_aut_at(pn_x, n_size, pn_aut, n_lag_first, n_lag);
         } 
     while(aut_left>aut && n_lag>n_min_distance);
     // Restore lag of the highest aut
@@ -208,7 +479,7 @@ void rf_signal_periodicity(float *pn_x, int32_t n_size, int32_t *p_last_periodic
         do {
             aut=aut_right;
             n_lag++;
-            aut_right=rf_autocorrelation(pn_x, n_size, n_lag);
+            aut_right=rf_aut_at(pn_x, n_size, pn_aut, n_lag_first, n_lag);
             } 
         while(aut_right>aut && n_lag<n_max_distance);
         // Restore lag of the highest aut
@@ -234,14 +505,7 @@ void rf_signal_periodicity(float *pn_x, int32_t n_size, int32_t *p_last_periodic
 */
 float rf_rms(float *pn_x, int32_t n_size, float *sumsq) 
 {
-    int16_t i;
-    float r,*pn_ptr;
-    (*sumsq)=0.0;
-    for (i=0,pn_ptr=pn_x; i<n_size; ++i,++pn_ptr) {
-        r=(*pn_ptr);
-        (*sumsq) += r*r;
-        }
-    (*sumsq)/=n_size; // This corresponds to autocorrelation at lag=0
+    (*sumsq)=rf_kernel_sumsq(pn_x, n_size)/n_size; // This corresponds to autocorrelation at lag=0
     return sqrt(*sumsq);
 }
 
@@ -254,13 +518,319 @@ float rf_rms(float *pn_x, int32_t n_size, float *sumsq)
 */
 float rf_Pcorrelation(float *pn_x, float *pn_y, int32_t n_size)
 {
-    int16_t i;
-    float r,*x_ptr,*y_ptr;
-    r=0.0;
-    for (i=0,x_ptr=pn_x,y_ptr=pn_y; i<n_size; ++i,++x_ptr,++y_ptr) {
-        r+=(*x_ptr)*(*y_ptr);
+    return rf_kernel_dot(pn_x, pn_y, n_size)/n_size;
+}
+
+/**
+* \brief        Buffer space of a streaming estimator
+* \par          Details
+*               Size of the buffer rf_stream_init needs for the IR and red sample rings and the
+*               detrended IR window. The streaming estimator has no use for a detrended red window.
+*
+* \param[in]    *pcfg   - Configuration, or NULL for rf_config_default
+*
+* \retval       Size in bytes
+*/
+size_t rf_stream_buffer_size(const rf_config *pcfg)
+{
+    int32_t n_size=pcfg ? pcfg->n_buffer_size : BUFFER_SIZE;
+    return 2*(size_t)n_size*sizeof(uint32_t)+(size_t)n_size*sizeof(float);
+}
+
+/**
+* \brief        Initialize a streaming estimator
+* \par          Details
+*               Empties the sample ring and resets the running sums and the periodicity tracking.
+*
+* \param[out]   *ps                 - Streaming estimator state
+* \param[in]    *pcfg               - Configuration, or NULL for rf_config_default
+* \param[in]    n_output_interval   - Number of new samples between two estimates, e.g. n_fs for 1 Hz output
+* \param[in]    *p_buffer           - Buffer of rf_stream_buffer_size(pcfg) bytes, 4-byte aligned, owned by
+*                                     the caller for the lifetime of the estimator
+*
+* \retval       None
+*/
+void rf_stream_init(rf_stream *ps, const rf_config *pcfg, int32_t n_output_interval, void *p_buffer)
+{
+    int32_t n_size;
+
+    rf_init(&ps->ctx, pcfg, NULL);
+    n_size=ps->ctx.cfg.n_buffer_size;
+    ps->aun_ir=(uint32_t *)p_buffer;
+    ps->aun_red=ps->aun_ir+n_size;
+    ps->ctx.an_x=(float *)(ps->aun_red+n_size);
+    ps->ctx.an_y=NULL;
+    ps->n_head=0;
+    ps->n_count=0;
+    ps->n_output_interval=(n_output_interval>0) ? n_output_interval : 1;
+    ps->n_since_output=0;
+    ps->n_sum_ir=ps->n_sum_red=0;
+    ps->n_sum_x_ir=ps->n_sum_x_red=0;
+    ps->n_sumsq_ir=ps->n_sumsq_red=0;
+    ps->n_sum_ir_red=0;
+    memset(ps->an_sum_lag_ir, 0, sizeof(ps->an_sum_lag_ir));
+}
+
+/**
+* \brief        Add a sample to a streaming estimator
+* \par          Details
+*               Appends the sample to the window and, once the window of n_buffer_size samples is full, drops the oldest
+*               sample. The running sums are updated in O(1). Shifting the window moves every
+*               remaining sample one place to the left, which lowers its X by 2, hence
+*               sum(X*y)' = sum(X*y) - 2*sum(y) + (N-1)*(y_oldest + y_new) + 2*y_oldest.
+*
+* \param[in,out] *ps    - Streaming estimator state
+* \param[in]    un_ir   - New IR sample
+* \param[in]    un_red  - New red sample
+*
+* \retval       1 if an estimate is due, see rf_stream_estimate
+*/
+int rf_stream_push(rf_stream *ps, uint32_t un_ir, uint32_t un_red)
+{
+    const rf_config *pcfg=&ps->ctx.cfg;
+    const int32_t n_size=pcfg->n_buffer_size;
+    const int b_lags=(pcfg->n_periodicity_search==RF_PERIODICITY_SEQUENCE);
+    int64_t n_ir=un_ir, n_red=un_red, n_old_ir, n_old_red, n_pair_ir;
+    int32_t n_tail, k, n_pos;
+
+    if(ps->n_count<n_size) {
+        // Window still filling up: the new sample takes point index n_count
+        ps->aun_ir[ps->n_count]=un_ir;
+        ps->aun_red[ps->n_count]=un_red;
+        ps->n_sum_x_ir += (2*ps->n_count-(n_size-1))*n_ir;
+        ps->n_sum_x_red += (2*ps->n_count-(n_size-1))*n_red;
+        // The new sample pairs with the one k places before it
+        for(k=pcfg->n_aut_first; b_lags && k<=pcfg->n_aut_last && k<=ps->n_count; ++k)
+            ps->an_sum_lag_ir[k-pcfg->n_aut_first] += (int64_t)ps->aun_ir[ps->n_count-k]*n_ir;
+        ps->n_count++;
+        }
+    else {
+        n_tail=ps->n_head;
+        n_old_ir=ps->aun_ir[n_tail];
+        n_old_red=ps->aun_red[n_tail];
+        // Lag k loses the pair of point indices (0,k) and gains (N-k,N), N being the new sample
+        for(k=pcfg->n_aut_first; b_lags && k<=pcfg->n_aut_last && k<n_size; ++k) {
+            n_pos=n_tail+k;
+            if(n_pos>=n_size)
+                n_pos-=n_size;
+            if(k==0)
+                n_pair_ir=n_ir;
+            else {
+                n_pair_ir=n_tail+n_size-k;
+                if(n_pair_ir>=n_size)
+                    n_pair_ir-=n_size;
+                n_pair_ir=ps->aun_ir[n_pair_ir];
+                }
+            ps->an_sum_lag_ir[k-pcfg->n_aut_first] += n_pair_ir*n_ir - n_old_ir*ps->aun_ir[n_pos];
+            }
+        ps->n_sum_x_ir += (n_size-1)*(n_old_ir+n_ir) - 2*ps->n_sum_ir + 2*n_old_ir;
+        ps->n_sum_x_red += (n_size-1)*(n_old_red+n_red) - 2*ps->n_sum_red + 2*n_old_red;
+        ps->n_sum_ir -= n_old_ir;
+        ps->n_sum_red -= n_old_red;
+        ps->n_sumsq_ir -= n_old_ir*n_old_ir;
+        ps->n_sumsq_red -= n_old_red*n_old_red;
+        ps->n_sum_ir_red -= n_old_ir*n_old_red;
+        ps->aun_ir[n_tail]=un_ir;
+        ps->aun_red[n_tail]=un_red;
+        ps->n_head=(n_tail+1)%n_size;
+        }
+    ps->n_sum_ir += n_ir;
+    ps->n_sum_red += n_red;
+    ps->n_sumsq_ir += n_ir*n_ir;
+    ps->n_sumsq_red += n_red*n_red;
+    ps->n_sum_ir_red += n_ir*n_red;
+    ps->n_since_output++;
+    return rf_stream_samples_until_output(ps)==0;
+}
+
+/**
+* \brief        Samples needed before the next estimate
+* \par          Details
+*               Lets the caller read exactly as many samples as it can push before an estimate is due.
+*
+* \retval       Number of samples to push before rf_stream_push returns 1, 0 if an estimate is due now
+*/
+int32_t rf_stream_samples_until_output(const rf_stream *ps)
+{
+    int32_t n_fill=ps->ctx.cfg.n_buffer_size-ps->n_count;
+    int32_t n_interval=ps->n_output_interval-ps->n_since_output;
+    if(n_interval<0)
+        n_interval=0;
+    return (n_fill>n_interval) ? n_fill : n_interval;
+}
+
+/**
+* \brief        Mean square of a detrended streaming window
+* \par          Details
+*               sum(d^2)/N = (sum(y^2) - sum(y)^2/N - beta^2*sum_X2)/N, see rf_stream_estimate.
+*               N*sum(y^2)-sum(y)^2 is exact in 64 bits for 18-bit samples.
+*
+* \param[in]    n_size  - Number of samples N in the window
+* \param[in]    n_sumsq - sum(y^2)
+* \param[in]    n_sum   - sum(y)
+* \param[in]    beta    - Slope of the linear regression of the window
+* \param[in]    sum_X2  - Sum of squares of the mean-centered point indices
+*
+* \retval       Mean square of the detrended signal, 0 or less for a flat one
+*/
+static double rf_stream_detrended_sumsq(int32_t n_size, int64_t n_sumsq, int64_t n_sum, double beta, double sum_X2)
+{
+    return ((double)(n_size*n_sumsq-n_sum*n_sum)/n_size - beta*beta*sum_X2)/n_size;
+}
+
+/**
+* \brief        Signal levels of the current window of a streaming estimator
+* \par          Details
+*               DC level and AC RMS of both channels, from the running sums in O(1). Meant for
+*               LED current and ADC range control, which keeps the DC level inside the ADC range.
+*
+* \param[in]    *ps    - Streaming estimator state
+* \param[out]   *pl    - Levels of the window
+*
+* \retval       1 on success, 0 if the window is not full yet
+*/
+int rf_stream_levels(const rf_stream *ps, rf_levels *pl)
+{
+    const int32_t n_size=ps->ctx.cfg.n_buffer_size;
+    const double sum_X2=ps->ctx.cfg.f_sum_X2;
+    double beta_ir, beta_red, f_ir_sumsq, f_red_sumsq;
+
+    if(ps->n_count<n_size)
+        return 0;
+
+    beta_ir=(double)ps->n_sum_x_ir/(2.0*sum_X2);
+    beta_red=(double)ps->n_sum_x_red/(2.0*sum_X2);
+    f_ir_sumsq=rf_stream_detrended_sumsq(n_size, ps->n_sumsq_ir, ps->n_sum_ir, beta_ir, sum_X2);
+    f_red_sumsq=rf_stream_detrended_sumsq(n_size, ps->n_sumsq_red, ps->n_sum_red, beta_red, sum_X2);
+    pl->f_dc_ir=(float)((double)ps->n_sum_ir/n_size);
+    pl->f_dc_red=(float)((double)ps->n_sum_red/n_size);
+    pl->f_ac_ir=(f_ir_sumsq>0.0) ? (float)sqrt(f_ir_sumsq) : 0.0f;
+    pl->f_ac_red=(f_red_sumsq>0.0) ? (float)sqrt(f_red_sumsq) : 0.0f;
+    return 1;
+}
+
+/**
+* \brief        Calculate the heart rate and SpO2 level over the current window of a streaming estimator
+* \par          Details
+*               DC levels, regression slopes, RMS values and the red/IR correlation come straight from
+*               the running sums in O(1):
+*               sum(d^2) = sum(y^2) - sum(y)^2/N - beta^2*sum_X2 for the detrended signal d.
+*               Only the periodicity search walks the window, and only when the red/IR correlation
+*               is good enough for the heart rate to be evaluated. With RF_PERIODICITY_SEQUENCE it
+*               does not walk the window either, see rf_stream_autocorrelation_sequence.
+*
+* \param[in,out] *ps    - Streaming estimator state, must hold a full window of n_buffer_size samples
+* \param[out]   *pn_spo2 .. *correl - see rf_heart_rate_and_oxygen_saturation
+*
+* \retval       None
+*/
+void rf_stream_estimate(rf_stream *ps, float *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid, float *ratio, float *correl)
+{
+    const int32_t n_size=ps->ctx.cfg.n_buffer_size;
+    const int b_lags=(ps->ctx.cfg.n_periodicity_search==RF_PERIODICITY_SEQUENCE);
+    const double sum_X2=ps->ctx.cfg.f_sum_X2;
+    int32_t k, n_idx;
+    double f_ir_mean, f_red_mean, beta_ir, beta_red;
+    double f_ir_sumsq, f_red_sumsq, f_cross;
+    float x, *ptr_x;
+
+    ps->n_since_output=0;
+    if(ps->n_count<n_size) {
+        rf_invalidate(pn_spo2, pch_spo2_valid, pn_heart_rate, pch_hr_valid, ratio, correl); // not enough samples yet
+        return;
+        }
+
+    f_ir_mean=(double)ps->n_sum_ir/n_size;
+    f_red_mean=(double)ps->n_sum_red/n_size;
+    // sum(X*y) uses X=2x, hence the factor of 2
+    beta_ir=(double)ps->n_sum_x_ir/(2.0*sum_X2);
+    beta_red=(double)ps->n_sum_x_red/(2.0*sum_X2);
+
+    f_ir_sumsq=rf_stream_detrended_sumsq(n_size, ps->n_sumsq_ir, ps->n_sum_ir, beta_ir, sum_X2);
+    f_red_sumsq=rf_stream_detrended_sumsq(n_size, ps->n_sumsq_red, ps->n_sum_red, beta_red, sum_X2);
+    f_cross=((double)(n_size*ps->n_sum_ir_red-ps->n_sum_ir*ps->n_sum_red)/n_size - beta_ir*beta_red*sum_X2)/n_size;
+    if(f_ir_sumsq<=0.0 || f_red_sumsq<=0.0) {
+        rf_invalidate(pn_spo2, pch_spo2_valid, pn_heart_rate, pch_hr_valid, ratio, correl); // flat signal
+        return;
+        }
+
+    // Calculate Pearson correlation between red and IR
+    *correl=(float)(f_cross/sqrt(f_red_sumsq*f_ir_sumsq));
+    if(*correl>=ps->ctx.cfg.f_min_pearson_correlation && b_lags)
+        rf_stream_autocorrelation_sequence(ps, f_ir_mean, beta_ir);
+    else if(*correl>=ps->ctx.cfg.f_min_pearson_correlation) {
+        // Unroll the ring into the detrended IR window for the periodicity search
+        for(k=0,n_idx=ps->n_head,x=-ps->ctx.cfg.f_mean_X,ptr_x=ps->ctx.an_x; k<n_size; ++k,++x,++ptr_x) {
+            *ptr_x=(float)(ps->aun_ir[n_idx]-f_ir_mean-beta_ir*x);
+            if(++n_idx==n_size)
+                n_idx=0;
+            }
         }
-    r/=n_size;
-    return r;
+    rf_estimate(&ps->ctx, n_size, (float)f_ir_mean, (float)f_red_mean,
+                (float)sqrt(f_ir_sumsq), (float)sqrt(f_red_sumsq), (float)f_ir_sumsq, b_lags,
+                pn_spo2, pch_spo2_valid, pn_heart_rate, pch_hr_valid, ratio, correl);
 }
 
+/**
+* \brief        Autocorrelation sequence of a streaming window
+* \par          Details
+*               Fills ctx.an_aut as rf_autocorrelation_sequence would for the detrended IR window,
+*               in O(n_aut_last) instead of O(N*L). For lag k and M=N-k pairs, with d = y-m-b*x and
+*               x = i-(N-1)/2,
+*               sum(d_i*d_(i+k)) = R - m*H - b*(Q+P-(N-1)/2*H) + M*m^2 + b^2*sum(x_i*x_(i+k))
+*               where R = sum(y_i*y_(i+k)) is kept up to date by rf_stream_push, H = sum(y_i+y_(i+k)),
+*               Q = sum((i+k)*y_i) and P = sum(i*y_(i+k)). H, Q and P follow from the window sums and
+*               the sums over its first and last k samples. sum(x_i+x_(i+k)) is 0, so m*b drops out.
+*
+* \param[in,out] *ps        - Streaming estimator state, must hold a full window
+* \param[in]    f_ir_mean   - Mean of the IR window
+* \param[in]    beta_ir     - Slope of the IR window against x
+*
+* \retval       None
+*/
+static void rf_stream_autocorrelation_sequence(rf_stream *ps, double f_ir_mean, double beta_ir)
+{
+    const rf_config *pcfg=&ps->ctx.cfg;
+    const int32_t n_size=pcfg->n_buffer_size;
+    const double c=(n_size-1)/2.0;
+    int64_t n_sum=ps->n_sum_ir, n_sum_i;
+    int64_t n_pre=0, n_pre_i=0, n_suf=0, n_suf_i=0;  // sum(y) and sum(i*y) over the first and the last k samples
+    int64_t H, Q, P, y;
+    int32_t k, n_pos, M;
+    double f_sum_u, f_sum_u2, f_dd;
+
+    // sum(i*y) from sum(X*y), X=2i-(N-1)
+    n_sum_i=(ps->n_sum_x_ir+(int64_t)(n_size-1)*n_sum)/2;
+    for(k=0; k<=pcfg->n_aut_last; ++k) {
+        if(k>=n_size) {
+            ps->ctx.an_aut[k-pcfg->n_aut_first]=0.0; // no pairs, as in rf_autocorrelation
+            continue;
+            }
+        if(k>=pcfg->n_aut_first) {
+            M=n_size-k;
+            H=2*n_sum-n_pre-n_suf;
+            Q=(n_sum_i-n_suf_i)+k*(n_sum-n_suf);
+            P=(n_sum_i-n_pre_i)-k*(n_sum-n_pre);
+            // sum(x_i*x_(i+k)) = sum(u^2)+k*sum(u), u = i-c for i=0 to M-1
+            f_sum_u=M*(M-1)/2.0-M*c;
+            f_sum_u2=(M-1.0)*M*(2.0*M-1.0)/6.0-c*M*(M-1.0)+M*c*c;
+            f_dd=(double)ps->an_sum_lag_ir[k-pcfg->n_aut_first] - f_ir_mean*H
+                 - beta_ir*(double)(2*(Q+P)-(int64_t)(n_size-1)*H)/2.0
+                 + M*f_ir_mean*f_ir_mean + beta_ir*beta_ir*(f_sum_u2+k*f_sum_u);
+            ps->ctx.an_aut[k-pcfg->n_aut_first]=(float)(f_dd/M);
+            }
+        // Extend the head and tail sums by point indices k and N-1-k
+        n_pos=ps->n_head+k;
+        if(n_pos>=n_size)
+            n_pos-=n_size;
+        y=ps->aun_ir[n_pos];
+        n_pre+=y;
+        n_pre_i+=k*y;
+        n_pos=ps->n_head+n_size-1-k;
+        if(n_pos>=n_size)
+            n_pos-=n_size;
+        y=ps->aun_ir[n_pos];
+        n_suf+=y;
+        n_suf_i+=(n_size-1-k)*y;
+        }
+}
@@ -43,14 +43,18 @@
  * described in this code's Instructable. Typically, different sampling rate
  * and/or sample length would require these paramteres to be adjusted.
  */
-#define ST 4      // Sampling time in s. WARNING: if you change ST, then you MUST recalcuate the sum_X2 parameter below!
-#define FS 25     // Sampling frequency in Hz. WARNING: if you change FS, then you MUST recalcuate the sum_X2 parameter below!
+#define ST 4      // Default sampling time in s. Can be changed at runtime with rf_configure.
+#define FS 25     // Default sampling frequency in Hz. Can be changed at runtime with rf_configure.
+
+// Limits for rf_configure. They size the sample and scratch buffers.
+#define RF_MAX_ST 8
+#define RF_MAX_FS 100
+#define RF_MAX_BUFFER_SIZE (RF_MAX_FS*RF_MAX_ST)
+#define RF_MAX_AUT_LAGS (RF_MAX_FS*60/MIN_HR+3)  // lags n_lowest_period-1 to n_highest_period+1, see rf_configure
 
 // Sum of squares of ST*FS numbers from -mean_X (see below) to +mean_X incremented be one. For example, given ST=4 and FS=25,
 // the sum consists of 100 terms: (-49.5)^2 + (-48.5)^2 + (-47.5)^2 + ... + (47.5)^2 + (48.5)^2 + (49.5)^2
-// The sum is symmetrc, so you can evaluate it by multiplying its positive half by 2. It is precalcuated here for enhanced 
-// performance.
-//const float sum_X2 = 83325; // WARNING: you MUST recalculate this sum if you changed either ST or FS above!
+// rf_configure evaluates it in closed form, N*(N^2-1)/12 with N=ST*FS, so it no longer has to be recalculated by hand.
 
 #define MAX_HR 125  // Maximal heart rate. To eliminate erroneous signals, calculated HR should never be greater than this number.
 #define MIN_HR 40   // Minimal heart rate. To eliminate erroneous signals, calculated HR should never be lower than this number.
@@ -69,16 +73,91 @@
 // Good quality signals must have their correlation coefficient greater than this minimum.
 //const float min_pearson_correlation = 0.8;
 
+// Periodicity search, see rf_config.n_periodicity_search.
+// RF_PERIODICITY_HILL_CLIMB evaluates the autocorrelation lag by lag, starting from the last periodicity. Cheap while
+// the heart rate is tracked well, but up to O(N*L) per window for N samples and L lags when it is not.
+// RF_PERIODICITY_SEQUENCE computes the whole autocorrelation sequence over the lag range first, at a fixed O(N*L)
+// per window in one pass over the data; the streaming estimator keeps it up to date at O(L) per sample instead.
+// Both walk the sequence the same way, so they find the same period.
+#define RF_PERIODICITY_HILL_CLIMB 0
+#define RF_PERIODICITY_SEQUENCE   1
+
 /*
  * Derived parameters 
  * Do not touch these! 
- * 
+ * These are for the default FS and ST; rf_configure derives the same values for other settings.
  */
-#define  BUFFER_SIZE    FS*ST                      // Number of smaples in a single batch
-#define  FS60           FS*60                      // Conversion factor for heart rate from bps to bpm
-#define  LOWEST_PERIOD  FS60/MAX_HR                // Minimal distance between peaks
-#define  HIGHEST_PERIOD FS60/MIN_HR                // Maximal distance between peaks
-#define  INIT_INTERVAL  FS60/TYPICAL_HR            // Seed value for heart rate determination routine
+#define  BUFFER_SIZE    (FS*ST)                    // Number of smaples in a single batch
+#define  FS60           (FS*60)                    // Conversion factor for heart rate from bps to bpm
+#define  LOWEST_PERIOD  (FS60/MAX_HR)              // Minimal distance between peaks
+#define  HIGHEST_PERIOD (FS60/MIN_HR)              // Maximal distance between peaks
+#define  INIT_INTERVAL  (FS60/TYPICAL_HR)          // Seed value for heart rate determination routine
+
+/*
+ * Algorithm context
+ * Holds the state that carries over from one window to the next, the scratch buffers and the
+ * configuration of one sensor channel. See rf_init. The window-sized scratch buffers are
+ * supplied by the caller, rf_scratch_size bytes for a given configuration, so memory use
+ * follows the configured window instead of the largest one.
+ */
+typedef struct {
+    float   f_min_autocorrelation_ratio; // see min_autocorrelation_ratio above
+    float   f_min_pearson_correlation;   // see min_pearson_correlation above
+    int32_t n_periodicity_search;        // RF_PERIODICITY_HILL_CLIMB or RF_PERIODICITY_SEQUENCE
+    // Set by rf_configure
+    int32_t n_fs;                        // sampling frequency in Hz
+    int32_t n_st;                        // sampling time in s
+    int32_t n_buffer_size;               // number of samples in a window, n_fs*n_st
+    int32_t n_fs60;                      // conversion factor for heart rate from bps to bpm
+    float   f_mean_X;                    // mean of the point indices 0 to n_buffer_size-1
+    float   f_sum_X2;                    // sum of squares of the mean-centered point indices
+    int32_t n_lowest_period;             // minimal distance between peaks, in samples
+    int32_t n_highest_period;            // maximal distance between peaks, in samples
+    int32_t n_init_interval;             // seed value for the periodicity search, in samples
+    int32_t n_aut_first, n_aut_last;     // lag range of the autocorrelation sequence
+} rf_config;
+
+typedef struct {
+    rf_config cfg;
+    int32_t   n_last_peak_interval;      // periodicity tracking state
+    float     *an_x;                     // detrended IR window, n_buffer_size samples
+    float     *an_y;                     // detrended red window, n_buffer_size samples
+    float     an_aut[RF_MAX_AUT_LAGS];   // autocorrelation sequence of an_x, lags n_aut_first to n_aut_last
+} rf_context;
+
+/*
+ * Streaming estimator
+ * Keeps the last n_buffer_size samples in a ring together with running sums, so the
+ * statistics of the sliding window are updated in O(1) per sample instead of being
+ * recomputed from scratch for every batch. The sums are kept in exact integer arithmetic
+ * on the raw 18-bit samples, so they never drift. X is twice the mean-centered point
+ * index, 2k-(n_buffer_size-1), which keeps it an integer.
+ * The rings and the detrended IR window live in a caller-supplied buffer of
+ * rf_stream_buffer_size bytes.
+ */
+typedef struct {
+    uint32_t *aun_ir;               // ring of the last n_buffer_size IR samples
+    uint32_t *aun_red;              // ring of the last n_buffer_size red samples
+    int32_t  n_head;                // ring index of the oldest sample
+    int32_t  n_count;               // number of samples in the ring
+    int32_t  n_output_interval;     // samples between two estimates
+    int32_t  n_since_output;        // samples pushed since the last estimate
+    int64_t  n_sum_ir, n_sum_red;         // sum of y
+    int64_t  n_sum_x_ir, n_sum_x_red;     // sum of X*y, the linear regression numerator
+    int64_t  n_sumsq_ir, n_sumsq_red;     // sum of y^2
+    int64_t  n_sum_ir_red;                // sum of ir*red
+    int64_t  an_sum_lag_ir[RF_MAX_AUT_LAGS]; // sum of ir_i*ir_(i+k) for lags k = n_aut_first to n_aut_last,
+                                             // kept only for RF_PERIODICITY_SEQUENCE
+    rf_context ctx;                 // periodicity tracking and the detrended IR window
+} rf_stream;
+
+/*
+ * Signal levels of a window, see rf_stream_levels
+ */
+typedef struct {
+    float f_dc_ir, f_dc_red;        // mean of the window, in ADC counts
+    float f_ac_ir, f_ac_red;        // RMS of the detrended window, in ADC counts
+} rf_levels;
 
 #ifdef __cplusplus
 extern "C" {
@@ -86,11 +165,27 @@ extern "C" {
 
 void rf_heart_rate_and_oxygen_saturation(uint32_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint32_t *pun_red_buffer, float *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, 
                                         int8_t *pch_hr_valid, float *ratio, float *correl);
+void rf_reset_default_context(void);
+void rf_config_default(rf_config *pcfg);
+int  rf_configure(rf_config *pcfg, int32_t n_fs, int32_t n_st);
+size_t rf_scratch_size(const rf_config *pcfg);
+void rf_init(rf_context *pctx, const rf_config *pcfg, float *pf_scratch);
+void rf_process(rf_context *pctx, uint32_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint32_t *pun_red_buffer, float *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, 
+                int8_t *pch_hr_valid, float *ratio, float *correl);
 float rf_linear_regression_beta(float *pn_x, float xmean, float sum_x2);
 float rf_autocorrelation(float *pn_x, int32_t n_size, int32_t n_lag);
 float rf_rms(float *pn_x, int32_t n_size, float *sumsq);
 float rf_Pcorrelation(float *pn_x, float *pn_y, int32_t n_size);
 void  rf_signal_periodicity(float *pn_x, int32_t n_size, int32_t *p_last_periodicity, int32_t n_min_distance, int32_t n_max_distance, float min_aut_ratio, float aut_lag0, float *ratio);
+void  rf_autocorrelation_sequence(float *pn_x, int32_t n_size, int32_t n_lag_first, int32_t n_lag_last, float *pn_aut);
+void  rf_signal_periodicity_sequence(float *pn_aut, int32_t n_lag_first, int32_t *p_last_periodicity, int32_t n_min_distance, int32_t n_max_distance, float min_aut_ratio, float aut_lag0, float *ratio);
+
+size_t  rf_stream_buffer_size(const rf_config *pcfg);
+void    rf_stream_init(rf_stream *ps, const rf_config *pcfg, int32_t n_output_interval, void *p_buffer);
+int     rf_stream_push(rf_stream *ps, uint32_t un_ir, uint32_t un_red);
+int32_t rf_stream_samples_until_output(const rf_stream *ps);
+int     rf_stream_levels(const rf_stream *ps, rf_levels *pl);
+void    rf_stream_estimate(rf_stream *ps, float *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid, float *ratio, float *correl);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,450 @@
+/*
+ * Fixed-point variant of the heart rate and SpO2 algorithm in algorithm_by_RF.c,
+ * for cores without (or without a fast) floating point unit.
+ *
+ * The steps are the same as in rf_process. Only the arithmetic differs:
+ * - DC removal and detrending are done on N*y, N being the window length, so the mean and
+ *   the regression are exact integer sums. X is twice the mean-centered point index,
+ *   2k-(N-1), as in the streaming estimator.
+ * - The detrended signals are scaled to int16_t with one exponent per signal (block floating
+ *   point). All sums of products are then exact in int64_t.
+ * - Square roots and ratios are computed from normalized mantissas, so no precision is lost
+ *   for weak signals.
+ * Apart from converting the two thresholds in rf_q_init, no floating point is used.
+ */
+#include "algorithm_by_RF_q.h"
+
+#define RF_Q_SPO2_A  (-2953052)  // -45.060 in Q16
+#define RF_Q_SPO2_B  1989280     //  30.354 in Q16
+#define RF_Q_SPO2_C  6215762     //  94.845 in Q16
+#define RF_Q_RATIO_MIN 655       //  0.02 in Q15, lower boundary of applicability of the SpO2 formula
+#define RF_Q_RATIO_MAX 60293     //  1.84 in Q15, upper boundary of applicability of the SpO2 formula
+#define RF_Q_INVALID   (-999)
+
+// Context behind rf_q_heart_rate_and_oxygen_saturation, for callers that process a single channel
+static rf_q_context rf_q_default_context;
+static int16_t rf_q_default_scratch[BUFFER_SIZE];
+static int rf_q_default_context_ready=0;
+
+static void rf_q_invalidate(int32_t *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid,
+                            int32_t *ratio, int32_t *correl);
+static int32_t rf_q_block_shift(uint32_t un_max);
+static uint32_t rf_q_isqrt(uint64_t un_x);
+static uint32_t rf_q_sqrt_norm(uint64_t un_x, int32_t *pn_exp);
+static int32_t rf_q_div_q15(int64_t n_num, int64_t n_den, int32_t n_exp);
+static int64_t rf_q_autocorrelation(const int16_t *pn_x, int32_t n_size, int32_t n_lag);
+static void rf_q_signal_periodicity(const int16_t *pn_x, int32_t n_size, int32_t *p_last_periodicity, int32_t n_min_distance,
+                                    int32_t n_max_distance, int32_t n_min_aut_ratio, int64_t n_aut_lag0, int32_t *ratio);
+
+/**
+* \brief        Scratch space of a fixed-point algorithm context
+*
+* \param[in]    *pcfg   - Configuration, or NULL for rf_config_default
+*
+* \retval       Size in bytes of the buffer rf_q_init needs
+*/
+size_t rf_q_scratch_size(const rf_config *pcfg)
+{
+    int32_t n_size=pcfg ? pcfg->n_buffer_size : BUFFER_SIZE;
+    return (size_t)n_size*sizeof(int16_t);
+}
+
+/**
+* \brief        Initialize a fixed-point algorithm context
+* \par          Details
+*               See rf_init. The thresholds of the configuration are converted to Q15 here, once.
+*
+* \param[out]   *pctx       - Context to initialize
+* \param[in]    *pcfg       - Configuration, or NULL for rf_config_default
+* \param[in]    *pn_scratch - Scratch space of rf_q_scratch_size(pcfg) bytes, owned by the caller for
+*                             the lifetime of the context
+*
+* \retval       None
+*/
+void rf_q_init(rf_q_context *pctx, const rf_config *pcfg, int16_t *pn_scratch)
+{
+    if(pcfg)
+        pctx->cfg=*pcfg;
+    else
+        rf_config_default(&pctx->cfg);
+    pctx->n_min_autocorrelation_ratio=(int32_t)(pctx->cfg.f_min_autocorrelation_ratio*RF_Q15_ONE+0.5f);
+    pctx->n_min_pearson_correlation=(int32_t)(pctx->cfg.f_min_pearson_correlation*RF_Q15_ONE+0.5f);
+    pctx->n_last_peak_interval=pctx->cfg.n_init_interval;
+    pctx->an_x=pn_scratch;
+}
+
+/**
+* \brief        Calculate the heart rate and SpO2 level in fixed point
+* \par          Details
+*               Fixed-point counterpart of rf_heart_rate_and_oxygen_saturation. See
+*               algorithm_by_RF_q.h for the output formats and the tolerance.
+*
+* \param[in]    *pun_ir_buffer          - IR sensor data buffer
+* \param[in]    n_ir_buffer_length      - IR sensor data buffer length
+* \param[in]    *pun_red_buffer         - Red sensor data buffer
+* \param[out]    *pn_spo2               - Calculated SpO2 value, Q16
+* \param[out]    *pch_spo2_valid        - 1 if the calculated SpO2 value is valid
+* \param[out]    *pn_heart_rate         - Calculated heart rate value
+* \param[out]    *pch_hr_valid          - 1 if the calculated heart rate value is valid
+* \param[out]    *ratio                 - Autocorrelation ratio at the detected period, Q15
+* \param[out]    *correl                - Pearson correlation between red and IR, Q15
+*
+* \retval       None
+*/
+void rf_q_heart_rate_and_oxygen_saturation(
+    uint32_t *pun_ir_buffer,
+    int32_t n_ir_buffer_length,
+    uint32_t *pun_red_buffer,
+    int32_t *pn_spo2,
+    int8_t *pch_spo2_valid,
+    int32_t *pn_heart_rate,
+    int8_t *pch_hr_valid,
+    int32_t *ratio, int32_t *correl)
+{
+    if(!rf_q_default_context_ready) {
+        rf_q_init(&rf_q_default_context, NULL, rf_q_default_scratch);
+        rf_q_default_context_ready=1;
+        }
+    rf_q_process(&rf_q_default_context, pun_ir_buffer, n_ir_buffer_length, pun_red_buffer,
+                 pn_spo2, pch_spo2_valid, pn_heart_rate, pch_hr_valid, ratio, correl);
+}
+
+/**
+* \brief        Calculate the heart rate and SpO2 level for one channel in fixed point
+* \par          Details
+*               Fixed-point counterpart of rf_process. n_ir_buffer_length must be the configured
+*               n_buffer_size.
+*
+* \param[in,out] *pctx                  - Context of the channel, see rf_q_init
+* \param[in]    *pun_ir_buffer .. *correl - see rf_q_heart_rate_and_oxygen_saturation
+*
+* \retval       None
+*/
+void rf_q_process(
+    rf_q_context *pctx,
+    uint32_t *pun_ir_buffer,
+    int32_t n_ir_buffer_length,
+    uint32_t *pun_red_buffer,
+    int32_t *pn_spo2,
+    int8_t *pch_spo2_valid,
+    int32_t *pn_heart_rate,
+    int8_t *pch_hr_valid,
+    int32_t *ratio, int32_t *correl)
+{
+    const rf_config *pcfg=&pctx->cfg;
+    const int32_t n_size=pcfg->n_buffer_size;
+    int32_t k, X;
+    int64_t n_sum_ir, n_sum_red, n_sum_x_ir, n_sum_x_red, n_sum_X2;
+    int64_t n_beta_ir, n_beta_red, n_v_ir, n_v_red;
+    int64_t n_sumsq_ir, n_sumsq_red, n_sum_ir_red;
+    uint32_t un_max_ir, un_max_red;
+    int32_t n_shift_ir, n_shift_red, n_exp_ir, n_exp_red;
+    uint32_t un_rms_ir, un_rms_red;
+    int32_t n_x, n_y, n_xy_ratio;
+    int16_t *an_x=pctx->an_x;
+
+    if(n_ir_buffer_length!=n_size) {
+        rf_q_invalidate(pn_spo2, pch_spo2_valid, pn_heart_rate, pch_hr_valid, ratio, correl);
+        return;
+        }
+
+    // DC sums and linear regression numerators. Since X sums to 0, sum(X*(N*y-sum(y))) = N*sum(X*y)
+    n_sum_ir=n_sum_red=n_sum_x_ir=n_sum_x_red=0;
+    for(k=0,X=1-n_size; k<n_size; ++k,X+=2) {
+        n_sum_ir += pun_ir_buffer[k];
+        n_sum_red += pun_red_buffer[k];
+        n_sum_x_ir += (int64_t)X*pun_ir_buffer[k];
+        n_sum_x_red += (int64_t)X*pun_red_buffer[k];
+        }
+
+    // Slope of N*y against X in Q20. sum(X^2) = N*(N^2-1)/3
+    n_sum_X2=(int64_t)n_size*((int64_t)n_size*n_size-1)/3;
+    n_beta_ir=((n_sum_x_ir*(1<<20))/n_sum_X2)*n_size;
+    n_beta_red=((n_sum_x_red*(1<<20))/n_sum_X2)*n_size;
+
+    // Peak amplitude of the detrended signals, to choose their block exponents
+    un_max_ir=un_max_red=0;
+    for(k=0,X=1-n_size; k<n_size; ++k,X+=2) {
+        n_v_ir=(int64_t)n_size*pun_ir_buffer[k]-n_sum_ir-((n_beta_ir*X+(1<<19))>>20);
+        n_v_red=(int64_t)n_size*pun_red_buffer[k]-n_sum_red-((n_beta_red*X+(1<<19))>>20);
+        if(n_v_ir<0) n_v_ir=-n_v_ir;
+        if(n_v_red<0) n_v_red=-n_v_red;
+        if((uint32_t)n_v_ir>un_max_ir) un_max_ir=(uint32_t)n_v_ir;
+        if((uint32_t)n_v_red>un_max_red) un_max_red=(uint32_t)n_v_red;
+        }
+    n_shift_ir=rf_q_block_shift(un_max_ir);
+    n_shift_red=rf_q_block_shift(un_max_red);
+
+    // Detrended signals as int16_t, with the sums of squares and the correlation product
+    n_sumsq_ir=n_sumsq_red=n_sum_ir_red=0;
+    for(k=0,X=1-n_size; k<n_size; ++k,X+=2) {
+        n_v_ir=(int64_t)n_size*pun_ir_buffer[k]-n_sum_ir-((n_beta_ir*X+(1<<19))>>20);
+        n_v_red=(int64_t)n_size*pun_red_buffer[k]-n_sum_red-((n_beta_red*X+(1<<19))>>20);
+        n_x=(int32_t)((n_v_ir+(((int64_t)1<<n_shift_ir)>>1))>>n_shift_ir);
+        n_y=(int32_t)((n_v_red+(((int64_t)1<<n_shift_red)>>1))>>n_shift_red);
+        an_x[k]=(int16_t)n_x;
+        n_sumsq_ir += n_x*n_x;
+        n_sumsq_red += n_y*n_y;
+        n_sum_ir_red += n_x*n_y;
+        }
+    if(n_sumsq_ir==0 || n_sumsq_red==0) {
+        // Flat signal, nothing to correlate
+        rf_q_invalidate(pn_spo2, pch_spo2_valid, pn_heart_rate, pch_hr_valid, ratio, correl);
+        return;
+        }
+
+    // Pearson correlation between red and IR. The block exponents cancel out
+    un_rms_ir=rf_q_sqrt_norm((uint64_t)n_sumsq_ir, &n_exp_ir);
+    un_rms_red=rf_q_sqrt_norm((uint64_t)n_sumsq_red, &n_exp_red);
+    *correl=rf_q_div_q15(n_sum_ir_red, (int64_t)un_rms_ir*un_rms_red, -(n_exp_ir+n_exp_red));
+
+    if(*correl>=pctx->n_min_pearson_correlation) {
+        // Mean square of the detrended IR signal, scaled like the autocorrelation in rf_q_signal_periodicity
+        rf_q_signal_periodicity(an_x, n_size, &pctx->n_last_peak_interval, pcfg->n_lowest_period, pcfg->n_highest_period,
+                                pctx->n_min_autocorrelation_ratio, n_sumsq_ir*(1<<16)/n_size, ratio);
+        }
+    else
+        pctx->n_last_peak_interval=0;
+    if(pctx->n_last_peak_interval!=0) {
+        *pn_heart_rate = (int32_t)(pcfg->n_fs60/pctx->n_last_peak_interval);
+        *pch_hr_valid  = 1;
+        }
+    else {
+        pctx->n_last_peak_interval=pcfg->n_fs;
+        *pn_heart_rate = RF_Q_INVALID; // unable to calculate because signal looks aperiodic
+        *pch_hr_valid  = 0;
+        *pn_spo2 = RF_Q_INVALID*RF_Q16_ONE; // do not use SPO2 from this corrupt signal
+        *pch_spo2_valid  = 0;
+        return;
+        }
+
+    // xy_ratio = (rms_red*mean_ir)/(rms_ir*mean_red). The window length cancels out, the block
+    // exponents and the exponents of the square roots do not.
+    n_xy_ratio=0;
+    if(n_sum_red>0)
+        n_xy_ratio=rf_q_div_q15((int64_t)un_rms_red*n_sum_ir, (int64_t)un_rms_ir*n_sum_red,
+                                n_exp_red-n_exp_ir+n_shift_red-n_shift_ir);
+    if(n_xy_ratio>RF_Q_RATIO_MIN && n_xy_ratio<RF_Q_RATIO_MAX) { // Check boundaries of applicability
+        int64_t n_spo2=((RF_Q_SPO2_A*(int64_t)n_xy_ratio+(1<<14))>>15)+RF_Q_SPO2_B;
+        *pn_spo2 = (int32_t)(((n_spo2*n_xy_ratio+(1<<14))>>15)+RF_Q_SPO2_C);
+        *pch_spo2_valid = 1;
+        }
+    else {
+        *pn_spo2 = RF_Q_INVALID*RF_Q16_ONE; // do not use SPO2 since signal an_ratio is out of range
+        *pch_spo2_valid  = 0;
+        }
+}
+
+/**
+* \brief        Mark all outputs invalid
+* \par          Details
+*               Used when a window cannot be evaluated at all, e.g. it is incomplete or flat.
+*
+* \retval       None
+*/
+static void rf_q_invalidate(int32_t *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid,
+                            int32_t *ratio, int32_t *correl)
+{
+    *pn_heart_rate = RF_Q_INVALID;
+    *pch_hr_valid  = 0;
+    *pn_spo2 = RF_Q_INVALID*RF_Q16_ONE;
+    *pch_spo2_valid  = 0;
+    *ratio = 0;
+    *correl = 0;
+}
+
+/**
+* \brief        Block exponent
+* \par          Details
+*               Smallest right shift that brings a signal of peak amplitude un_max, rounded, into
+*               the int16_t range.
+*
+* \retval       Shift
+*/
+static int32_t rf_q_block_shift(uint32_t un_max)
+{
+    int32_t n_shift=0;
+    while((((uint64_t)un_max+(((uint64_t)1<<n_shift)>>1))>>n_shift) > INT16_MAX)
+        n_shift++;
+    return n_shift;
+}
+
+/**
+* \brief        Integer square root
+* \par          Details
+*               Bit-by-bit method, floor(sqrt(un_x)).
+*
+* \retval       Square root
+*/
+static uint32_t rf_q_isqrt(uint64_t un_x)
+{
+    uint64_t un_res=0, un_bit=(uint64_t)1<<62;
+    while(un_bit>un_x)
+        un_bit>>=2;
+    while(un_bit) {
+        if(un_x>=un_res+un_bit) {
+            un_x-=un_res+un_bit;
+            un_res=(un_res>>1)+un_bit;
+            }
+        else
+            un_res>>=1;
+        un_bit>>=2;
+        }
+    return (uint32_t)un_res;
+}
+
+/**
+* \brief        Normalized square root
+* \par          Details
+*               sqrt(un_x) as a mantissa in [2^30, 2^31) and a binary exponent, so the result has
+*               31 significant bits whatever the magnitude of un_x. un_x must not be 0.
+*
+* \param[in]    un_x    - Argument
+* \param[out]   *pn_exp - Exponent, sqrt(un_x) = mantissa*2^(*pn_exp)
+*
+* \retval       Mantissa
+*/
+static uint32_t rf_q_sqrt_norm(uint64_t un_x, int32_t *pn_exp)
+{
+    int32_t n_shift=0;
+    while(un_x<((uint64_t)1<<60)) {
+        un_x<<=2;
+        n_shift++;
+        }
+    while(un_x>=((uint64_t)1<<62)) {
+        un_x>>=2;
+        n_shift--;
+        }
+    *pn_exp=-n_shift;
+    return rf_q_isqrt(un_x);
+}
+
+/**
+* \brief        Scaled division
+* \par          Details
+*               n_num/n_den*2^n_exp in Q15, rounded and saturated to the int32_t range. Both
+*               operands are normalized first, so the quotient keeps at least 30 significant bits.
+*               n_den must not be 0.
+*
+* \retval       Quotient in Q15
+*/
+static int32_t rf_q_div_q15(int64_t n_num, int64_t n_den, int32_t n_exp)
+{
+    int neg=0;
+    uint64_t un_num, un_den, un_q;
+    int32_t n_shift=15+n_exp;
+
+    if(n_num<0) {
+        neg=!neg;
+        un_num=(uint64_t)0-(uint64_t)n_num;
+        }
+    else
+        un_num=(uint64_t)n_num;
+    if(n_den<0) {
+        neg=!neg;
+        un_den=(uint64_t)0-(uint64_t)n_den;
+        }
+    else
+        un_den=(uint64_t)n_den;
+    if(un_num==0)
+        return 0;
+
+    while(un_den>=((uint64_t)1<<32)) {
+        un_den>>=1;
+        n_shift--;
+        }
+    while(un_num<((uint64_t)1<<62)) {
+        un_num<<=1;
+        n_shift--;
+        }
+    un_q=un_num/un_den;
+    if(n_shift>=0) {
+        if(n_shift>31 || un_q>((uint64_t)INT32_MAX>>n_shift))
+            un_q=INT32_MAX;
+        else
+            un_q<<=n_shift;
+        }
+    else if(n_shift<-63)
+        un_q=0;
+    else {
+        un_q=(un_q+(((uint64_t)1<<(-n_shift))>>1))>>(-n_shift);
+        if(un_q>INT32_MAX)
+            un_q=INT32_MAX;
+        }
+    return neg ? -(int32_t)un_q : (int32_t)un_q;
+}
+
+/**
+* \brief        Autocorrelation function
+* \par          Details
+*               Fixed-point counterpart of rf_autocorrelation. The sum is exact; the mean over
+*               n_size-n_lag products is returned with 16 fractional bits.
+*
+* \retval       Autocorrelation, Q16 in units of the squared int16_t samples
+*/
+static int64_t rf_q_autocorrelation(const int16_t *pn_x, int32_t n_size, int32_t n_lag)
+{
+    int32_t i, n_temp=n_size-n_lag;
+    int64_t sum=0;
+    const int16_t *pn_ptr;
+    if(n_temp<=0) return sum;
+    for (i=0,pn_ptr=pn_x; i<n_temp; ++i,++pn_ptr) {
+        sum += (int32_t)(*pn_ptr)*(*(pn_ptr+n_lag));
+        }
+    return sum*(1<<16)/n_temp;
+}
+
+/**
+* \brief        Signal periodicity
+* \par          Details
+*               Fixed-point counterpart of rf_signal_periodicity. n_min_aut_ratio and *ratio are
+*               Q15, n_aut_lag0 is scaled like the result of rf_q_autocorrelation.
+*
+* \retval       Average distance between peaks
+*/
+static void rf_q_signal_periodicity(const int16_t *pn_x, int32_t n_size, int32_t *p_last_periodicity, int32_t n_min_distance,
+                                    int32_t n_max_distance, int32_t n_min_aut_ratio, int64_t n_aut_lag0, int32_t *ratio)
+{
+    int32_t n_lag;
+    int64_t aut,aut_left,aut_right,aut_save;
+    int left_limit_reached=0;
+    // Start from the last periodicity computing the corresponding autocorrelation
+    n_lag=*p_last_periodicity;
+    aut_save=aut=rf_q_autocorrelation(pn_x, n_size, n_lag);
+    // Is autocorrelation one lag to the left greater?
+    aut_left=aut;
+    do {
+        aut=aut_left;
+        n_lag--;
+        aut_left=rf_q_autocorrelation(pn_x, n_size, n_lag);
+        }
+    while(aut_left>aut && n_lag>n_min_distance);
+    // Restore lag of the highest aut
+    if(n_lag==n_min_distance) {
+        left_limit_reached=1;
+        n_lag=*p_last_periodicity;
+        aut=aut_save;
+        }
+    else n_lag++;
+    if(n_lag==*p_last_periodicity) {
+        // Trip to the left made no progress. Walk to the right.
+        aut_right=aut;
+        do {
+            aut=aut_right;
+            n_lag++;
+            aut_right=rf_q_autocorrelation(pn_x, n_size, n_lag);
+            }
+        while(aut_right>aut && n_lag<n_max_distance);
+        // Restore lag of the highest aut
+        if(n_lag==n_max_distance)
+            n_lag=0; // Indicates failure
+        else
+            n_lag--;
+        if(n_lag==*p_last_periodicity && left_limit_reached)
+            n_lag=0; // Indicates failure
+        }
+    *ratio=rf_q_div_q15(aut, n_aut_lag0, 0);
+    if(*ratio < n_min_aut_ratio)
+        n_lag=0; // Indicates failure
+    *p_last_periodicity=n_lag;
+}
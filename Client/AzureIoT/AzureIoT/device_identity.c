@@ -0,0 +1,119 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "device_identity.h"
+
+// A device certificate in PEM is well below this; a chain only adds certificates after it
+#define MAX_CERTIFICATE_FILE_SIZE 8192
+#define MAX_CERTIFICATE_SIZE (MAX_CERTIFICATE_FILE_SIZE / 4 * 3)
+
+static const char PemBegin[] = "-----BEGIN CERTIFICATE-----";
+static const char PemEnd[] = "-----END CERTIFICATE-----";
+
+// OID 2.5.4.3, id-at-commonName, DER encoded with its tag and length
+static const uint8_t CommonNameOid[] = {0x06, 0x03, 0x55, 0x04, 0x03};
+
+static int DecodeBase64Digit(char c)
+{
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    }
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    }
+    if (c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    }
+    if (c == '+') {
+        return 62;
+    }
+    if (c == '/') {
+        return 63;
+    }
+    return -1;
+}
+
+/// <summary>
+///     Decodes the base64 body of the first certificate in a PEM text, skipping line breaks.
+/// </summary>
+/// <returns>Number of DER bytes, 0 if there is no complete certificate</returns>
+static size_t DecodeFirstCertificate(const char *pem, uint8_t *der, size_t size)
+{
+    const char *begin = strstr(pem, PemBegin);
+    if (begin == NULL) {
+        return 0;
+    }
+    begin += sizeof(PemBegin) - 1;
+    const char *end = strstr(begin, PemEnd);
+    if (end == NULL) {
+        return 0;
+    }
+
+    uint32_t bits = 0;
+    int bitCount = 0;
+    size_t length = 0;
+    for (const char *p = begin; p < end && *p != '='; p++) {
+        int digit = DecodeBase64Digit(*p);
+        if (digit < 0) {
+            continue;
+        }
+        bits = (bits << 6) | (uint32_t)digit;
+        bitCount += 6;
+        if (bitCount >= 8) {
+            bitCount -= 8;
+            if (length == size) {
+                return 0;
+            }
+            der[length++] = (uint8_t)(bits >> bitCount);
+        }
+    }
+    return length;
+}
+
+bool ReadDeviceIdFromCertificate(const char *certificatePath, char *deviceId, size_t size)
+{
+    static char pem[MAX_CERTIFICATE_FILE_SIZE + 1];
+    static uint8_t der[MAX_CERTIFICATE_SIZE];
+
+    FILE *file = fopen(certificatePath, "r");
+    if (file == NULL) {
+        return false;
+    }
+    size_t pemLength = fread(pem, 1, MAX_CERTIFICATE_FILE_SIZE, file);
+    fclose(file);
+    pem[pemLength] = '\0';
+
+    size_t derLength = DecodeFirstCertificate(pem, der, sizeof(der));
+
+    // The issuer name comes before the subject name, so the subject common name is the last one
+    const uint8_t *name = NULL;
+    size_t nameLength = 0;
+    for (size_t i = 0; i + sizeof(CommonNameOid) + 2 <= derLength; i++) {
+        if (memcmp(der + i, CommonNameOid, sizeof(CommonNameOid)) != 0) {
+            continue;
+        }
+        // The string after the OID: its tag, then a short form length or, for the 128 characters
+        // of a device id, a one byte long form one
+        size_t valueOffset = i + sizeof(CommonNameOid) + 2;
+        size_t valueLength = der[valueOffset - 1];
+        if (valueLength == 0x81 && valueOffset < derLength) {
+            valueLength = der[valueOffset++];
+        } else if (valueLength >= 0x80) {
+            continue;
+        }
+        if (valueOffset + valueLength <= derLength) {
+            name = der + valueOffset;
+            nameLength = valueLength;
+        }
+    }
+    if (name == NULL || nameLength == 0 || nameLength >= size) {
+        return false;
+    }
+
+    for (size_t i = 0; i < nameLength; i++) {
+        deviceId[i] = (char)tolower(name[i]);
+    }
+    deviceId[nameLength] = '\0';
+    return true;
+}
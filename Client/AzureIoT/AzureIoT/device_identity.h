@@ -0,0 +1,20 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+/// <summary>
+///     Length of an Azure Sphere device id, which is also the IoT Hub device id the device
+///     authenticates as: 128 hex digits.
+/// </summary>
+#define DEVICE_ID_LENGTH 128
+
+/// <summary>
+///     Reads the device id from the subject common name of the device authentication
+///     certificate, DeviceAuth_GetCertificatePath, which only exists once the device has
+///     authenticated with its tenant. The id is lower case, as IoT Hub and DPS use it.
+/// </summary>
+/// <param name="certificatePath">PEM file of the certificate</param>
+/// <param name="deviceId">Receives the null terminated id</param>
+/// <param name="size">Size of deviceId, at least DEVICE_ID_LENGTH + 1</param>
+/// <returns>false if the certificate cannot be read or has no common name</returns>
+bool ReadDeviceIdFromCertificate(const char *certificatePath, char *deviceId, size_t size);
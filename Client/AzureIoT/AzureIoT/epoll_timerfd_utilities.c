@@ -87,6 +87,10 @@ int ConsumeTimerFdEvent(int timerFd)
     uint64_t timerData = 0;
 
     if (read(timerFd, &timerData, sizeof(timerData)) == -1) {
+        if (errno == EAGAIN) {
+            // Re-armed since the event was reported, see WaitForEventsAndCallHandlers
+            return 1;
+        }
         Log_Debug("ERROR: Could not read timerfd %s (%d).\n", strerror(errno), errno);
         return -1;
     }
@@ -141,6 +145,64 @@ int WaitForEventAndCallHandler(int epollFd)
     return 0;
 }
 
+static uint64_t MonotonicNanoseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+int WaitForEventsAndCallHandlers(int epollFd, int maxEvents, EventBatchStats *stats)
+{
+    struct epoll_event events[EVENT_BATCH_MAX_EVENTS];
+    if (maxEvents < 1 || maxEvents > EVENT_BATCH_MAX_EVENTS) {
+        maxEvents = EVENT_BATCH_MAX_EVENTS;
+    }
+
+    uint64_t waitStart = stats != NULL ? MonotonicNanoseconds() : 0;
+    int numEventsOccurred = epoll_wait(epollFd, events, maxEvents, -1);
+    uint64_t dispatchStart = stats != NULL ? MonotonicNanoseconds() : 0;
+
+    if (numEventsOccurred == -1) {
+        if (errno == EINTR) {
+            // interrupted by signal, e.g. due to breakpoint being set; ignore
+            numEventsOccurred = 0;
+        } else {
+            Log_Debug("ERROR: Failed waiting on events: %s (%d).\n", strerror(errno), errno);
+            return -1;
+        }
+    }
+
+    // Insertion sort by descending priority; stable, so equal priorities keep the epoll order
+    for (int i = 1; i < numEventsOccurred; i++) {
+        struct epoll_event event = events[i];
+        int priority = event.data.ptr != NULL ? ((EventData *)event.data.ptr)->priority : 0;
+        int j = i;
+        for (; j > 0; j--) {
+            const EventData *previous = events[j - 1].data.ptr;
+            if (previous == NULL || previous->priority >= priority) {
+                break;
+            }
+            events[j] = events[j - 1];
+        }
+        events[j] = event;
+    }
+
+    for (int i = 0; i < numEventsOccurred; i++) {
+        EventData *eventData = events[i].data.ptr;
+        if (eventData != NULL) {
+            eventData->eventHandler(eventData);
+        }
+    }
+
+    if (stats != NULL) {
+        stats->eventCount = numEventsOccurred;
+        stats->waitNanoseconds = dispatchStart - waitStart;
+        stats->dispatchNanoseconds = MonotonicNanoseconds() - dispatchStart;
+    }
+    return 0;
+}
+
 void CloseFdAndPrintError(int fd, const char *fdName)
 {
     if (fd >= 0) {
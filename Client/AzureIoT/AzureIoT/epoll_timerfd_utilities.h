@@ -2,6 +2,7 @@
    Licensed under the MIT License. */
 
 #pragma once
+#include <stdint.h>
 #include <time.h>
 #include <sys/epoll.h>
 #include <unistd.h>
@@ -31,8 +32,36 @@ typedef struct EventData {
     /// The file descriptor that generated the event.
     /// </summary>
     int fd;
+    /// <summary>
+    /// Dispatch order within one WaitForEventsAndCallHandlers batch: events with a higher
+    /// priority are handled first. 0 unless set.
+    /// </summary>
+    int priority;
 } EventData;
 
+/// <summary>
+///     Largest number of events WaitForEventsAndCallHandlers takes from one epoll_wait.
+/// </summary>
+#define EVENT_BATCH_MAX_EVENTS 8
+
+/// <summary>
+///     Statistics of one WaitForEventsAndCallHandlers call.
+/// </summary>
+typedef struct {
+    /// <summary>
+    /// Number of events returned by epoll_wait and dispatched.
+    /// </summary>
+    int eventCount;
+    /// <summary>
+    /// Time spent blocked in epoll_wait, in nanoseconds.
+    /// </summary>
+    uint64_t waitNanoseconds;
+    /// <summary>
+    /// Time spent in the handlers, in nanoseconds.
+    /// </summary>
+    uint64_t dispatchNanoseconds;
+} EventBatchStats;
+
 /// <summary>
 ///    Creates an epoll instance.
 /// </summary>
@@ -81,7 +110,9 @@ int SetTimerFdToSingleExpiry(int timerFd, const struct timespec *expiry);
 ///     If the event is not consumed, then it will immediately recur.
 /// </summary>
 /// <param name="timerFd">Timer file descriptor</param>
-/// <returns>0 on success, or -1 on failure</returns>
+/// <returns>0 on success, 1 if the timer has not expired since it was last consumed or set,
+/// or -1 on failure. A handler of a batch sees 1 when an earlier handler of the same batch
+/// re-armed its timer after the event was reported.</returns>
 int ConsumeTimerFdEvent(int timerFd);
 
 /// <summary>
@@ -105,6 +136,18 @@ int CreateTimerFdAndAddToEpoll(int epollFd, const struct timespec *period,
 /// <returns>0 on success, or -1 on failure</returns>
 int WaitForEventAndCallHandler(int epollFd);
 
+/// <summary>
+///     Waits for events on an epoll instance and triggers the handlers of all events that are
+///     ready, up to maxEvents per call, in the order of their EventData priority.
+/// </summary>
+/// <param name="epollFd">
+///     Epoll file descriptor which was created with <see cref="CreateEpollFd" />.
+/// </param>
+/// <param name="maxEvents">Largest number of events to handle, at most EVENT_BATCH_MAX_EVENTS</param>
+/// <param name="stats">Receives the statistics of this call, or NULL</param>
+/// <returns>0 on success, or -1 on failure</returns>
+int WaitForEventsAndCallHandlers(int epollFd, int maxEvents, EventBatchStats *stats);
+
 /// <summary>
 ///     Closes a file descriptor and prints an error on failure.
 /// </summary>
@@ -0,0 +1,20 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include "format_buffer.h"
+
+int AppendFormatted(char *buffer, size_t bufferSize, int offset, const char *format, ...)
+{
+    if (offset < 0) {
+        return -1;
+    }
+
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buffer + offset, bufferSize - (size_t)offset, format, args);
+    va_end(args);
+
+    if (len < 0 || (size_t)len >= bufferSize - (size_t)offset) {
+        return -1;
+    }
+    return offset + len;
+}
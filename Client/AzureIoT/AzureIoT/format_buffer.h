@@ -0,0 +1,10 @@
+#pragma once
+#include <stddef.h>
+
+/// <summary>
+///     Appends formatted text at the given offset of the buffer. Calls can be chained, passing
+///     the offset of the previous one, and only the result of the last one needs checking.
+/// </summary>
+/// <returns>The new offset, or -1 if the text did not fit or offset already was -1</returns>
+int AppendFormatted(char *buffer, size_t bufferSize, int offset, const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
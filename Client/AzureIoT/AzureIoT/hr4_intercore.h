@@ -0,0 +1,84 @@
+#pragma once
+#include <stdint.h>
+#include "max30102.h"
+
+/// <summary>
+///     Messages between the high-level app and the HR4 real-time app (Client/AzureIoT/HR4RTApp),
+///     used when the high-level app is built with HR4_RTAPP. The real-time app owns the HR4 I2C
+///     bus, samples the MAX30102 from a timer interrupt and runs the streaming RF estimator and
+///     the LED control; the high-level app only starts measurements and forwards what comes
+///     back. Every message starts with its Hr4MessageType and is sent as one inter-core
+///     message, so all of them stay below HR4_MESSAGE_MAX_SIZE.
+/// </summary>
+#define HR4_RTAPP_COMPONENT_ID "88e958a2-e272-4cff-99cc-3a2124ac3e9d"
+#define HR4_HLAPP_COMPONENT_ID "819255ff-8640-41fd-aea7-f85d34c491d5"
+#define HR4_MESSAGE_MAX_SIZE 1024
+
+typedef enum {
+    Hr4Message_Start = 1,   // high-level to real-time, Hr4StartMessage
+    Hr4Message_Stop = 2,    // high-level to real-time, Hr4MessageHeader only
+    Hr4Message_Result = 3,  // real-time to high-level, Hr4ResultMessage
+    Hr4Message_Samples = 4, // real-time to high-level, Hr4SamplesMessage
+    Hr4Message_Done = 5     // real-time to high-level, Hr4DoneMessage
+} Hr4MessageType;
+
+typedef struct {
+    uint32_t type; // Hr4MessageType
+} Hr4MessageHeader;
+
+/// <summary>
+///     Starts a measurement of one window plus runSeconds - windowSeconds one-second estimates.
+///     Samples are only sent when sendSamples is set.
+/// </summary>
+typedef struct {
+    Hr4MessageHeader header;
+    int32_t sampleRate;
+    int32_t windowSeconds;
+    int32_t runSeconds;
+    int32_t adcRangeNanoamps;
+    uint8_t redPulseAmplitude;
+    uint8_t irPulseAmplitude;
+    uint8_t sendSamples;
+    uint8_t reserved;
+} Hr4StartMessage;
+
+/// <summary>
+///     One estimate of the RF algorithm, sent once per second of samples.
+/// </summary>
+typedef struct {
+    Hr4MessageHeader header;
+    int32_t heartRate;
+    float spo2;
+    float ratio;
+    float correl;
+    uint8_t heartRateValid;
+    uint8_t spo2Valid;
+    uint8_t reserved[2];
+} Hr4ResultMessage;
+
+#define HR4_SAMPLES_PER_MESSAGE 64
+
+/// <summary>
+///     Raw samples in the order they were read, with the sensor configuration they were taken
+///     with. A message never spans a change of the configuration.
+/// </summary>
+typedef struct {
+    Hr4MessageHeader header;
+    max30102_config sensorConfig;
+    // samples lost in the sensor FIFO, the sample ring or the mailbox since the last message
+    uint32_t overflows;
+    uint32_t sampleCount;
+    uint32_t ir[HR4_SAMPLES_PER_MESSAGE];
+    uint32_t red[HR4_SAMPLES_PER_MESSAGE];
+} Hr4SamplesMessage;
+
+/// <summary>
+///     Ends a measurement. The LED settings are those it ended with, for the next Hr4StartMessage.
+/// </summary>
+typedef struct {
+    Hr4MessageHeader header;
+    int32_t adcRangeNanoamps;
+    uint8_t redPulseAmplitude;
+    uint8_t irPulseAmplitude;
+    uint8_t reserved[2];
+} Hr4DoneMessage;
@@ -0,0 +1,72 @@
+#include <math.h>
+#include "led_control.h"
+
+// The MAX30102 delivers 18-bit samples.
+#define ADC_FULL_SCALE 262143.0f
+#define DC_TARGET (ADC_FULL_SCALE / 2)
+#define DC_LOW_LIMIT (ADC_FULL_SCALE / 4)
+#define PEAK_HIGH_LIMIT (ADC_FULL_SCALE * 0.9f)
+// Peaks of the pulse reach about this many AC RMS above the DC level
+#define AC_PEAK_FACTOR 4.0f
+// Below this DC level the sensor sees almost no light, usually because there is no finger on it
+#define NO_FINGER_LEVEL (ADC_FULL_SCALE / 128)
+
+#define MIN_PULSE_AMPLITUDE 1.0f
+#define MAX_PULSE_AMPLITUDE 255.0f
+#define MIN_ADC_RANGE 2048
+#define MAX_ADC_RANGE 16384
+
+/// <summary>
+///     Factor for the LED current of a channel that brings its DC level to DC_TARGET, 1 if the
+///     channel is in range or sees no finger.
+/// </summary>
+static float GetChannelGain(float dc, float ac)
+{
+    if (dc < NO_FINGER_LEVEL) {
+        return 1.0f;
+    }
+    if (dc + AC_PEAK_FACTOR * ac > PEAK_HIGH_LIMIT || dc < DC_LOW_LIMIT) {
+        return DC_TARGET / dc;
+    }
+    return 1.0f;
+}
+
+static uint8_t ToPulseAmplitude(float amplitude)
+{
+    if (amplitude < MIN_PULSE_AMPLITUDE) {
+        return (uint8_t)MIN_PULSE_AMPLITUDE;
+    }
+    if (amplitude > MAX_PULSE_AMPLITUDE) {
+        return (uint8_t)MAX_PULSE_AMPLITUDE;
+    }
+    return (uint8_t)lroundf(amplitude);
+}
+
+bool UpdateLedSettings(LedSettings *settings, float irDc, float irAc, float redDc, float redAc)
+{
+    float red = fmaxf(settings->redPulseAmplitude, MIN_PULSE_AMPLITUDE) *
+                GetChannelGain(redDc, redAc);
+    float ir = fmaxf(settings->irPulseAmplitude, MIN_PULSE_AMPLITUDE) * GetChannelGain(irDc, irAc);
+    int32_t range = settings->adcRangeNanoamps;
+
+    // An LED at full current needs a more sensitive range; halving it doubles the counts
+    while ((red > MAX_PULSE_AMPLITUDE || ir > MAX_PULSE_AMPLITUDE) && range > MIN_ADC_RANGE) {
+        range /= 2;
+        red /= 2;
+        ir /= 2;
+    }
+    // An LED at its lowest current needs a less sensitive range, if the other one can follow
+    while ((red < MIN_PULSE_AMPLITUDE || ir < MIN_PULSE_AMPLITUDE) && range < MAX_ADC_RANGE &&
+           red * 2 <= MAX_PULSE_AMPLITUDE && ir * 2 <= MAX_PULSE_AMPLITUDE) {
+        range *= 2;
+        red *= 2;
+        ir *= 2;
+    }
+
+    LedSettings updated = {ToPulseAmplitude(red), ToPulseAmplitude(ir), range};
+    bool changed = updated.redPulseAmplitude != settings->redPulseAmplitude ||
+                   updated.irPulseAmplitude != settings->irPulseAmplitude ||
+                   updated.adcRangeNanoamps != settings->adcRangeNanoamps;
+    *settings = updated;
+    return changed;
+}
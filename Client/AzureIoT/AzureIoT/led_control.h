@@ -0,0 +1,35 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+/// <summary>
+///     LED pulse amplitudes and ADC range of the MAX30102, see maxim_max30102_set_led_pa and
+///     maxim_max30102_set_adc_range.
+/// </summary>
+typedef struct {
+    uint8_t redPulseAmplitude; // REG_LED1_PA, 0.2 mA per step
+    uint8_t irPulseAmplitude;  // REG_LED2_PA, 0.2 mA per step
+    int32_t adcRangeNanoamps;  // 2048, 4096, 8192 or 16384
+} LedSettings;
+
+/// <summary>
+///     The settings maxim_max30102_init applies: about 7 mA for both LEDs and a 4096 nA range.
+/// </summary>
+#define LED_SETTINGS_DEFAULT {0x24, 0x24, 4096}
+
+/// <summary>
+///     Adjusts the settings so the next windows use the ADC range well. A channel whose DC level
+///     clips, or comes within four AC RMS of full scale, or sits in the lowest quarter of the
+///     range gets its LED current scaled so its DC level lands at half scale. LED output is
+///     roughly proportional to the current, so one step usually suffices. When an LED is
+///     already at its limit, the shared ADC range is halved or doubled instead, which doubles or
+///     halves the counts of both channels. A window with almost no light, no finger on the
+///     sensor, leaves the settings alone.
+/// </summary>
+/// <param name="settings">Settings the window was taken with, updated in place</param>
+/// <param name="irDc">DC level of the IR channel in ADC counts</param>
+/// <param name="irAc">AC RMS of the IR channel in ADC counts</param>
+/// <param name="redDc">DC level of the red channel in ADC counts</param>
+/// <param name="redAc">AC RMS of the red channel in ADC counts</param>
+/// <returns>true if the settings changed</returns>
+bool UpdateLedSettings(LedSettings *settings, float irDc, float irAc, float redDc, float redAc);
@@ -13,6 +13,8 @@
 // 3. The Azure DPS Global endpoint address 'global.azure-devices-provisioning.net'
 //    (set in 'AllowedConnections')
 // 4. The IoT Hub Endpoint address for your IoT Central application (set in 'AllowedConnections')
+// Optionally the IoT Hub host name can follow the Scope Id in 'CmdArgs'; the app then connects
+// to it directly, without a DPS round trip, and only uses DPS when that fails.
 
 #include <signal.h>
 #include <stdbool.h>
@@ -22,6 +24,8 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/random.h>
 
 // applibs_versions.h defines the API struct versions to use for applibs APIs.
 #include "applibs_versions.h"
@@ -30,6 +34,7 @@
 #include <applibs/gpio.h>
 #include <applibs/storage.h>
 #include <applibs/i2c.h>
+#include <tlsutils/deviceauth.h>
 
 // By default, this sample is targeted at the MT3620 Reference Development Board (RDB).
 // This can be changed using the project property "Target Hardware Definition Directory".
@@ -37,6 +42,20 @@
 #include <hw/sample_hardware.h>
 #include "max30102.h"
 #include "algorithm_by_RF.h"
+#include "measurement_arena.h"
+#include "telemetry_batch.h"
+#include "telemetry_filter.h"
+#include "ppg_block.h"
+#include "device_identity.h"
+#include "offline_queue.h"
+#include "metrics.h"
+#include "led_control.h"
+#include "reported_state.h"
+#ifdef HR4_RTAPP
+#include <sys/socket.h>
+#include <applibs/application.h>
+#include "hr4_intercore.h"
+#endif
 
 #include "epoll_timerfd_utilities.h"
 
@@ -45,6 +64,7 @@
 #include <iothub_device_client_ll.h>
 #include <iothub_client_options.h>
 #include <iothubtransportmqtt.h>
+#include <iothub_security_factory.h>
 #include <iothub.h>
 #include <azure_sphere_provisioning.h>
 
@@ -56,6 +76,10 @@ static volatile sig_atomic_t terminationRequired = false;
 #define SCOPEID_LENGTH 20
 static char scopeId[SCOPEID_LENGTH]; // ScopeId for the Azure IoT Central application, set in
                                      // app_manifest.json, CmdArgs
+#define HOSTNAME_LENGTH 128
+// IoT Hub the device is assigned to, optionally set after the ScopeId in app_manifest.json,
+// CmdArgs. Connecting to it directly skips the DPS round trip of provisioning.
+static char hubHostname[HOSTNAME_LENGTH];
 
 static IOTHUB_DEVICE_CLIENT_LL_HANDLE iothubClientHandle = NULL;
 static const int keepalivePeriodSeconds = 20;
@@ -63,17 +87,30 @@ static bool iothubAuthenticated = false;
 static void SendMessageCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void *context);
 static void TwinCallback(DEVICE_TWIN_UPDATE_STATE updateState, const unsigned char *payload,
                          size_t payloadSize, void *userContextCallback);
-static void TwinReportBoolState(const unsigned char *propertyName, bool propertyValue);
-static void TwinReportStringState(const unsigned char* propertyName, const unsigned char* propertyValue);
+static void TwinReportBoolState(const char *propertyName, bool propertyValue);
+static void TwinReportStringState(const char *propertyName, const char *propertyValue);
+static void TwinReportIntState(const char *propertyName, int propertyValue);
 static void ReportStatusCallback(int result, void *context);
+static void FlushReportedState(void);
 static const char *GetReasonString(IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason);
 static const char *getAzureSphereProvisioningResultString(
     AZURE_SPHERE_PROV_RETURN_VALUE provisioningResult);
-static void SendTelemetry(const unsigned char *key, const unsigned char *value);
+static bool SendTelemetry(const char *key, const char *value);
+static bool SendTelemetryMessage(const char *message);
+static bool SendIoTHubMessage(IOTHUB_MESSAGE_HANDLE messageHandle, const char *contentType,
+                              const char *contentEncoding,
+                              IOTHUB_CLIENT_EVENT_CONFIRMATION_CALLBACK callback, void *context);
+static void DrainOfflineQueue(void);
+static void OfflineMessageCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void *context);
+static void MessageConfirmationCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void *context);
 static void SetupAzureClient(void);
+static bool CreateDirectAzureClient(void);
+static bool CreateProvisionedAzureClient(void);
+static void BackOffAzureReconnect(void);
 
-// Function to generate simulated Temperature data/telemetry
+// Sent when no reading has been for the heartbeat interval of telemetryFilter
 static void SendDeviceHeartbeat(void);
+static time_t GetMonotonicSeconds(void);
 
 // Initialization/Cleanup
 static int InitPeripheralsAndHandlers(void);
@@ -99,29 +136,237 @@ static int azureTimerFd = -1;
 static int epollFd = -1;
 static int i2cFd = -1;
 static int intPinFd = -1;
+static int hr4SampleTimerFd = -1;
+static int measurementStepTimerFd = -1;
+static int captureSendTimerFd = -1;
+static int monitoringTimerFd = -1;
+#ifdef HR4_RTAPP
+// Socket to the HR4 real-time app, which owns the HR4 and samples it; see hr4_intercore.h
+static int rtAppSocketFd = -1;
+#endif
 
 // Azure IoT poll periods
 static const int AzureIoTDefaultPollPeriodSeconds = 20;
 static const int AzureIoTMinReconnectPeriodSeconds = 10;
 static const int AzureIoTMaxReconnectPeriodSeconds = 10 * 60;
 static int azureIoTPollPeriodSeconds = -1;
+// While messages or reported properties wait for IoT Hub, or the client is connecting, DoWork
+// runs at this short period.
+static const struct timespec AzureIoTBusyPollPeriod = {0, 50 * 1000 * 1000};
+// Sends and reported state updates handed to IoTHubClient and not yet confirmed.
+static int pendingOutboundCount = 0;
+// Confirmation context of a message sent by SendIoTHubMessage: the callback and context of
+// the sender and, for the SendToConfirm metric, the time the message was handed over. It is
+// freed by MessageConfirmationCallback, which IoTHubClient also calls for the messages still
+// pending when the client is destroyed.
+typedef struct {
+    IOTHUB_CLIENT_EVENT_CONFIRMATION_CALLBACK callback;
+    void *context;
+    uint64_t sendTime;
+} MessageConfirmation;
+static struct timespec azureTimerPeriod = {0, 0};
+
+// The client reconnects by itself after network and communication errors, with jittered
+// exponential backoff, for up to AzureIoTClientRetryTimeoutSeconds. It is recreated only when
+// it gives up or IoT Hub refuses it, e.g. because its SAS token expired.
+static const size_t AzureIoTClientRetryTimeoutSeconds = 5 * 60;
+static bool iothubClientConnecting = false; // created, no connection status reported yet
+static bool iothubClientFailed = false;     // needs to be recreated
+static bool iothubClientWasAuthenticated = false;
+static bool iothubClientDirect = false; // created for hubHostname rather than through DPS
+// Cleared when a direct client fails before it authenticated, for whatever reason, so the next
+// client goes through DPS; set again once a client authenticates.
+static bool tryDirectConnection = true;
+static unsigned int reconnectRandomSeed = 0;
+
+static void BeginOutbound(void);
+static void EndOutbound(void);
+static void UpdateAzureTimerPeriod(void);
+
+#ifdef METRICS_ENABLED
+// The metrics gathered since the last report are sent as the "Metrics" reported property.
+static const uint64_t MetricsReportPeriodNanoseconds = 5ull * 60 * 1000 * 1000 * 1000;
+static uint64_t lastMetricsReportTime = 0;
+static void TwinReportMetrics(void);
+#endif
+
+// Twin documents are parsed in place into this arena and released at once when the update is
+// handled. On the device a full twin document with $metadata takes about six times its size;
+// larger documents fall back to the heap.
+static char twinArenaBuffer[24 * 1024];
+static JSON_Arena twinArena;
 
 // Application states
-static char nprId[12] = { 0 };
+// National Patient Registry id; an 11 digit national identity number
+#define NPR_ID_MAX_LENGTH 11
+static char nprId[NPR_ID_MAX_LENGTH + 1] = { 0 };
+// IoT Hub device id, read from the device certificate when the first capture block starts
+static char deviceId[DEVICE_ID_LENGTH + 1] = {0};
+
+// Button polling, configured through the Device Twin ("ButtonIdlePollMilliseconds",
+// "ButtonDebouncePollMilliseconds", "ButtonDebounceMilliseconds"). The buttons are sampled every
+// buttonIdlePollMilliseconds. Once a button changes level it is sampled every
+// buttonDebouncePollMilliseconds until the new level has held for buttonDebounceMilliseconds,
+// so contact bounce is filtered without a fast idle poll.
+static const int32_t MaxButtonPollMilliseconds = 1000;
+static const int32_t MaxButtonDebounceMilliseconds = 1000;
+static int32_t buttonIdlePollMilliseconds = 100;
+static int32_t buttonDebouncePollMilliseconds = 10;
+static int32_t buttonDebounceMilliseconds = 30;
+static bool buttonPollDebouncing = false;
 
 // Button state variables
-static GPIO_Value_Type sendMessageButtonState = GPIO_Value_High;
-static GPIO_Value_Type sendTelemetryButtonState = GPIO_Value_High;
+typedef struct {
+    GPIO_Value_Type stableState;   // debounced level
+    GPIO_Value_Type changingState; // level seen while debouncing
+    int changingMilliseconds;      // how long changingState has held
+} ButtonState;
+static ButtonState sendMessageButtonState = {GPIO_Value_High, GPIO_Value_High, 0};
+static ButtonState sendTelemetryButtonState = {GPIO_Value_High, GPIO_Value_High, 0};
 
 static void ButtonPollTimerEventHandler(EventData *eventData);
-static bool IsButtonPressed(int fd, GPIO_Value_Type *oldState);
+static struct timespec GetButtonPollPeriod(void);
+static bool IsButtonPressed(int fd, ButtonState *state);
 static void SendTelemetryButtonHandler(void);
 static void AzureTimerEventHandler(EventData *eventData);
+static void Hr4SampleTimerEventHandler(EventData *eventData);
+static void MeasurementStepTimerEventHandler(EventData *eventData);
+static void CaptureSendTimerEventHandler(EventData *eventData);
+static void MonitoringTimerEventHandler(EventData *eventData);
+#ifdef HR4_RTAPP
+static void RtAppSocketEventHandler(EventData *eventData);
+#endif
+static bool ConsumeTimerEvent(int timerFd);
+
+// Statistics of the event loop, see WaitForEventsAndCallHandlers.
+static EventBatchStats lastEventBatchStats;
+static unsigned long eventBatchCount = 0;
+static unsigned long eventCount = 0;
+static int largestEventBatch = 0;
 
 // HR4 variables
 static uint8_t max30102_revision = 0;
 static uint8_t max30102_part_id = 0;
 
+// Measurement state machine. A measurement advances by one step per epoll event
+// (Starting -> Collecting <-> Computing -> Publishing -> ShuttingDown -> Idle), so the epoll loop
+// keeps servicing the button and IoT Hub timers for the whole measurement. Samples are collected
+// from Hr4SampleTimerEventHandler; the other steps run from MeasurementStepTimerEventHandler.
+// A scheduled measurement first waits for a finger in WaitingForFinger, also polled from
+// Hr4SampleTimerEventHandler.
+typedef enum {
+    MeasurementState_Idle,
+    MeasurementState_WaitingForFinger,
+    MeasurementState_Starting,
+    MeasurementState_Collecting,
+    MeasurementState_Computing,
+    MeasurementState_Publishing,
+    MeasurementState_ShuttingDown
+} MeasurementState;
+
+static MeasurementState measurementState = MeasurementState_Idle;
+// Sampling frequency and window length requested through the Device Twin ("SampleRate",
+// "WindowSeconds"). They are applied when the next measurement starts.
+static int32_t desiredSampleRate = FS;
+static int32_t desiredWindowSeconds = ST;
+// Configuration of the running measurement.
+static rf_config measurementConfig;
+// The measurement lasts one window plus two one-second estimates.
+static int measurementRunTimeSeconds = ST + 2;
+// The FIFO is drained each time it reaches the almost-full level; the remaining
+// MAX30102_FIFO_DEPTH - MAX30102_FIFO_A_FULL_SAMPLES samples absorb timer jitter.
+static struct timespec hr4SamplePollPeriod = {
+    0, MAX30102_FIFO_A_FULL_SAMPLES * (1000 * 1000 * 1000 / FS)};
+// Shortest possible expiry: the next step runs as soon as the pending events have been handled.
+static const struct timespec measurementStepDelay = {0, 1};
+static const struct timespec timerDisabled = {0, 0};
+static struct timespec measurementStartTime;
+// Sliding window of the last n_st seconds of samples, re-estimated once per second.
+static rf_stream measurementStream;
+// The burst buffers and the window of measurementStream are taken from the measurement arena.
+static uint32_t *aun_ir_buffer = NULL;  //infrared LED sensor data, one FIFO burst
+static uint32_t *aun_red_buffer = NULL; //red LED sensor data, one FIFO burst
+// Window buffer of measurementStream, taken from the measurement arena.
+static void *measurementWindowBuffer = NULL;
+// Valid windows of the current measurement, sent together as one telemetry message.
+static TelemetryBatch measurementBatch;
+// Drops measurements whose average is within the deadband of the last one sent, configured
+// through the Device Twin ("TelemetryDeadbandHeartRate", "TelemetryDeadbandSpO2",
+// "TelemetryHeartbeatMinutes"). The device heartbeat keeps the device visible meanwhile.
+static TelemetryFilter telemetryFilter;
+static const int32_t MaxTelemetryDeadband = 50;
+static const int32_t MaxTelemetryHeartbeatMinutes = 24 * 60;
+// LED currents and ADC range, adjusted after invalid windows by UpdateLedSettings and kept for
+// the next measurement. Each adjustment restarts the window and the measurement run time, so a
+// measurement makes at most MaxLedAdjustmentsPerMeasurement of them.
+static LedSettings ledSettings = LED_SETTINGS_DEFAULT;
+static const int MaxLedAdjustmentsPerMeasurement = 3;
+static int ledAdjustmentCount = 0;
+// Raw samples are captured as binary PPG blocks of one second each while the Device Twin
+// "CaptureRawTrace" property is set, for replay in the benchmark harness. Each block carries
+// the sensor configuration it was recorded with. The two block buffers are taken from the
+// measurement arena: the samples go into the active block while the complete one waits for
+// captureSendTimerFd, so sending never delays the FIFO reads.
+typedef struct {
+    uint8_t *buffer;
+    PpgBlock block;
+    max30102_config sensorConfig;
+} CaptureBlock;
+static bool captureRawTrace = false;
+static uint32_t captureSequence = 0;
+static size_t captureBufferSize = 0;
+static CaptureBlock captureBlocks[2];
+static CaptureBlock *activeCaptureBlock = NULL;  // being filled, NULL while not capturing
+static CaptureBlock *pendingCaptureBlock = NULL; // complete and waiting to be sent
+static unsigned int captureOverruns = 0;         // blocks dropped because none was free
+// Scheduled monitoring, configured through the Device Twin ("MonitoringIntervalMinutes",
+// "MonitoringValidWindows", "MonitoringTimeoutSeconds"). Every interval the MAX30102 is woken in
+// proximity mode, where it only pulses the pilot LED until the IR level passes
+// PROXIMITY_THRESHOLD. The measurement then ends after monitoringValidWindows valid windows,
+// once the finger is lifted or at the timeout, whichever comes first, and the sensor is shut
+// down until the next round. An interval of 0 leaves measurements to the button.
+static const int32_t MaxMonitoringIntervalMinutes = 24 * 60;
+static const int32_t MinMonitoringTimeoutSeconds = 30;
+static const int32_t MaxMonitoringTimeoutSeconds = 60 * 60;
+static int32_t monitoringIntervalMinutes = 0;
+static int32_t monitoringValidWindows = 3;
+static int32_t monitoringTimeoutSeconds = 120;
+static bool scheduledMeasurement = false;
+// CLOCK_MONOTONIC seconds; ends the wait for a finger, then the measurement once it started
+static time_t monitoringDeadline = 0;
+// The proximity interrupt is checked at this period while waiting for a finger.
+static const struct timespec fingerPollPeriod = {0, 250 * 1000 * 1000};
+#ifdef HR4_RTAPP
+// Sensor configuration of the last samples of the real-time app, recorded with the next ones
+static max30102_config rtAppSensorConfig;
+#endif
+
+static void SetMeasurementState(MeasurementState newState);
+static size_t GetMeasurementArenaFootprint(const rf_config *config);
+static void StartMeasurement(void);
+static void StartScheduledMeasurement(void);
+static void CheckForFinger(void);
+static bool IsFingerLifted(void);
+static void UpdateMonitoringTimer(void);
+static bool AllocateCaptureBlocks(void);
+#ifdef HR4_RTAPP
+static void StartRtAppMeasurement(void);
+static void HandleRtAppResult(const Hr4ResultMessage *result);
+static void HandleRtAppSamples(const Hr4SamplesMessage *samples);
+static void HandleRtAppDone(const Hr4DoneMessage *done);
+static bool SendToRtApp(const void *message, size_t length);
+#endif
+static void CollectMeasurementSamples(void);
+static void ProcessMeasurementWindow(void);
+static void PublishMeasurement(void);
+static void BeginCaptureBlock(CaptureBlock *captureBlock);
+static void AddToCaptureBlock(uint32_t ir, uint32_t red);
+static void CompleteCaptureBlock(void);
+static void SendPendingCaptureBlock(void);
+static void StopCapture(void);
+static bool ApplyLedSettings(void);
+static bool AdjustLedSettings(void);
+
 /// <summary>
 ///     Signal handler for termination requests. This handler must be async-signal-safe.
 /// </summary>
@@ -156,7 +401,9 @@ void InitHR4(void) {
 
 int Read_i2c(uint8_t addr, uint16_t count, uint8_t* ptr)
 {
+	uint64_t start = METRICS_NOW();
 	int r = I2CMaster_WriteThenRead(i2cFd, MAX30101_SAD, &addr, sizeof(addr), ptr, count);
+	METRICS_RECORD_DURATION(MetricTimer_I2cRead, start);
 	if (r == -1)
 		Log_Debug("ERROR: I2CMaster_Writer: errno=%d (%s)\n", errno, strerror(errno));
 	return r;
@@ -168,7 +415,9 @@ void Write_i2c(uint8_t addr, uint16_t count, uint8_t* ptr)
 	buff[0] = addr;
 	buff[1] = *ptr;
 
+	uint64_t start = METRICS_NOW();
 	int r = I2CMaster_Write(i2cFd, MAX30101_SAD, buff, 2);
+	METRICS_RECORD_DURATION(MetricTimer_I2cWrite, start);
 	if (r == -1)
 		Log_Debug("ERROR: I2CMaster_Writer: errno=%d (%s)\n", errno, strerror(errno));
 }
@@ -180,9 +429,13 @@ int main(int argc, char *argv[])
 {
     Log_Debug("IoT Central Application starting.\n");
 
-    if (argc == 2) {
+    if (argc == 2 || argc == 3) {
         Log_Debug("Setting Azure Scope ID %s\n", argv[1]);
         strncpy(scopeId, argv[1], SCOPEID_LENGTH);
+        if (argc == 3) {
+            Log_Debug("Setting Azure IoT Hub %s\n", argv[2]);
+            strncpy(hubHostname, argv[2], HOSTNAME_LENGTH - 1);
+        }
     } else {
         Log_Debug("ScopeId needs to be set in the app_manifest CmdArgs\n");
         return -1;
@@ -194,11 +447,19 @@ int main(int argc, char *argv[])
 
     // Main loop
     while (!terminationRequired) {
-        if (WaitForEventAndCallHandler(epollFd) != 0) {
+        if (WaitForEventsAndCallHandlers(epollFd, EVENT_BATCH_MAX_EVENTS, &lastEventBatchStats) !=
+            0) {
             terminationRequired = true;
         }
+        eventBatchCount++;
+        eventCount += (unsigned long)lastEventBatchStats.eventCount;
+        if (lastEventBatchStats.eventCount > largestEventBatch) {
+            largestEventBatch = lastEventBatchStats.eventCount;
+        }
     }
 
+    Log_Debug("INFO: Handled %lu events in %lu waits, at most %d per wait.\n", eventCount,
+              eventBatchCount, largestEventBatch);
     ClosePeripheralsAndHandlers();
 
     Log_Debug("Application exiting.\n");
@@ -206,17 +467,51 @@ int main(int argc, char *argv[])
     return 0;
 }
 
+/// <summary>
+///     Consumes the event of a timer, see ConsumeTimerFdEvent. Requests termination on failure.
+/// </summary>
+/// <returns>true if the timer has expired and its handler should run</returns>
+static bool ConsumeTimerEvent(int timerFd)
+{
+    int result = ConsumeTimerFdEvent(timerFd);
+    if (result < 0) {
+        terminationRequired = true;
+    }
+    return result == 0;
+}
+
 /// <summary>
 /// Button timer event:  Check the status of buttons A and B
 /// </summary>
 static void ButtonPollTimerEventHandler(EventData *eventData)
 {
-    if (ConsumeTimerFdEvent(buttonPollTimerFd) != 0) {
-        terminationRequired = true;
+    if (!ConsumeTimerEvent(buttonPollTimerFd)) {
         return;
     }
 
     SendTelemetryButtonHandler();
+
+    // Sample fast only while a level change is being debounced
+    bool debouncing =
+        sendTelemetryButtonState.changingState != sendTelemetryButtonState.stableState;
+    if (debouncing != buttonPollDebouncing) {
+        buttonPollDebouncing = debouncing;
+        struct timespec period = GetButtonPollPeriod();
+        if (SetTimerFdToPeriod(buttonPollTimerFd, &period) != 0) {
+            terminationRequired = true;
+        }
+    }
+}
+
+/// <summary>
+///     Returns the button poll period of the current phase, idle or debouncing.
+/// </summary>
+static struct timespec GetButtonPollPeriod(void)
+{
+    int32_t milliseconds =
+        buttonPollDebouncing ? buttonDebouncePollMilliseconds : buttonIdlePollMilliseconds;
+    struct timespec period = {milliseconds / 1000, (milliseconds % 1000) * 1000 * 1000};
+    return period;
 }
 
 /// <summary>
@@ -224,29 +519,143 @@ static void ButtonPollTimerEventHandler(EventData *eventData)
 /// </summary>
 static void AzureTimerEventHandler(EventData *eventData)
 {
-    if (ConsumeTimerFdEvent(azureTimerFd) != 0) {
-        terminationRequired = true;
+    if (!ConsumeTimerEvent(azureTimerFd)) {
         return;
     }
 
     bool isNetworkReady = false;
     if (Networking_IsNetworkingReady(&isNetworkReady) != -1) {
-        if (isNetworkReady && !iothubAuthenticated) {
+        if (isNetworkReady && (iothubClientHandle == NULL || iothubClientFailed)) {
             SetupAzureClient();
         }
     } else {
         Log_Debug("Failed to get Network state\n");
     }
 
+    if (iothubClientHandle == NULL || iothubClientFailed) {
+        return;
+    }
+
     if (iothubAuthenticated) {
-		//SendDeviceHeartbeat();
-        IoTHubDeviceClient_LL_DoWork(iothubClientHandle);
+        if (IsTelemetryHeartbeatDue(&telemetryFilter, GetMonotonicSeconds())) {
+            SendDeviceHeartbeat();
+        }
+        DrainOfflineQueue();
+#ifdef METRICS_ENABLED
+        if (METRICS_NOW() - lastMetricsReportTime >= MetricsReportPeriodNanoseconds) {
+            TwinReportMetrics();
+        }
+#endif
+    }
+    // While not authenticated DoWork lets the client connect or retry
+    uint64_t start = METRICS_NOW();
+    IoTHubDeviceClient_LL_DoWork(iothubClientHandle);
+    METRICS_RECORD_DURATION(MetricTimer_DoWork, start);
+    if (iothubAuthenticated) {
+        // Includes the properties the twin and connection callbacks of DoWork just set
+        FlushReportedState();
+    }
+}
+
+/// <summary>
+/// HR4 sample timer event:  Drain the samples waiting in the MAX30102 FIFO
+/// </summary>
+static void Hr4SampleTimerEventHandler(EventData *eventData)
+{
+    if (!ConsumeTimerEvent(hr4SampleTimerFd)) {
+        return;
+    }
+
+    // While a window is being computed the samples wait in the FIFO.
+    if (measurementState == MeasurementState_Collecting) {
+        CollectMeasurementSamples();
+    } else if (measurementState == MeasurementState_WaitingForFinger) {
+        CheckForFinger();
+    }
+}
+
+/// <summary>
+/// Measurement step timer event:  Run the next step of the measurement state machine
+/// </summary>
+static void MeasurementStepTimerEventHandler(EventData *eventData)
+{
+    if (!ConsumeTimerEvent(measurementStepTimerFd)) {
+        return;
+    }
+
+    switch (measurementState) {
+    case MeasurementState_Starting:
+#ifdef HR4_RTAPP
+        StartRtAppMeasurement();
+#else
+        StartMeasurement();
+#endif
+        break;
+    case MeasurementState_Computing:
+        ProcessMeasurementWindow();
+        break;
+    case MeasurementState_Publishing:
+        PublishMeasurement();
+        break;
+    case MeasurementState_ShuttingDown:
+#ifndef HR4_RTAPP
+        // The real-time app powers the sensor down itself
+        max301024_shut_down(1);
+#endif
+        scheduledMeasurement = false;
+        measurementState = MeasurementState_Idle;
+        break;
+    case MeasurementState_Idle:
+    case MeasurementState_WaitingForFinger:
+    case MeasurementState_Collecting:
+        break;
+    }
+}
+
+/// <summary>
+/// Capture send timer event:  Send the raw sample block completed by the sample handler
+/// </summary>
+static void CaptureSendTimerEventHandler(EventData *eventData)
+{
+    if (!ConsumeTimerEvent(captureSendTimerFd)) {
+        return;
+    }
+
+    SendPendingCaptureBlock();
+}
+
+/// <summary>
+/// Monitoring timer event:  Start the next scheduled measurement
+/// </summary>
+static void MonitoringTimerEventHandler(EventData *eventData)
+{
+    if (!ConsumeTimerEvent(monitoringTimerFd)) {
+        return;
+    }
+
+    if (measurementState != MeasurementState_Idle) {
+        Log_Debug("INFO: Measurement in progress, skipping the scheduled one.\n");
+        return;
     }
+    StartScheduledMeasurement();
 }
 
 // event handler data structures. Only the event handler field needs to be populated.
+// Of the events ready at the same time, the MAX30102 FIFO is drained first so it cannot
+// overflow, then the measurement steps run, then buttons, IoT Hub housekeeping and the
+// raw capture blocks.
 static EventData buttonPollEventData = {.eventHandler = &ButtonPollTimerEventHandler};
 static EventData azureEventData = {.eventHandler = &AzureTimerEventHandler};
+static EventData hr4SampleEventData = {.eventHandler = &Hr4SampleTimerEventHandler,
+                                       .priority = 2};
+static EventData measurementStepEventData = {.eventHandler = &MeasurementStepTimerEventHandler,
+                                             .priority = 1};
+static EventData captureSendEventData = {.eventHandler = &CaptureSendTimerEventHandler};
+static EventData monitoringEventData = {.eventHandler = &MonitoringTimerEventHandler};
+#ifdef HR4_RTAPP
+// The real-time app takes the place of the FIFO
+static EventData rtAppSocketEventData = {.eventHandler = &RtAppSocketEventHandler, .priority = 2};
+#endif
 
 /// <summary>
 ///     Set up SIGTERM termination handler, initialize peripherals, and set up event handlers.
@@ -289,29 +698,92 @@ static int InitPeripheralsAndHandlers(void)
         return -1;
     }
 
+#ifdef HR4_RTAPP
+    // The real-time app owns the HR4 I2C bus and interrupt
+    rtAppSocketFd = Application_Connect(HR4_RTAPP_COMPONENT_ID);
+    if (rtAppSocketFd < 0) {
+        Log_Debug("ERROR: Could not connect to the HR4 real-time app: %s (%d).\n",
+                  strerror(errno), errno);
+        return -1;
+    }
+    if (RegisterEventHandlerToEpoll(epollFd, rtAppSocketFd, &rtAppSocketEventData, EPOLLIN) !=
+        0) {
+        return -1;
+    }
+#else
 	InitHR4();
 	maxim_max30102_i2c_setup(Read_i2c, Write_i2c);
 	max30102_revision = max30102_get_revision();
 	max30102_part_id = max30102_get_part_id();
 	Log_Debug("HeartRate Click Revision: 0x%02X\n", max30102_get_revision());
 	Log_Debug("HeartRate Click Part ID:  0x%02X\n\n", max30102_get_part_id());
+#endif
+
+    // Make sure the largest sampling configuration a twin update can ask for fits the arena.
+    rf_config largestConfig;
+    rf_config_default(&largestConfig);
+    rf_configure(&largestConfig, RF_MAX_FS, RF_MAX_ST);
+    size_t largestFootprint = GetMeasurementArenaFootprint(&largestConfig);
+    if (largestFootprint > MEASUREMENT_ARENA_SIZE) {
+        Log_Debug("ERROR: Measurement arena too small: %zu bytes needed at %d sps for %d s, %zu available.\n",
+                  largestFootprint, RF_MAX_FS, RF_MAX_ST, (size_t)MEASUREMENT_ARENA_SIZE);
+        return -1;
+    }
+    Log_Debug("INFO: Measurement arena: %zu bytes, at most %zu used by a measurement.\n",
+              (size_t)MEASUREMENT_ARENA_SIZE, largestFootprint);
+
+    TelemetryFilterConfig telemetryFilterConfig = TELEMETRY_FILTER_CONFIG_DEFAULT;
+    InitTelemetryFilter(&telemetryFilter, &telemetryFilterConfig);
+
+    // Without mutable storage readings are sent directly and lost while offline.
+    OpenOfflineQueue();
+    ResetMetrics();
+#ifdef METRICS_ENABLED
+    lastMetricsReportTime = METRICS_NOW();
+#endif
 
     // Set up a timer to poll for button events.
-    struct timespec buttonPressCheckPeriod = {0, 1000 * 1000};
+    struct timespec buttonPollPeriod = GetButtonPollPeriod();
     buttonPollTimerFd =
-        CreateTimerFdAndAddToEpoll(epollFd, &buttonPressCheckPeriod, &buttonPollEventData, EPOLLIN);
+        CreateTimerFdAndAddToEpoll(epollFd, &buttonPollPeriod, &buttonPollEventData, EPOLLIN);
     if (buttonPollTimerFd < 0) {
         return -1;
     }
 
     azureIoTPollPeriodSeconds = AzureIoTDefaultPollPeriodSeconds;
-    struct timespec azureTelemetryPeriod = {azureIoTPollPeriodSeconds, 0};
+    azureTimerPeriod = (struct timespec){azureIoTPollPeriodSeconds, 0};
     azureTimerFd =
-        CreateTimerFdAndAddToEpoll(epollFd, &azureTelemetryPeriod, &azureEventData, EPOLLIN);
+        CreateTimerFdAndAddToEpoll(epollFd, &azureTimerPeriod, &azureEventData, EPOLLIN);
     if (buttonPollTimerFd < 0) {
         return -1;
     }
 
+    // The measurement timers are created disarmed; a button press starts the state machine.
+    hr4SampleTimerFd =
+        CreateTimerFdAndAddToEpoll(epollFd, &timerDisabled, &hr4SampleEventData, EPOLLIN);
+    if (hr4SampleTimerFd < 0) {
+        return -1;
+    }
+
+    measurementStepTimerFd =
+        CreateTimerFdAndAddToEpoll(epollFd, &timerDisabled, &measurementStepEventData, EPOLLIN);
+    if (measurementStepTimerFd < 0) {
+        return -1;
+    }
+
+    captureSendTimerFd =
+        CreateTimerFdAndAddToEpoll(epollFd, &timerDisabled, &captureSendEventData, EPOLLIN);
+    if (captureSendTimerFd < 0) {
+        return -1;
+    }
+
+    // Armed when the Device Twin sets MonitoringIntervalMinutes
+    monitoringTimerFd =
+        CreateTimerFdAndAddToEpoll(epollFd, &timerDisabled, &monitoringEventData, EPOLLIN);
+    if (monitoringTimerFd < 0) {
+        return -1;
+    }
+
     return 0;
 }
 
@@ -329,11 +801,19 @@ static void ClosePeripheralsAndHandlers(void)
 
     CloseFdAndPrintError(buttonPollTimerFd, "ButtonTimer");
     CloseFdAndPrintError(azureTimerFd, "AzureTimer");
+    CloseFdAndPrintError(hr4SampleTimerFd, "Hr4SampleTimer");
+    CloseFdAndPrintError(measurementStepTimerFd, "MeasurementStepTimer");
+    CloseFdAndPrintError(captureSendTimerFd, "CaptureSendTimer");
+    CloseFdAndPrintError(monitoringTimerFd, "MonitoringTimer");
+#ifdef HR4_RTAPP
+    CloseFdAndPrintError(rtAppSocketFd, "RtAppSocket");
+#endif
     CloseFdAndPrintError(sendMessageButtonGpioFd, "SendMessageButton");
     CloseFdAndPrintError(sendTelemetryButtonGpioFd, "SendTelemetryButton");
     CloseFdAndPrintError(deviceTwinStatusLedGpioFd, "StatusLed");
 	CloseFdAndPrintError(intPinFd, "MIKROE_INT");
 	CloseFdAndPrintError(i2cFd, "MIKROE_I2C");
+    CloseOfflineQueue();
     CloseFdAndPrintError(epollFd, "Epoll");		
 }
 
@@ -346,63 +826,78 @@ static void HubConnectionStatusCallback(IOTHUB_CLIENT_CONNECTION_STATUS result,
                                         void *userContextCallback)
 {
     iothubAuthenticated = (result == IOTHUB_CLIENT_CONNECTION_AUTHENTICATED);
+    iothubClientConnecting = false;
     Log_Debug("IoT Hub Authenticated: %s\n", GetReasonString(reason));
 
+    if (iothubAuthenticated) {
+        iothubClientWasAuthenticated = true;
+        tryDirectConnection = true;
+        azureIoTPollPeriodSeconds = AzureIoTDefaultPollPeriodSeconds;
+    } else if (iothubClientDirect && !iothubClientWasAuthenticated) {
+        // hubHostname may be wrong or stale, and a DNS or connect failure only reports a
+        // network error, which the client would retry for the whole retry timeout. A direct
+        // client that never got through is replaced by one through DPS at its first failure.
+        iothubClientFailed = true;
+        tryDirectConnection = false;
+    } else if (reason != IOTHUB_CLIENT_CONNECTION_NO_NETWORK &&
+               reason != IOTHUB_CLIENT_CONNECTION_COMMUNICATION_ERROR &&
+               reason != IOTHUB_CLIENT_CONNECTION_OK) {
+        // The client does not recover from this by itself. A refused provisioned client backs
+        // off first.
+        iothubClientFailed = true;
+        if (!iothubClientWasAuthenticated) {
+            BackOffAzureReconnect();
+        }
+    }
+    // Do not keep polling at the busy period, and retrying the connection with it, while offline
+    UpdateAzureTimerPeriod();
+
 	if (iothubAuthenticated) 
 	{
+#ifndef HR4_RTAPP
 		char max30102_revision_string[10] = { 0 };
 		char max30102_part_id_string[10] = { 0 };
 		snprintf(max30102_revision_string, 10, "0x%02X", max30102_revision);
 		snprintf(max30102_part_id_string, 10, "0x%02X", max30102_part_id);
 		TwinReportStringState("max30102_revision", max30102_revision_string);
 		TwinReportStringState("max30102_part_id", max30102_part_id_string);
+#endif
+		DrainOfflineQueue();
 	}
 }
 
 /// <summary>
 ///     Sets up the Azure IoT Hub connection (creates the iothubClientHandle)
 ///     When the SAS Token for a device expires the connection needs to be recreated
-///     which is why this is not simply a one time call.
+///     which is why this is not simply a one time call. The client connects directly to
+///     hubHostname when it is known, and goes through DPS when it is not or that failed.
 /// </summary>
 static void SetupAzureClient(void)
 {
-    if (iothubClientHandle != NULL)
+    if (iothubClientHandle != NULL) {
         IoTHubDeviceClient_LL_Destroy(iothubClientHandle);
-
-    AZURE_SPHERE_PROV_RETURN_VALUE provResult =
-        IoTHubDeviceClient_LL_CreateWithAzureSphereDeviceAuthProvisioning(scopeId, 10000,
-                                                                          &iothubClientHandle);
-    Log_Debug("IoTHubDeviceClient_LL_CreateWithAzureSphereDeviceAuthProvisioning returned '%s'.\n",
-              getAzureSphereProvisioningResultString(provResult));
-
-    if (provResult.result != AZURE_SPHERE_PROV_RESULT_OK) {
-
-        // If we fail to connect, reduce the polling frequency, starting at
-        // AzureIoTMinReconnectPeriodSeconds and with a backoff up to
-        // AzureIoTMaxReconnectPeriodSeconds
-        if (azureIoTPollPeriodSeconds == AzureIoTDefaultPollPeriodSeconds) {
-            azureIoTPollPeriodSeconds = AzureIoTMinReconnectPeriodSeconds;
-        } else {
-            azureIoTPollPeriodSeconds *= 2;
-            if (azureIoTPollPeriodSeconds > AzureIoTMaxReconnectPeriodSeconds) {
-                azureIoTPollPeriodSeconds = AzureIoTMaxReconnectPeriodSeconds;
-            }
-        }
-
-        struct timespec azureTelemetryPeriod = {azureIoTPollPeriodSeconds, 0};
-        SetTimerFdToPeriod(azureTimerFd, &azureTelemetryPeriod);
-
+        iothubClientHandle = NULL;
+    }
+    // Destroying the client dropped whatever was still pending; the period is set below.
+    pendingOutboundCount = 0;
+    iothubAuthenticated = false;
+    iothubClientConnecting = false;
+    iothubClientFailed = false;
+    iothubClientWasAuthenticated = false;
+
+    iothubClientDirect =
+        tryDirectConnection && hubHostname[0] != '\0' && CreateDirectAzureClient();
+    if (!iothubClientDirect && !CreateProvisionedAzureClient()) {
+        BackOffAzureReconnect();
+        UpdateAzureTimerPeriod();
         Log_Debug("ERROR: failure to create IoTHub Handle - will retry in %i seconds.\n",
                   azureIoTPollPeriodSeconds);
         return;
     }
 
-    // Successfully connected, so make sure the polling frequency is back to the default
-    azureIoTPollPeriodSeconds = AzureIoTDefaultPollPeriodSeconds;
-    struct timespec azureTelemetryPeriod = {azureIoTPollPeriodSeconds, 0};
-    SetTimerFdToPeriod(azureTimerFd, &azureTelemetryPeriod);
-
-    iothubAuthenticated = true;
+    // Poll at the busy period until the client reports whether it connected
+    iothubClientConnecting = true;
+    UpdateAzureTimerPeriod();
 
     if (IoTHubDeviceClient_LL_SetOption(iothubClientHandle, OPTION_KEEP_ALIVE,
                                         &keepalivePeriodSeconds) != IOTHUB_CLIENT_OK) {
@@ -410,11 +905,99 @@ static void SetupAzureClient(void)
         return;
     }
 
+    if (IoTHubDeviceClient_LL_SetRetryPolicy(iothubClientHandle,
+                                             IOTHUB_CLIENT_RETRY_EXPONENTIAL_BACKOFF_WITH_JITTER,
+                                             AzureIoTClientRetryTimeoutSeconds) !=
+        IOTHUB_CLIENT_OK) {
+        Log_Debug("ERROR: failure setting the retry policy\n");
+    }
+
     IoTHubDeviceClient_LL_SetDeviceTwinCallback(iothubClientHandle, TwinCallback, NULL);
 	IoTHubDeviceClient_LL_SetConnectionStatusCallback(iothubClientHandle,
 		HubConnectionStatusCallback, NULL);
 }
 
+/// <summary>
+///     Creates the client for hubHostname, authenticated with the device certificate. This
+///     does not contact IoT Hub yet; a refused connection is reported to
+///     HubConnectionStatusCallback.
+/// </summary>
+/// <returns>true if the client was created</returns>
+static bool CreateDirectAzureClient(void)
+{
+    if (iothub_security_init(IOTHUB_SECURITY_TYPE_X509) != 0) {
+        Log_Debug("ERROR: iothub_security_init failed for the direct connection.\n");
+        return false;
+    }
+
+    iothubClientHandle =
+        IoTHubDeviceClient_LL_CreateWithAzureSphereFromDeviceAuth(hubHostname, MQTT_Protocol);
+    if (iothubClientHandle == NULL) {
+        Log_Debug("ERROR: failure to create the IoTHub Handle for %s.\n", hubHostname);
+        return false;
+    }
+
+    // The device ID is taken from the device certificate
+    static const int deviceIdForDaaCertUsage = 1;
+    if (IoTHubDeviceClient_LL_SetOption(iothubClientHandle, "SetDeviceId",
+                                        &deviceIdForDaaCertUsage) != IOTHUB_CLIENT_OK) {
+        Log_Debug("ERROR: failure setting option \"SetDeviceId\"\n");
+        IoTHubDeviceClient_LL_Destroy(iothubClientHandle);
+        iothubClientHandle = NULL;
+        return false;
+    }
+
+    Log_Debug("INFO: Connecting directly to %s.\n", hubHostname);
+    return true;
+}
+
+/// <summary>
+///     Creates the client through the Device Provisioning Service, which blocks for up to
+///     10 seconds.
+/// </summary>
+/// <returns>true if the client was created</returns>
+static bool CreateProvisionedAzureClient(void)
+{
+    AZURE_SPHERE_PROV_RETURN_VALUE provResult =
+        IoTHubDeviceClient_LL_CreateWithAzureSphereDeviceAuthProvisioning(scopeId, 10000,
+                                                                          &iothubClientHandle);
+    Log_Debug("IoTHubDeviceClient_LL_CreateWithAzureSphereDeviceAuthProvisioning returned '%s'.\n",
+              getAzureSphereProvisioningResultString(provResult));
+    if (provResult.result != AZURE_SPHERE_PROV_RESULT_OK) {
+        iothubClientHandle = NULL;
+        return false;
+    }
+    return true;
+}
+
+/// <summary>
+///     Lengthens azureIoTPollPeriodSeconds after a failed connection attempt: exponential
+///     backoff from AzureIoTMinReconnectPeriodSeconds up to AzureIoTMaxReconnectPeriodSeconds
+///     with decorrelated jitter, i.e. a random period between the minimum and three times the
+///     previous one, so devices that lost IoT Hub together do not all come back together.
+/// </summary>
+static void BackOffAzureReconnect(void)
+{
+    if (reconnectRandomSeed == 0 &&
+        getrandom(&reconnectRandomSeed, sizeof(reconnectRandomSeed), GRND_NONBLOCK) !=
+            sizeof(reconnectRandomSeed)) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        reconnectRandomSeed = (unsigned int)now.tv_nsec;
+    }
+
+    int previous = azureIoTPollPeriodSeconds == AzureIoTDefaultPollPeriodSeconds
+                       ? AzureIoTMinReconnectPeriodSeconds
+                       : azureIoTPollPeriodSeconds;
+    int upper = previous * 3;
+    if (upper > AzureIoTMaxReconnectPeriodSeconds) {
+        upper = AzureIoTMaxReconnectPeriodSeconds;
+    }
+    azureIoTPollPeriodSeconds = AzureIoTMinReconnectPeriodSeconds +
+                                rand_r(&reconnectRandomSeed) %
+                                    (upper - AzureIoTMinReconnectPeriodSeconds + 1);
+}
+
 /// <summary>
 ///     Callback invoked when a Device Twin update is received from IoT Hub.
 ///     Updates local state for 'showEvents' (bool).
@@ -424,20 +1007,19 @@ static void SetupAzureClient(void)
 static void TwinCallback(DEVICE_TWIN_UPDATE_STATE updateState, const unsigned char *payload,
                          size_t payloadSize, void *userContextCallback)
 {
-    size_t nullTerminatedJsonSize = payloadSize + 1;
-    char *nullTerminatedJsonString = (char *)malloc(nullTerminatedJsonSize);
-    if (nullTerminatedJsonString == NULL) {
-        Log_Debug("ERROR: Could not allocate buffer for twin update payload.\n");
-        abort();
+    json_arena_init(&twinArena, twinArenaBuffer, sizeof(twinArenaBuffer));
+    bool parsedInArena = true;
+    JSON_Value *rootProperties =
+        json_parse_string_n_arena((const char *)payload, payloadSize, &twinArena);
+    if (rootProperties == NULL) {
+        // Either the arena is too small or the payload is not JSON; the heap tells them apart.
+        parsedInArena = false;
+        rootProperties = json_parse_string_n((const char *)payload, payloadSize);
+        if (rootProperties != NULL) {
+            Log_Debug("INFO: Twin update of %zu bytes does not fit the %zu byte arena.\n",
+                      payloadSize, sizeof(twinArenaBuffer));
+        }
     }
-
-    // Copy the provided buffer to a null terminated buffer.
-    memcpy(nullTerminatedJsonString, payload, payloadSize);
-    // Add the null terminator at the end.
-    nullTerminatedJsonString[nullTerminatedJsonSize - 1] = 0;
-
-    JSON_Value *rootProperties = NULL;
-    rootProperties = json_parse_string(nullTerminatedJsonString);
     if (rootProperties == NULL) {
         Log_Debug("WARNING: Cannot parse the string as JSON content.\n");
         goto cleanup;
@@ -460,15 +1042,171 @@ static void TwinCallback(DEVICE_TWIN_UPDATE_STATE updateState, const unsigned ch
 
 	JSON_Object* nprIdState = json_object_dotget_object(desiredProperties, "nprId");
 	if (nprIdState != NULL) {
-		strcpy(nprId, json_object_get_string(nprIdState, "value"));
+		const char *id = json_object_get_string(nprIdState, "value");
+		if (id != NULL && strlen(id) <= NPR_ID_MAX_LENGTH) {
+			strcpy(nprId, id);
+		} else {
+			Log_Debug("WARNING: Unsupported nprId, keeping \"%s\".\n", nprId);
+		}
 		TwinReportStringState("nprId", nprId);
 		TwinReportStringState("nprId_property", nprId);
 	}
 
+    JSON_Object *captureRawTraceState =
+        json_object_dotget_object(desiredProperties, "CaptureRawTrace");
+    if (captureRawTraceState != NULL) {
+        captureRawTrace = (bool)json_object_get_boolean(captureRawTraceState, "value");
+        TwinReportBoolState("CaptureRawTrace", captureRawTrace);
+    }
+
+    JSON_Object *sampleRateState = json_object_dotget_object(desiredProperties, "SampleRate");
+    if (sampleRateState != NULL) {
+        int32_t sampleRate = (int32_t)json_object_get_number(sampleRateState, "value");
+        if (sampleRate == 25 || sampleRate == 50 || sampleRate == 100) {
+            desiredSampleRate = sampleRate;
+        } else {
+            Log_Debug("WARNING: Unsupported SampleRate %d, keeping %d.\n", sampleRate,
+                      desiredSampleRate);
+        }
+        TwinReportIntState("SampleRate", desiredSampleRate);
+    }
+
+    JSON_Object *windowSecondsState =
+        json_object_dotget_object(desiredProperties, "WindowSeconds");
+    if (windowSecondsState != NULL) {
+        int32_t windowSeconds = (int32_t)json_object_get_number(windowSecondsState, "value");
+        if (windowSeconds >= 1 && windowSeconds <= RF_MAX_ST) {
+            desiredWindowSeconds = windowSeconds;
+        } else {
+            Log_Debug("WARNING: Unsupported WindowSeconds %d, keeping %d.\n", windowSeconds,
+                      desiredWindowSeconds);
+        }
+        TwinReportIntState("WindowSeconds", desiredWindowSeconds);
+    }
+
+    JSON_Object *monitoringIntervalState =
+        json_object_dotget_object(desiredProperties, "MonitoringIntervalMinutes");
+    if (monitoringIntervalState != NULL) {
+        int32_t minutes = (int32_t)json_object_get_number(monitoringIntervalState, "value");
+        if (minutes >= 0 && minutes <= MaxMonitoringIntervalMinutes) {
+            monitoringIntervalMinutes = minutes;
+            UpdateMonitoringTimer();
+        } else {
+            Log_Debug("WARNING: Unsupported MonitoringIntervalMinutes %d, keeping %d.\n", minutes,
+                      monitoringIntervalMinutes);
+        }
+        TwinReportIntState("MonitoringIntervalMinutes", monitoringIntervalMinutes);
+    }
+
+    JSON_Object *monitoringValidWindowsState =
+        json_object_dotget_object(desiredProperties, "MonitoringValidWindows");
+    if (monitoringValidWindowsState != NULL) {
+        int32_t windows = (int32_t)json_object_get_number(monitoringValidWindowsState, "value");
+        if (windows >= 1 && windows <= TELEMETRY_BATCH_MAX_WINDOWS) {
+            monitoringValidWindows = windows;
+        } else {
+            Log_Debug("WARNING: Unsupported MonitoringValidWindows %d, keeping %d.\n", windows,
+                      monitoringValidWindows);
+        }
+        TwinReportIntState("MonitoringValidWindows", monitoringValidWindows);
+    }
+
+    JSON_Object *monitoringTimeoutState =
+        json_object_dotget_object(desiredProperties, "MonitoringTimeoutSeconds");
+    if (monitoringTimeoutState != NULL) {
+        int32_t seconds = (int32_t)json_object_get_number(monitoringTimeoutState, "value");
+        if (seconds >= MinMonitoringTimeoutSeconds && seconds <= MaxMonitoringTimeoutSeconds) {
+            monitoringTimeoutSeconds = seconds;
+        } else {
+            Log_Debug("WARNING: Unsupported MonitoringTimeoutSeconds %d, keeping %d.\n", seconds,
+                      monitoringTimeoutSeconds);
+        }
+        TwinReportIntState("MonitoringTimeoutSeconds", monitoringTimeoutSeconds);
+    }
+
+    JSON_Object *heartRateDeadbandState =
+        json_object_dotget_object(desiredProperties, "TelemetryDeadbandHeartRate");
+    if (heartRateDeadbandState != NULL) {
+        int32_t deadband = (int32_t)json_object_get_number(heartRateDeadbandState, "value");
+        if (deadband >= 0 && deadband <= MaxTelemetryDeadband) {
+            telemetryFilter.config.heartRateDeadband = deadband;
+        } else {
+            Log_Debug("WARNING: Unsupported TelemetryDeadbandHeartRate %d, keeping %d.\n",
+                      deadband, telemetryFilter.config.heartRateDeadband);
+        }
+        TwinReportIntState("TelemetryDeadbandHeartRate", telemetryFilter.config.heartRateDeadband);
+    }
+
+    JSON_Object *spo2DeadbandState =
+        json_object_dotget_object(desiredProperties, "TelemetryDeadbandSpO2");
+    if (spo2DeadbandState != NULL) {
+        int32_t deadband = (int32_t)json_object_get_number(spo2DeadbandState, "value");
+        if (deadband >= 0 && deadband <= MaxTelemetryDeadband) {
+            telemetryFilter.config.spo2Deadband = deadband;
+        } else {
+            Log_Debug("WARNING: Unsupported TelemetryDeadbandSpO2 %d, keeping %d.\n", deadband,
+                      telemetryFilter.config.spo2Deadband);
+        }
+        TwinReportIntState("TelemetryDeadbandSpO2", telemetryFilter.config.spo2Deadband);
+    }
+
+    JSON_Object *heartbeatState =
+        json_object_dotget_object(desiredProperties, "TelemetryHeartbeatMinutes");
+    if (heartbeatState != NULL) {
+        int32_t minutes = (int32_t)json_object_get_number(heartbeatState, "value");
+        if (minutes >= 1 && minutes <= MaxTelemetryHeartbeatMinutes) {
+            telemetryFilter.config.heartbeatSeconds = minutes * 60;
+        } else {
+            Log_Debug("WARNING: Unsupported TelemetryHeartbeatMinutes %d, keeping %d.\n", minutes,
+                      telemetryFilter.config.heartbeatSeconds / 60);
+        }
+        TwinReportIntState("TelemetryHeartbeatMinutes",
+                           telemetryFilter.config.heartbeatSeconds / 60);
+    }
+
+    static const char *const buttonPollNames[] = {"ButtonIdlePollMilliseconds",
+                                                  "ButtonDebouncePollMilliseconds"};
+    int32_t *const buttonPollValues[] = {&buttonIdlePollMilliseconds,
+                                         &buttonDebouncePollMilliseconds};
+    for (size_t i = 0; i < sizeof(buttonPollNames) / sizeof(buttonPollNames[0]); i++) {
+        JSON_Object *buttonPollState =
+            json_object_dotget_object(desiredProperties, buttonPollNames[i]);
+        if (buttonPollState != NULL) {
+            int32_t milliseconds = (int32_t)json_object_get_number(buttonPollState, "value");
+            if (milliseconds >= 1 && milliseconds <= MaxButtonPollMilliseconds) {
+                *buttonPollValues[i] = milliseconds;
+                struct timespec period = GetButtonPollPeriod();
+                if (buttonPollTimerFd >= 0 && SetTimerFdToPeriod(buttonPollTimerFd, &period) != 0) {
+                    terminationRequired = true;
+                }
+            } else {
+                Log_Debug("WARNING: Unsupported %s %d, keeping %d.\n", buttonPollNames[i],
+                          milliseconds, *buttonPollValues[i]);
+            }
+            TwinReportIntState(buttonPollNames[i], *buttonPollValues[i]);
+        }
+    }
+
+    JSON_Object *buttonDebounceState =
+        json_object_dotget_object(desiredProperties, "ButtonDebounceMilliseconds");
+    if (buttonDebounceState != NULL) {
+        int32_t milliseconds = (int32_t)json_object_get_number(buttonDebounceState, "value");
+        if (milliseconds >= 0 && milliseconds <= MaxButtonDebounceMilliseconds) {
+            buttonDebounceMilliseconds = milliseconds;
+        } else {
+            Log_Debug("WARNING: Unsupported ButtonDebounceMilliseconds %d, keeping %d.\n",
+                      milliseconds, buttonDebounceMilliseconds);
+        }
+        TwinReportIntState("ButtonDebounceMilliseconds", buttonDebounceMilliseconds);
+    }
+
 cleanup:
     // Release the allocated memory.
-    json_value_free(rootProperties);
-    free(nullTerminatedJsonString);
+    if (parsedInArena) {
+        json_arena_reset(&twinArena);
+    } else {
+        json_value_free(rootProperties);
+    }
 }
 
 /// <summary>
@@ -532,137 +1270,368 @@ static const char *getAzureSphereProvisioningResultString(
 /// </summary>
 /// <param name="key">The telemetry item to update</param>
 /// <param name="value">new telemetry value</param>
-static void SendTelemetry(const unsigned char *key, const unsigned char *value)
+/// <returns>true if IoTHubClient accepted the message for delivery</returns>
+static bool SendTelemetry(const char *key, const char *value)
 {
     static char eventBuffer[100] = {0};
     static const char *EventMsgTemplate = "{ \"%s\": \"%s\" }";
     int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, key, value);
     if (len < 0)
-        return;
+        return false;
+
+    return SendTelemetryMessage(eventBuffer);
+}
 
-    Log_Debug("Sending IoT Hub Message: %s\n", eventBuffer);
+/// <summary>
+///     Sends a complete JSON telemetry message to IoT Hub
+/// </summary>
+/// <param name="message">The JSON message body</param>
+/// <returns>true if IoTHubClient accepted the message for delivery</returns>
+static bool SendTelemetryMessage(const char *message)
+{
+    Log_Debug("Sending IoT Hub Message: %s\n", message);
 
-    IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(eventBuffer);
+    IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(message);
 
     if (messageHandle == 0) {
         Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
-        return;
+        return false;
+    }
+
+    // Lets IoT Hub routing and IoT Central parse the body as JSON
+    return SendIoTHubMessage(messageHandle, "application%2Fjson", "utf-8", SendMessageCallback,
+                             NULL);
+}
+
+/// <summary>
+///     Sets the content type and encoding of a message, hands it over to IoT Hub and destroys it
+/// </summary>
+/// <param name="messageHandle">The message to send</param>
+/// <param name="contentType">URL encoded content type of the message body</param>
+/// <param name="contentEncoding">Content encoding of the message body</param>
+/// <param name="callback">Callback invoked when IoT Hub confirms the message</param>
+/// <param name="context">Context passed to the callback</param>
+/// <returns>true if IoTHubClient accepted the message for delivery</returns>
+static bool SendIoTHubMessage(IOTHUB_MESSAGE_HANDLE messageHandle, const char *contentType,
+                              const char *contentEncoding,
+                              IOTHUB_CLIENT_EVENT_CONFIRMATION_CALLBACK callback, void *context)
+{
+    MessageConfirmation *confirmation = malloc(sizeof(*confirmation));
+    if (confirmation == NULL) {
+        Log_Debug("WARNING: unable to allocate the confirmation of the IoTHubMessage\n");
+        IoTHubMessage_Destroy(messageHandle);
+        return false;
+    }
+    confirmation->callback = callback;
+    confirmation->context = context;
+    confirmation->sendTime = METRICS_NOW();
+
+    if (IoTHubMessage_SetContentTypeSystemProperty(messageHandle, contentType) !=
+            IOTHUB_MESSAGE_OK ||
+        IoTHubMessage_SetContentEncodingSystemProperty(messageHandle, contentEncoding) !=
+            IOTHUB_MESSAGE_OK) {
+        Log_Debug("WARNING: unable to set the content type of the IoTHubMessage\n");
     }
 
-    if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, SendMessageCallback,
-                                             /*&callback_param*/ 0) != IOTHUB_CLIENT_OK) {
+    bool accepted =
+        IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle,
+                                             MessageConfirmationCallback,
+                                             confirmation) == IOTHUB_CLIENT_OK;
+    if (!accepted) {
         Log_Debug("WARNING: failed to hand over the message to IoTHubClient\n");
+        free(confirmation);
     } else {
         Log_Debug("INFO: IoTHubClient accepted the message for delivery\n");
+        BeginOutbound();
     }
 
     IoTHubMessage_Destroy(messageHandle);
+    return accepted;
 }
 
 /// <summary>
-///     Callback confirming message delivered to IoT Hub.
+///     Confirmation callback of every message sent by SendIoTHubMessage. Records the send to
+///     confirm latency with the send time of this very message, as IoT Hub may confirm messages
+///     out of order, and passes the result on to the callback given to SendIoTHubMessage.
 /// </summary>
 /// <param name="result">Message delivery status</param>
-/// <param name="context">User specified context</param>
-static void SendMessageCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void *context)
+/// <param name="context">The MessageConfirmation of the message</param>
+static void MessageConfirmationCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void *context)
 {
-    Log_Debug("INFO: Message received by IoT Hub. Result is: %d\n", result);
+    MessageConfirmation *confirmation = context;
+    METRICS_RECORD_DURATION(MetricTimer_SendToConfirm, confirmation->sendTime);
+    if (confirmation->callback != NULL) {
+        confirmation->callback(result, confirmation->context);
+    }
+    free(confirmation);
+    EndOutbound();
 }
 
 /// <summary>
-///     Creates and enqueues a report containing the name and value pair of a Device Twin reported
-///     property. The report is not sent immediately, but it is sent on the next invocation of
-///     IoTHubDeviceClient_LL_DoWork().
+///     Hands the messages waiting in the offline queue over to IoTHubClient, at most one drain
+///     batch at a time. The rest follows once IoT Hub has confirmed the batch.
 /// </summary>
-/// <param name="propertyName">the IoT Hub Device Twin property name</param>
-/// <param name="propertyValue">the IoT Hub Device Twin property value</param>
-static void TwinReportBoolState(const unsigned char *propertyName, bool propertyValue)
+static void DrainOfflineQueue(void)
 {
-    if (iothubClientHandle == NULL) {
-        Log_Debug("ERROR: client not initialized\n");
-    } else {
-        static char reportedPropertiesString[30] = {0};
-        int len = snprintf(reportedPropertiesString, 30, "{\"%s\":%s}", propertyName,
-                           (propertyValue == true ? "true" : "false"));
-        if (len < 0)
+    static char messageBuffer[OFFLINE_QUEUE_MAX_MESSAGE_SIZE + 1];
+    size_t length;
+    uint32_t sequence;
+
+    if (!iothubAuthenticated) {
+        return;
+    }
+
+    while (GetNextOfflineMessage(messageBuffer, sizeof(messageBuffer) - 1, &length, &sequence)) {
+        messageBuffer[length] = '\0';
+        Log_Debug("Sending queued IoT Hub Message %u: %s\n", sequence, messageBuffer);
+
+        IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(messageBuffer);
+        if (messageHandle == 0) {
+            Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
+            AcknowledgeOfflineMessage(sequence, false);
             return;
+        }
 
-        if (IoTHubDeviceClient_LL_SendReportedState(
-                iothubClientHandle, (unsigned char *)reportedPropertiesString,
-                strlen(reportedPropertiesString), ReportStatusCallback, 0) != IOTHUB_CLIENT_OK) {
-            Log_Debug("ERROR: failed to set reported state for '%s'.\n", propertyName);
-        } else {
-            Log_Debug("INFO: Reported state for '%s' to value '%s'.\n", propertyName,
-                      (propertyValue == true ? "true" : "false"));
+        // Lets the receiver drop messages resent after a lost confirmation
+        char sequenceString[11];
+        snprintf(sequenceString, sizeof(sequenceString), "%u", sequence);
+        if (IoTHubMessage_SetProperty(messageHandle, "sequence", sequenceString) !=
+            IOTHUB_MESSAGE_OK) {
+            Log_Debug("WARNING: unable to set the sequence number of the IoTHubMessage\n");
+        }
+
+        if (!SendIoTHubMessage(messageHandle, "application%2Fjson", "utf-8",
+                               OfflineMessageCallback, (void *)(uintptr_t)sequence)) {
+            AcknowledgeOfflineMessage(sequence, false);
+            return;
         }
     }
 }
 
 /// <summary>
-///     Creates and enqueues a report containing the name and value pair of a Device Twin reported
-///     property. The report is not sent immediately, but it is sent on the next invocation of
-///     IoTHubDeviceClient_LL_DoWork().
+///     Callback confirming a message from the offline queue delivered to IoT Hub.
 /// </summary>
-/// <param name="propertyName">the IoT Hub Device Twin property name</param>
-/// <param name="propertyValue">the IoT Hub Device Twin property value</param>
-static void TwinReportStringState(const unsigned char* propertyName, const unsigned char* propertyValue)
+/// <param name="result">Message delivery status</param>
+/// <param name="context">Sequence number of the message</param>
+static void OfflineMessageCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void *context)
 {
-	if (iothubClientHandle == NULL) {
-		Log_Debug("ERROR: client not initialized\n");
-	}
-	else {
-		static char reportedPropertiesString[40] = { 0 };
-		int len = snprintf(reportedPropertiesString, 40, "{\"%s\":\"%s\"}", propertyName,
-			propertyValue);
-		if (len < 0)
-			return;
-		Log_Debug("Sending IoT Hub Message Reported state: %s\n", reportedPropertiesString);
-		if (IoTHubDeviceClient_LL_SendReportedState(
-			iothubClientHandle, (unsigned char*)reportedPropertiesString,
-			strlen(reportedPropertiesString), ReportStatusCallback, 0) != IOTHUB_CLIENT_OK) {
-			Log_Debug("ERROR: failed to set reported state for '%s'.\n", propertyName);
-		}
-		else {
-			Log_Debug("INFO: Reported state for '%s' to value '%s'.\n", propertyName,
-				propertyValue);
-		}
-	}
+    uint32_t sequence = (uint32_t)(uintptr_t)context;
+    Log_Debug("INFO: Queued message %u received by IoT Hub. Result is: %d\n", sequence, result);
+    AcknowledgeOfflineMessage(sequence, result == IOTHUB_CLIENT_CONFIRMATION_OK);
 }
 
 /// <summary>
-///     Callback invoked when the Device Twin reported properties are accepted by IoT Hub.
+///     Callback confirming message delivered to IoT Hub.
 /// </summary>
-static void ReportStatusCallback(int result, void *context)
+/// <param name="result">Message delivery status</param>
+/// <param name="context">User specified context</param>
+static void SendMessageCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void *context)
 {
-    Log_Debug("INFO: Device Twin reported properties update result: HTTP status code %d\n", result);
+    Log_Debug("INFO: Message received by IoT Hub. Result is: %d\n", result);
 }
 
 /// <summary>
-///     Generates a simulated Temperature and sends to IoT Hub.
+///     Records a Device Twin reported property. The properties recorded during one pass of the
+///     Azure timer are sent together by FlushReportedState.
 /// </summary>
-void SendDeviceHeartbeat(void)
+/// <param name="propertyName">the IoT Hub Device Twin property name</param>
+/// <param name="propertyValue">the IoT Hub Device Twin property value</param>
+static void TwinReportBoolState(const char *propertyName, bool propertyValue)
 {
-	SendTelemetry("device_heartbeat", "True");
+    if (!SetReportedBool(propertyName, propertyValue)) {
+        Log_Debug("ERROR: failed to set reported state for '%s'.\n", propertyName);
+        return;
+    }
+    Log_Debug("INFO: Reported state for '%s' to value '%s'.\n", propertyName,
+              (propertyValue == true ? "true" : "false"));
+    UpdateAzureTimerPeriod();
 }
 
 /// <summary>
-///     Check whether a given button has just been pressed.
+///     Records a Device Twin reported property. The properties recorded during one pass of the
+///     Azure timer are sent together by FlushReportedState.
 /// </summary>
-/// <param name="fd">The button file descriptor</param>
-/// <param name="oldState">Old state of the button (pressed or released)</param>
-/// <returns>true if pressed, false otherwise</returns>
-static bool IsButtonPressed(int fd, GPIO_Value_Type *oldState)
+/// <param name="propertyName">the IoT Hub Device Twin property name</param>
+/// <param name="propertyValue">the IoT Hub Device Twin property value</param>
+static void TwinReportIntState(const char *propertyName, int propertyValue)
 {
-    bool isButtonPressed = false;
-    GPIO_Value_Type newState;
-    int result = GPIO_GetValue(fd, &newState);
+    if (!SetReportedInt(propertyName, propertyValue)) {
+        Log_Debug("ERROR: failed to set reported state for '%s'.\n", propertyName);
+        return;
+    }
+    Log_Debug("INFO: Reported state for '%s' to value '%d'.\n", propertyName, propertyValue);
+    UpdateAzureTimerPeriod();
+}
+
+/// <summary>
+///     Records a Device Twin reported property. The properties recorded during one pass of the
+///     Azure timer are sent together by FlushReportedState.
+/// </summary>
+/// <param name="propertyName">the IoT Hub Device Twin property name</param>
+/// <param name="propertyValue">the IoT Hub Device Twin property value</param>
+static void TwinReportStringState(const char *propertyName, const char *propertyValue)
+{
+    if (!SetReportedString(propertyName, propertyValue)) {
+        Log_Debug("ERROR: failed to set reported state for '%s'.\n", propertyName);
+        return;
+    }
+    Log_Debug("INFO: Reported state for '%s' to value '%s'.\n", propertyName, propertyValue);
+    UpdateAzureTimerPeriod();
+}
+
+/// <summary>
+///     Sends the reported properties recorded since the last flush as one reported state update.
+///     The update is not sent immediately, but it is sent on the next invocation of
+///     IoTHubDeviceClient_LL_DoWork(). If IoTHubClient does not take it, the properties stay
+///     pending for the next flush.
+/// </summary>
+static void FlushReportedState(void)
+{
+    char *reportedPropertiesString = FormatReportedState();
+    if (reportedPropertiesString == NULL) {
+        return;
+    }
+
+    if (IoTHubDeviceClient_LL_SendReportedState(
+            iothubClientHandle, (unsigned char *)reportedPropertiesString,
+            strlen(reportedPropertiesString), ReportStatusCallback, 0) != IOTHUB_CLIENT_OK) {
+        Log_Debug("ERROR: failed to send reported state.\n");
+    } else {
+        Log_Debug("Sending IoT Hub Message Reported state: %s\n", reportedPropertiesString);
+        MarkReportedStateSent();
+        BeginOutbound();
+    }
+    json_free_serialized_string(reportedPropertiesString);
+}
+
+/// <summary>
+///     Callback invoked when the Device Twin reported properties are accepted by IoT Hub.
+/// </summary>
+static void ReportStatusCallback(int result, void *context)
+{
+    Log_Debug("INFO: Device Twin reported properties update result: HTTP status code %d\n", result);
+    if (result < 200 || result >= 300) {
+        // The hub may not have the values recorded as sent; send them again when next set
+        ForgetReportedState();
+    }
+    EndOutbound();
+}
+
+#ifdef METRICS_ENABLED
+/// <summary>
+///     Reports the metrics gathered since the last report as the "Metrics" Device Twin
+///     property and starts a new metrics period.
+/// </summary>
+static void TwinReportMetrics(void)
+{
+    static char reportedPropertiesString[METRICS_SNAPSHOT_SIZE];
+
+    lastMetricsReportTime = METRICS_NOW();
+    int len = FormatMetricsSnapshot(reportedPropertiesString, sizeof(reportedPropertiesString));
+    ResetMetrics();
+    if (len < 0)
+        return;
+
+    if (!MergeReportedState(reportedPropertiesString)) {
+        Log_Debug("ERROR: failed to set reported state for 'Metrics'.\n");
+    } else {
+        Log_Debug("INFO: Reported metrics: %s\n", reportedPropertiesString);
+    }
+}
+#endif
+
+/// <summary>
+///     Counts a message or reported state update handed over to IoTHubClient.
+/// </summary>
+static void BeginOutbound(void)
+{
+    pendingOutboundCount++;
+    UpdateAzureTimerPeriod();
+}
+
+/// <summary>
+///     Counts a confirmation from IoT Hub for a message or reported state update.
+/// </summary>
+static void EndOutbound(void)
+{
+    if (pendingOutboundCount > 0) {
+        pendingOutboundCount--;
+    }
+    UpdateAzureTimerPeriod();
+}
+
+/// <summary>
+///     Runs DoWork at the short AzureIoTBusyPollPeriod while anything is pending, so it goes on
+///     the wire right away, or while a new client connects, and returns to
+///     azureIoTPollPeriodSeconds once all is confirmed.
+/// </summary>
+static void UpdateAzureTimerPeriod(void)
+{
+    bool busy = iothubClientConnecting ||
+                (iothubAuthenticated && (pendingOutboundCount > 0 || IsReportedStatePending()));
+    struct timespec period = {azureIoTPollPeriodSeconds, 0};
+    if (busy) {
+        period = AzureIoTBusyPollPeriod;
+    }
+    if (period.tv_sec == azureTimerPeriod.tv_sec && period.tv_nsec == azureTimerPeriod.tv_nsec) {
+        return;
+    }
+
+    azureTimerPeriod = period;
+    if (SetTimerFdToPeriod(azureTimerFd, &azureTimerPeriod) != 0) {
+        terminationRequired = true;
+    }
+}
+
+/// <summary>
+///     Generates a simulated Temperature and sends to IoT Hub.
+/// </summary>
+void SendDeviceHeartbeat(void)
+{
+	if (SendTelemetry("device_heartbeat", "True")) {
+		MarkTelemetrySent(&telemetryFilter, GetMonotonicSeconds());
+	}
+}
+
+/// <summary>
+///     Returns the seconds of CLOCK_MONOTONIC, which the telemetry filter keeps time by.
+/// </summary>
+static time_t GetMonotonicSeconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+/// <summary>
+///     Check whether a given button has just been pressed. Called once per button poll; a new
+///     level only counts once it has held for buttonDebounceMilliseconds.
+/// </summary>
+/// <param name="fd">The button file descriptor</param>
+/// <param name="state">Debounce state of the button (pressed or released)</param>
+/// <returns>true if pressed, false otherwise</returns>
+static bool IsButtonPressed(int fd, ButtonState *state)
+{
+    bool isButtonPressed = false;
+    GPIO_Value_Type newState;
+    int result = GPIO_GetValue(fd, &newState);
     if (result != 0) {
         Log_Debug("ERROR: Could not read button GPIO: %s (%d).\n", strerror(errno), errno);
         terminationRequired = true;
+    } else if (newState == state->stableState) {
+        // Bounced back before the debounce time
+        state->changingState = newState;
+    } else if (newState != state->changingState) {
+        // First sample at the new level; it was taken at the idle poll period
+        state->changingState = newState;
+        state->changingMilliseconds = 0;
     } else {
-        // Button is pressed if it is low and different than last known state.
-        isButtonPressed = (newState != *oldState) && (newState == GPIO_Value_Low);
-        *oldState = newState;
+        state->changingMilliseconds += buttonDebouncePollMilliseconds;
+        if (state->changingMilliseconds >= buttonDebounceMilliseconds) {
+            // Button is pressed if it is low and different than last known state.
+            isButtonPressed = (newState == GPIO_Value_Low);
+            state->stableState = newState;
+        }
     }
 
     return isButtonPressed;
@@ -674,81 +1643,684 @@ static bool IsButtonPressed(int fd, GPIO_Value_Type *oldState)
 /// </summary>
 static void SendTelemetryButtonHandler(void)
 {
-	if (IsButtonPressed(sendTelemetryButtonGpioFd, &sendTelemetryButtonState))
-	{
-		float    n_spo2, ratio, correl;                                       //SPO2 value
-		int8_t   ch_spo2_valid;                                               //indicator to show if the SPO2 calculation is valid
-		int32_t  n_heart_rate;                                                //heart rate value
-		int8_t   ch_hr_valid;                                                 //indicator to show if the heart rate calculation is valid
-		uint32_t aun_ir_buffer[BUFFER_SIZE];                                  //infrared LED sensor data
-		uint32_t aun_red_buffer[BUFFER_SIZE];                                 //red LED sensor data
-		int32_t  i;
-		int32_t  average_hr;
-		float    average_spo2;
-		int32_t  nbr_readings;
-
-		int            run_time = 6;  //default to 30 second run time
-		struct timeval time_start, time_now;
-
-		maxim_max30102_init();
-
-		Log_Debug("\nRunning test for %d seconds.\n", run_time);
-		Log_Debug("HeartRate Click Revision: 0x%02X\n", max30102_get_revision());
-		Log_Debug("HeartRate Click Part ID:  0x%02X\n\n", max30102_get_part_id());
-		Log_Debug("Begin ... Place your finger on the sensor\n\n");
-
-		gettimeofday(&time_start, NULL);
-		time_now = time_start;
-		average_hr = nbr_readings = 0;
-		average_spo2 = 0.0;
-
-		while (difftime(time_now.tv_sec, time_start.tv_sec) < run_time) {
-			//buffer length of BUFFER_SIZE stores ST seconds of samples running at FS sps
-			//read BUFFER_SIZE samples, and determine the signal range
-			GPIO_Value_Type intVal;
-			for (i = 0; i < BUFFER_SIZE; i++) {
-				do {
-					GPIO_GetValue(intPinFd, &intVal);
-				} while (intVal == 1);                               //wait until the interrupt pin asserts
-
-				maxim_max30102_read_fifo((aun_red_buffer + i), (aun_ir_buffer + i));   //read from MAX30102 FIFO
-				Log_Debug("*");
-			}
-			Log_Debug("\n");
-			//calculate heart rate and SpO2 after BUFFER_SIZE samples (ST seconds of samples) using Robert's method
-			rf_heart_rate_and_oxygen_saturation(aun_ir_buffer, BUFFER_SIZE, aun_red_buffer, &n_spo2, &ch_spo2_valid, &n_heart_rate, &ch_hr_valid, &ratio, &correl);
-
-			if (ch_hr_valid && ch_spo2_valid) {
-				Log_Debug("Blood Oxygen Level (SpO2)=%.2f%% [normal is 95-100%%], Heart Rate=%d BPM [normal resting for adults is 60-100 BPM]\n", n_spo2, n_heart_rate);
-
-				average_hr += n_heart_rate;
-				average_spo2 += n_spo2;
-				nbr_readings++;
-			}
-			else
-				Log_Debug("ch_hr_valid=%d, ch_spo2_valid=%d\n", ch_hr_valid, ch_spo2_valid);
-
-			gettimeofday(&time_now, NULL);
-		}
+    if (IsButtonPressed(sendTelemetryButtonGpioFd, &sendTelemetryButtonState)) {
+        if (measurementState != MeasurementState_Idle) {
+            Log_Debug("INFO: Measurement already in progress.\n");
+            return;
+        }
+        SetMeasurementState(MeasurementState_Starting);
+    }
+}
 
-		if (nbr_readings > 0) 
-		{
-			Log_Debug("\n\nAverage Blood Oxygen Level = %.2f%%\n", average_spo2 / (float)nbr_readings);
-			Log_Debug("        Average Heart Rate = %d BPM\n", average_hr / nbr_readings);
-
-			char n_heart_rate_string[10];
-			int n_heart_rate_string_len = snprintf(n_heart_rate_string, 10, "%d", average_hr / nbr_readings);
-			if (n_heart_rate_string_len > 0) {
-				SendTelemetry("Heart_rate", n_heart_rate_string);
-			}
-
-			char n_spo2_string[10];
-			int n_spo2_string_len = snprintf(n_spo2_string, 10, "%3.2f", average_spo2 / (float)nbr_readings);
-			if (n_spo2_string_len > 0) {
-				SendTelemetry("SpO2", n_spo2_string);
-			}
-		}
+/// <summary>
+///     Moves the measurement state machine to newState. States other than Collecting,
+///     WaitingForFinger and Idle are run from the next MeasurementStepTimerEventHandler.
+/// </summary>
+static void SetMeasurementState(MeasurementState newState)
+{
+    measurementState = newState;
+    if (newState != MeasurementState_Collecting && newState != MeasurementState_Idle &&
+        newState != MeasurementState_WaitingForFinger) {
+        if (SetTimerFdToSingleExpiry(measurementStepTimerFd, &measurementStepDelay) != 0) {
+            terminationRequired = true;
+        }
+    }
+}
+
+/// <summary>
+///     Returns the number of measurement arena bytes a measurement with the given configuration
+///     takes: the two FIFO burst buffers, the window of the streaming estimator and the two
+///     raw capture blocks.
+/// </summary>
+static size_t GetMeasurementArenaFootprint(const rf_config *config)
+{
+    return 2 * MEASUREMENT_ARENA_FOOTPRINT(MAX30102_FIFO_DEPTH * sizeof(uint32_t)) +
+           MEASUREMENT_ARENA_FOOTPRINT(rf_stream_buffer_size(config)) +
+           2 * MEASUREMENT_ARENA_FOOTPRINT(PPG_BLOCK_MAX_SIZE((size_t)config->n_fs));
+}
+
+/// <summary>
+///     Applies the desired sampling configuration, powers up the MAX30102 and arms the HR4
+///     sample timer.
+/// </summary>
+static void StartMeasurement(void)
+{
+    rf_config_default(&measurementConfig);
+    if (!rf_configure(&measurementConfig, desiredSampleRate, desiredWindowSeconds) ||
+        !maxim_max30102_init_sample_rate(measurementConfig.n_fs)) {
+        Log_Debug("ERROR: Cannot sample at %d sps for %d s, using the defaults.\n",
+                  desiredSampleRate, desiredWindowSeconds);
+        rf_config_default(&measurementConfig);
+        maxim_max30102_init();
+    }
+    // Start with the settings the last measurement ended with
+    ledAdjustmentCount = 0;
+    if (!ApplyLedSettings()) {
+        Log_Debug("ERROR: Could not set the LED currents and ADC range.\n");
+    }
+    // Keep the autocorrelation sequence up to date per sample, so every estimate costs the same
+    measurementConfig.n_periodicity_search = RF_PERIODICITY_SEQUENCE;
+    measurementRunTimeSeconds = measurementConfig.n_st + 2;
+    hr4SamplePollPeriod.tv_nsec =
+        MAX30102_FIFO_A_FULL_SAMPLES * (1000 * 1000 * 1000 / measurementConfig.n_fs);
+
+    Log_Debug("\nRunning test for %d seconds.\n", measurementRunTimeSeconds);
+    Log_Debug("HeartRate Click Revision: 0x%02X\n", max30102_get_revision());
+    Log_Debug("HeartRate Click Part ID:  0x%02X\n\n", max30102_get_part_id());
+    Log_Debug("Begin ... Place your finger on the sensor\n\n");
+
+    ResetMeasurementArena();
+    aun_ir_buffer = AllocateFromMeasurementArena(MAX30102_FIFO_DEPTH * sizeof(uint32_t));
+    aun_red_buffer = AllocateFromMeasurementArena(MAX30102_FIFO_DEPTH * sizeof(uint32_t));
+    measurementWindowBuffer =
+        AllocateFromMeasurementArena(rf_stream_buffer_size(&measurementConfig));
+    if (aun_ir_buffer == NULL || aun_red_buffer == NULL || measurementWindowBuffer == NULL) {
+        SetMeasurementState(MeasurementState_ShuttingDown);
+        return;
+    }
+    if (!AllocateCaptureBlocks()) {
+        SetMeasurementState(MeasurementState_ShuttingDown);
+        return;
+    }
+    Log_Debug("INFO: Measurement arena high-water mark: %zu of %zu bytes.\n",
+              GetMeasurementArenaHighWaterMark(), (size_t)MEASUREMENT_ARENA_SIZE);
+
+    clock_gettime(CLOCK_MONOTONIC, &measurementStartTime);
+    rf_stream_init(&measurementStream, &measurementConfig, measurementConfig.n_fs,
+                   measurementWindowBuffer);
+    ClearTelemetryBatch(&measurementBatch);
+
+    if (SetTimerFdToPeriod(hr4SampleTimerFd, &hr4SamplePollPeriod) != 0) {
+        SetMeasurementState(MeasurementState_ShuttingDown);
+        return;
+    }
+    SetMeasurementState(MeasurementState_Collecting);
+}
+
+/// <summary>
+///     Starts a scheduled measurement: wakes the MAX30102 in proximity mode and polls for a
+///     finger until the monitoring timeout. The measurement gets a timeout of its own.
+/// </summary>
+static void StartScheduledMeasurement(void)
+{
+    scheduledMeasurement = true;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    monitoringDeadline = now.tv_sec + monitoringTimeoutSeconds;
+    Log_Debug("INFO: Scheduled measurement, waiting up to %d s for a finger.\n",
+              monitoringTimeoutSeconds);
+
+#ifdef HR4_RTAPP
+    // The real-time app owns the sensor, so the measurement starts right away
+    SetMeasurementState(MeasurementState_Starting);
+#else
+    if (!maxim_max30102_init() ||
+        !maxim_max30102_enable_proximity(PROXIMITY_THRESHOLD / MAX30102_PROX_THRESH_COUNTS)) {
+        Log_Debug("ERROR: Could not enable the MAX30102 proximity interrupt.\n");
+        SetMeasurementState(MeasurementState_ShuttingDown);
+        return;
+    }
+    if (SetTimerFdToPeriod(hr4SampleTimerFd, &fingerPollPeriod) != 0) {
+        SetMeasurementState(MeasurementState_ShuttingDown);
+        return;
+    }
+    SetMeasurementState(MeasurementState_WaitingForFinger);
+#endif
+}
+
+/// <summary>
+///     Starts the measurement once the proximity interrupt reports a finger, with a new
+///     monitoring timeout, or gives up on this round at the monitoring timeout. The INT pin is
+///     read first, so no I2C transfer is made while it is idle.
+/// </summary>
+static void CheckForFinger(void)
+{
+    // INT is active low; without the pin the status register is read every time
+    GPIO_Value_Type intValue = GPIO_Value_Low;
+    if (intPinFd < 0 || GPIO_GetValue(intPinFd, &intValue) != 0) {
+        intValue = GPIO_Value_Low;
+    }
+    int detected = 0;
+    if (intValue == GPIO_Value_Low && !maxim_max30102_read_proximity(&detected)) {
+        Log_Debug("ERROR: Could not read the MAX30102 interrupt status.\n");
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (detected) {
+        // However late the finger came, the measurement gets the whole timeout
+        monitoringDeadline = now.tv_sec + monitoringTimeoutSeconds;
+        Log_Debug("INFO: Finger detected, measuring for up to %d s.\n", monitoringTimeoutSeconds);
+    } else if (now.tv_sec >= monitoringDeadline) {
+        Log_Debug("INFO: No finger on the sensor, skipping this measurement.\n");
+    } else {
+        return;
+    }
+
+    SetTimerFdToSingleExpiry(hr4SampleTimerFd, &timerDisabled);
+    SetMeasurementState(detected ? MeasurementState_Starting : MeasurementState_ShuttingDown);
+}
+
+/// <summary>
+///     Tells if the IR level of the window has fallen below PROXIMITY_THRESHOLD, the level at
+///     which the proximity interrupt reported the finger.
+/// </summary>
+static bool IsFingerLifted(void)
+{
+    rf_levels levels;
+    return rf_stream_levels(&measurementStream, &levels) && levels.f_dc_ir < PROXIMITY_THRESHOLD;
+}
+
+/// <summary>
+///     Arms the monitoring timer for monitoringIntervalMinutes, or disarms it for 0.
+/// </summary>
+static void UpdateMonitoringTimer(void)
+{
+    struct timespec period = {monitoringIntervalMinutes * 60, 0};
+    if (SetTimerFdToPeriod(monitoringTimerFd, &period) != 0) {
+        terminationRequired = true;
+    }
+}
+
+/// <summary>
+///     Takes the two raw capture blocks from the measurement arena and starts the first one,
+///     if CaptureRawTrace is set.
+/// </summary>
+/// <returns>false if the arena has no room for them</returns>
+static bool AllocateCaptureBlocks(void)
+{
+    activeCaptureBlock = NULL;
+    pendingCaptureBlock = NULL;
+    if (!captureRawTrace) {
+        return true;
+    }
+
+    captureBufferSize = PPG_BLOCK_MAX_SIZE((size_t)measurementConfig.n_fs);
+    for (size_t i = 0; i < 2; i++) {
+        captureBlocks[i].buffer = AllocateFromMeasurementArena(captureBufferSize);
+        if (captureBlocks[i].buffer == NULL) {
+            return false;
+        }
+    }
+    activeCaptureBlock = &captureBlocks[0];
+    BeginCaptureBlock(activeCaptureBlock);
+    return true;
+}
+
+/// <summary>
+///     Drains the MAX30102 FIFO into the sliding window. Reading stops at the sample that makes
+///     an estimate due, which is then handed to the Computing step; the rest stays in the FIFO.
+/// </summary>
+static void CollectMeasurementSamples(void)
+{
+    size_t n_max = (size_t)rf_stream_samples_until_output(&measurementStream);
+    if (n_max > MAX30102_FIFO_DEPTH) {
+        n_max = MAX30102_FIFO_DEPTH;
+    }
+
+    size_t n_read;
+    if (!maxim_max30102_read_fifo_burst(aun_red_buffer, aun_ir_buffer, n_max, &n_read)) {
+        Log_Debug("ERROR: Could not read the MAX30102 FIFO.\n");
+        return;
+    }
+
+    METRICS_ADD(MetricCounter_Samples, (uint32_t)n_read);
+    METRICS_ADD(MetricCounter_FifoOverflows, maxim_max30102_take_overflow_count());
+
+    for (size_t i = 0; i < n_read; i++) {
+        AddToCaptureBlock(aun_ir_buffer[i], aun_red_buffer[i]);
+        if (rf_stream_push(&measurementStream, aun_ir_buffer[i], aun_red_buffer[i])) {
+            SetMeasurementState(MeasurementState_Computing);
+        }
+    }
+}
+
+/// <summary>
+///     Calculates heart rate and SpO2 over the last BUFFER_SIZE samples (ST seconds of samples)
+///     using Robert's method, then either collects the next second of samples or publishes.
+/// </summary>
+static void ProcessMeasurementWindow(void)
+{
+    float    n_spo2, ratio, correl;                                       //SPO2 value
+    int8_t   ch_spo2_valid;                                               //indicator to show if the SPO2 calculation is valid
+    int32_t  n_heart_rate;                                                //heart rate value
+    int8_t   ch_hr_valid;                                                 //indicator to show if the heart rate calculation is valid
+
+    bool fingerLifted = false;
+
+    uint64_t start = METRICS_NOW();
+    rf_stream_estimate(&measurementStream, &n_spo2, &ch_spo2_valid, &n_heart_rate, &ch_hr_valid, &ratio, &correl);
+    METRICS_RECORD_DURATION(MetricTimer_Window, start);
+    METRICS_ADD(MetricCounter_Windows, 1);
+
+    bool windowValid = ch_hr_valid && ch_spo2_valid;
+    if (windowValid) {
+        Log_Debug("Blood Oxygen Level (SpO2)=%.2f%% [normal is 95-100%%], Heart Rate=%d BPM [normal resting for adults is 60-100 BPM]\n", n_spo2, n_heart_rate);
+
+        TelemetryReading reading = {.heartRate = n_heart_rate,
+                                    .spo2 = n_spo2,
+                                    .ratio = ratio,
+                                    .correl = correl,
+                                    .timestamp = time(NULL)};
+        AddToTelemetryBatch(&measurementBatch, &reading);
+    }
+    else {
+        Log_Debug("ch_hr_valid=%d, ch_spo2_valid=%d\n", ch_hr_valid, ch_spo2_valid);
+        METRICS_ADD(MetricCounter_InvalidWindows, 1);
+        fingerLifted = scheduledMeasurement && IsFingerLifted();
+    }
+
+    struct timespec time_now;
+    clock_gettime(CLOCK_MONOTONIC, &time_now);
+    bool finished;
+    if (scheduledMeasurement) {
+        finished = fingerLifted ||
+                   measurementBatch.count >= (size_t)monitoringValidWindows ||
+                   time_now.tv_sec >= monitoringDeadline;
+    } else {
+        finished = time_now.tv_sec - measurementStartTime.tv_sec >= measurementRunTimeSeconds;
+    }
+    if (finished || IsTelemetryBatchFull(&measurementBatch)) {
+        SetTimerFdToSingleExpiry(hr4SampleTimerFd, &timerDisabled);
+        SetMeasurementState(MeasurementState_Publishing);
+        return;
+    }
+
+    // Only a measurement that goes on is worth new LED settings
+    if (!windowValid && AdjustLedSettings()) {
+        SetMeasurementState(MeasurementState_Collecting);
+        return;
+    }
+
+    // Samples kept arriving while the window was computed; drain them now so the FIFO
+    // cannot overflow before the next HR4 sample timer event.
+    SetMeasurementState(MeasurementState_Collecting);
+    CollectMeasurementSamples();
+}
+
+/// <summary>
+///     Sends the readings of all valid windows as one telemetry message, then hands over to the
+///     ShuttingDown step.
+/// </summary>
+static void PublishMeasurement(void)
+{
+    static char messageBuffer[TELEMETRY_BATCH_MESSAGE_SIZE];
+    int length = -1;
+    TelemetryReading average;
+    if (GetTelemetryBatchAverage(&measurementBatch, &average)) {
+        TelemetryFilterDecision decision = FilterTelemetry(&telemetryFilter, average.heartRate,
+                                                           average.spo2, GetMonotonicSeconds());
+        if (decision == TelemetryFilter_Suppress) {
+            Log_Debug("INFO: Heart rate %d BPM and SpO2 %.2f%% unchanged, not sent.\n",
+                      average.heartRate, average.spo2);
+        } else {
+            if (decision == TelemetryFilter_Significant) {
+                Log_Debug("INFO: Significant change: heart rate %d BPM, SpO2 %.2f%%.\n",
+                          average.heartRate, average.spo2);
+            }
+            length = FormatTelemetryBatch(&measurementBatch, messageBuffer, sizeof(messageBuffer));
+        }
+    }
+
+    if (length > 0) {
+        Log_Debug("\n\nSending %zu readings in one message.\n", measurementBatch.count);
+        // Store the reading first, so it survives until IoT Hub has confirmed it
+        uint32_t sequence;
+        bool sent;
+        if (AppendToOfflineQueue(messageBuffer, (size_t)length, &sequence)) {
+            DrainOfflineQueue();
+            sent = true;
+        } else {
+            sent = SendTelemetryMessage(messageBuffer);
+        }
+        // A reading that was neither stored nor sent is not the last one sent
+        if (sent) {
+            MarkTelemetryReadingSent(&telemetryFilter, average.heartRate, average.spo2,
+                                     GetMonotonicSeconds());
+        }
+    }
+    ClearTelemetryBatch(&measurementBatch);
+    StopCapture();
+
+    SetMeasurementState(MeasurementState_ShuttingDown);
+}
+
+/// <summary>
+///     Sets the LED currents and the ADC range to ledSettings.
+/// </summary>
+/// <returns>true on success</returns>
+static bool ApplyLedSettings(void)
+{
+    return maxim_max30102_set_led_pa(ledSettings.redPulseAmplitude,
+                                     ledSettings.irPulseAmplitude) &&
+           maxim_max30102_set_adc_range(ledSettings.adcRangeNanoamps);
+}
+
+/// <summary>
+///     Corrects the LED currents and the ADC range after an invalid window whose signal does not
+///     fit the ADC range. The samples taken with the old settings are dropped: the FIFO is
+///     cleared and the window and the measurement run time start over.
+/// </summary>
+/// <returns>true if the settings changed</returns>
+static bool AdjustLedSettings(void)
+{
+    rf_levels levels;
+    if (ledAdjustmentCount >= MaxLedAdjustmentsPerMeasurement ||
+        !rf_stream_levels(&measurementStream, &levels) ||
+        !UpdateLedSettings(&ledSettings, levels.f_dc_ir, levels.f_ac_ir, levels.f_dc_red,
+                           levels.f_ac_red)) {
+        return false;
+    }
+
+    ledAdjustmentCount++;
+    Log_Debug("INFO: DC level IR %.0f, red %.0f: LED amplitudes now 0x%02X/0x%02X (IR/red), "
+              "ADC range %d nA.\n",
+              levels.f_dc_ir, levels.f_dc_red, ledSettings.irPulseAmplitude,
+              ledSettings.redPulseAmplitude, ledSettings.adcRangeNanoamps);
+    if (!ApplyLedSettings() || !maxim_max30102_clear_fifo()) {
+        Log_Debug("ERROR: Could not set the LED currents and ADC range.\n");
+    }
+
+    // The capture block so far was recorded with the old settings, the next one is not
+    CompleteCaptureBlock();
+    if (activeCaptureBlock != NULL) {
+        maxim_max30102_get_config(&activeCaptureBlock->sensorConfig);
+    }
+
+    rf_stream_init(&measurementStream, &measurementConfig, measurementConfig.n_fs,
+                   measurementWindowBuffer);
+    clock_gettime(CLOCK_MONOTONIC, &measurementStartTime);
+    return true;
+}
+
+/// <summary>
+///     Starts the next raw capture block in the given buffer and notes the sensor configuration
+///     it is recorded with.
+/// </summary>
+static void BeginCaptureBlock(CaptureBlock *captureBlock)
+{
+    // The blocks name the device, never the patient; the server finds the patient from the
+    // device as it does for the readings. Until the id can be read the field is left empty,
+    // and the device is only known from the connection the message arrives on.
+    if (deviceId[0] == '\0' &&
+        !ReadDeviceIdFromCertificate(DeviceAuth_GetCertificatePath(), deviceId, sizeof(deviceId))) {
+        deviceId[0] = '\0';
+    }
+    BeginPpgBlock(&captureBlock->block, captureBlock->buffer, captureBufferSize, deviceId,
+                  captureSequence++, (uint16_t)measurementConfig.n_fs);
+#ifdef HR4_RTAPP
+    captureBlock->sensorConfig = rtAppSensorConfig;
+#else
+    maxim_max30102_get_config(&captureBlock->sensorConfig);
+#endif
+}
+
+/// <summary>
+///     Appends a raw sample to the active capture block while capturing. The block is completed
+///     once it holds one second of samples.
+/// </summary>
+static void AddToCaptureBlock(uint32_t ir, uint32_t red)
+{
+    if (activeCaptureBlock == NULL) {
+        return;
+    }
+    if (!AddToPpgBlock(&activeCaptureBlock->block, ir, red)) {
+        CompleteCaptureBlock();
+        AddToPpgBlock(&activeCaptureBlock->block, ir, red);
+    }
+    if (activeCaptureBlock->block.sampleCount >= measurementConfig.n_fs) {
+        CompleteCaptureBlock();
+    }
+}
+
+/// <summary>
+///     Hands the active capture block over to captureSendTimerFd and continues in the other
+///     buffer. If the previous block has not been sent yet, the active block is dropped instead;
+///     the receiver sees the gap in the sequence numbers.
+/// </summary>
+static void CompleteCaptureBlock(void)
+{
+    if (activeCaptureBlock == NULL || activeCaptureBlock->block.sampleCount == 0) {
+        return;
+    }
+
+    if (pendingCaptureBlock != NULL) {
+        captureOverruns++;
+        Log_Debug("WARNING: Dropped raw capture block %u, %u dropped so far\n",
+                  captureSequence - 1, captureOverruns);
+        BeginCaptureBlock(activeCaptureBlock);
+        return;
+    }
+
+    FinishPpgBlock(&activeCaptureBlock->block);
+    pendingCaptureBlock = activeCaptureBlock;
+    activeCaptureBlock = activeCaptureBlock == &captureBlocks[0] ? &captureBlocks[1]
+                                                                 : &captureBlocks[0];
+    BeginCaptureBlock(activeCaptureBlock);
+    if (SetTimerFdToSingleExpiry(captureSendTimerFd, &measurementStepDelay) != 0) {
+        terminationRequired = true;
+    }
+}
+
+/// <summary>
+///     Sets a message property to a number.
+/// </summary>
+static void SetNumberProperty(IOTHUB_MESSAGE_HANDLE messageHandle, const char *name, int value)
+{
+    char valueString[12];
+    snprintf(valueString, sizeof(valueString), "%d", value);
+    if (IoTHubMessage_SetProperty(messageHandle, name, valueString) != IOTHUB_MESSAGE_OK) {
+        Log_Debug("WARNING: unable to set the %s property of the IoTHubMessage\n", name);
+    }
+}
+
+/// <summary>
+///     Sends the completed capture block, if any, with the sensor configuration as message
+///     properties.
+/// </summary>
+static void SendPendingCaptureBlock(void)
+{
+    if (pendingCaptureBlock == NULL) {
+        return;
+    }
+
+    const PpgBlock *block = &pendingCaptureBlock->block;
+    const max30102_config *config = &pendingCaptureBlock->sensorConfig;
+    Log_Debug("Sending PPG block: %u samples in %zu bytes\n", block->sampleCount, block->length);
+
+    // IoTHubMessage_CreateFromByteArray copies the block, so its buffer is free again
+    IOTHUB_MESSAGE_HANDLE messageHandle =
+        IoTHubMessage_CreateFromByteArray(pendingCaptureBlock->buffer, block->length);
+    pendingCaptureBlock = NULL;
+    if (messageHandle == 0) {
+        Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
+        return;
+    }
+
+    SetNumberProperty(messageHandle, "sampleAverage", config->n_sample_average);
+    SetNumberProperty(messageHandle, "adcRangeNanoamps", config->n_adc_range_na);
+    SetNumberProperty(messageHandle, "pulseWidthMicroseconds", config->n_pulse_width_us);
+    SetNumberProperty(messageHandle, "redLedMicroamps", config->n_red_led_ua);
+    SetNumberProperty(messageHandle, "irLedMicroamps", config->n_ir_led_ua);
+    SendIoTHubMessage(messageHandle, PPG_BLOCK_CONTENT_TYPE, PPG_BLOCK_CONTENT_ENCODING,
+                      SendMessageCallback, NULL);
+}
+
+/// <summary>
+///     Sends what is left of the capture when the measurement ends. Both blocks live in the
+///     measurement arena and are gone with the next measurement.
+/// </summary>
+static void StopCapture(void)
+{
+    SendPendingCaptureBlock();
+    CompleteCaptureBlock();
+    SendPendingCaptureBlock();
+    activeCaptureBlock = NULL;
+}
 
-		max301024_shut_down(1);
+#ifdef HR4_RTAPP
+/// <summary>
+///     Sends a message to the HR4 real-time app.
+/// </summary>
+/// <returns>true on success</returns>
+static bool SendToRtApp(const void *message, size_t length)
+{
+    if (send(rtAppSocketFd, message, length, 0) != (ssize_t)length) {
+        Log_Debug("ERROR: Could not send to the HR4 real-time app: %s (%d).\n", strerror(errno),
+                  errno);
+        return false;
+    }
+    return true;
+}
+
+/// <summary>
+///     Starts a measurement with the desired sampling configuration in the real-time app, which
+///     samples, estimates and adjusts the LEDs by itself. The results, the raw samples while
+///     CaptureRawTrace is set and the end of the measurement come back through
+///     RtAppSocketEventHandler.
+/// </summary>
+static void StartRtAppMeasurement(void)
+{
+    rf_config_default(&measurementConfig);
+    if (!rf_configure(&measurementConfig, desiredSampleRate, desiredWindowSeconds)) {
+        Log_Debug("ERROR: Cannot sample at %d sps for %d s, using the defaults.\n",
+                  desiredSampleRate, desiredWindowSeconds);
+        rf_config_default(&measurementConfig);
+    }
+    // A scheduled measurement runs until its timeout unless it has enough valid windows first
+    measurementRunTimeSeconds = scheduledMeasurement ? monitoringTimeoutSeconds
+                                                     : measurementConfig.n_st + 2;
+    Log_Debug("\nRunning test for %d seconds.\n", measurementRunTimeSeconds);
+    Log_Debug("Begin ... Place your finger on the sensor\n\n");
+
+    ResetMeasurementArena();
+    if (!AllocateCaptureBlocks()) {
+        SetMeasurementState(MeasurementState_ShuttingDown);
+        return;
+    }
+    ClearTelemetryBatch(&measurementBatch);
+
+    Hr4StartMessage start = {.header.type = Hr4Message_Start,
+                             .sampleRate = measurementConfig.n_fs,
+                             .windowSeconds = measurementConfig.n_st,
+                             .runSeconds = measurementRunTimeSeconds,
+                             .adcRangeNanoamps = ledSettings.adcRangeNanoamps,
+                             .redPulseAmplitude = ledSettings.redPulseAmplitude,
+                             .irPulseAmplitude = ledSettings.irPulseAmplitude,
+                             .sendSamples = captureRawTrace};
+    if (!SendToRtApp(&start, sizeof(start))) {
+        StopCapture();
+        SetMeasurementState(MeasurementState_ShuttingDown);
+        return;
+    }
+    SetMeasurementState(MeasurementState_Collecting);
+}
+
+/// <summary>
+///     Adds a valid estimate of the real-time app to the measurement, and stops the measurement
+///     when the telemetry batch is full.
+/// </summary>
+static void HandleRtAppResult(const Hr4ResultMessage *result)
+{
+    METRICS_ADD(MetricCounter_Windows, 1);
+    if (!result->heartRateValid || !result->spo2Valid) {
+        Log_Debug("ch_hr_valid=%d, ch_spo2_valid=%d\n", result->heartRateValid,
+                  result->spo2Valid);
+        METRICS_ADD(MetricCounter_InvalidWindows, 1);
+        return;
+    }
+
+    Log_Debug("Blood Oxygen Level (SpO2)=%.2f%%, Heart Rate=%d BPM\n", result->spo2,
+              result->heartRate);
+    TelemetryReading reading = {.heartRate = result->heartRate,
+                                .spo2 = result->spo2,
+                                .ratio = result->ratio,
+                                .correl = result->correl,
+                                .timestamp = time(NULL)};
+    AddToTelemetryBatch(&measurementBatch, &reading);
+    if (IsTelemetryBatchFull(&measurementBatch) ||
+        (scheduledMeasurement && measurementBatch.count >= (size_t)monitoringValidWindows)) {
+        Hr4MessageHeader stop = {.type = Hr4Message_Stop};
+        SendToRtApp(&stop, sizeof(stop));
+    }
+}
+
+/// <summary>
+///     Records the raw samples of the real-time app in the capture blocks. A block never spans
+///     a change of the sensor configuration.
+/// </summary>
+static void HandleRtAppSamples(const Hr4SamplesMessage *samples)
+{
+    METRICS_ADD(MetricCounter_Samples, samples->sampleCount);
+    METRICS_ADD(MetricCounter_FifoOverflows, samples->overflows);
+    if (activeCaptureBlock == NULL) {
+        return;
+    }
+
+    if (memcmp(&samples->sensorConfig, &rtAppSensorConfig, sizeof(rtAppSensorConfig)) != 0) {
+        rtAppSensorConfig = samples->sensorConfig;
+        CompleteCaptureBlock();
+        activeCaptureBlock->sensorConfig = rtAppSensorConfig;
+    }
+    for (uint32_t i = 0; i < samples->sampleCount && i < HR4_SAMPLES_PER_MESSAGE; i++) {
+        AddToCaptureBlock(samples->ir[i], samples->red[i]);
+    }
+}
+
+/// <summary>
+///     Keeps the LED settings the real-time app ended with for the next measurement and
+///     publishes this one.
+/// </summary>
+static void HandleRtAppDone(const Hr4DoneMessage *done)
+{
+    ledSettings.redPulseAmplitude = done->redPulseAmplitude;
+    ledSettings.irPulseAmplitude = done->irPulseAmplitude;
+    ledSettings.adcRangeNanoamps = done->adcRangeNanoamps;
+    SetMeasurementState(MeasurementState_Publishing);
+}
+
+/// <summary>
+///     HR4 real-time app socket event:  Handle the next message of the real-time app
+/// </summary>
+static void RtAppSocketEventHandler(EventData *eventData)
+{
+    static union {
+        Hr4MessageHeader header;
+        Hr4ResultMessage result;
+        Hr4SamplesMessage samples;
+        Hr4DoneMessage done;
+        uint8_t bytes[HR4_MESSAGE_MAX_SIZE];
+    } message;
+    ssize_t length = recv(rtAppSocketFd, &message, sizeof(message), 0);
+    if (length < 0) {
+        Log_Debug("ERROR: Could not receive from the HR4 real-time app: %s (%d).\n",
+                  strerror(errno), errno);
+        return;
+    }
+    // Messages of a measurement that has already been published are dropped
+    if ((size_t)length < sizeof(message.header) ||
+        measurementState != MeasurementState_Collecting) {
+        return;
+    }
+
+    switch (message.header.type) {
+    case Hr4Message_Result:
+        if ((size_t)length >= sizeof(message.result)) {
+            HandleRtAppResult(&message.result);
+        }
+        break;
+    case Hr4Message_Samples:
+        if ((size_t)length >= sizeof(message.samples)) {
+            HandleRtAppSamples(&message.samples);
+        }
+        break;
+    case Hr4Message_Done:
+        if ((size_t)length >= sizeof(message.done)) {
+            HandleRtAppDone(&message.done);
+        }
+        break;
+    default:
+        break;
     }
 }
+#endif
@@ -65,12 +65,17 @@
 //extern i2c_handle_t  i2c_handle;
 static int (*_i2c_read)( uint8_t addr, uint16_t count, uint8_t* ptr );
 static void (*_i2c_write)( uint8_t addr, uint16_t count, uint8_t* ptr );
+static uint32_t un_overflow_count=0;  // samples lost to FIFO overflows, see maxim_max30102_take_overflow_count
+// Last values written to the registers that shape the samples, see maxim_max30102_get_config.
+// All of them are 0 after power-on and after a reset.
+static uint8_t uch_cfg_fifo=0, uch_cfg_spo2=0, uch_cfg_led1_pa=0, uch_cfg_led2_pa=0;
 
 
 /**
 * \brief        Write a value to a MAX30102 register
 * \par          Details
-*               This function writes a value to a MAX30102 register
+*               This function writes a value to a MAX30102 register and keeps a copy of the
+*               sensor configuration registers for maxim_max30102_get_config
 *
 * \param[in]    uch_addr    - register address
 * \param[in]    uch_data    - register data
@@ -80,6 +85,17 @@ static void (*_i2c_write)( uint8_t addr, uint16_t count, uint8_t* ptr );
 int maxim_max30102_write_reg(uint8_t uch_addr, uint8_t uch_data)
 {
     _i2c_write(uch_addr, 1, &uch_data);
+    switch(uch_addr)
+    {
+    case REG_FIFO_CONFIG: uch_cfg_fifo=uch_data; break;
+    case REG_SPO2_CONFIG: uch_cfg_spo2=uch_data; break;
+    case REG_LED1_PA:     uch_cfg_led1_pa=uch_data; break;
+    case REG_LED2_PA:     uch_cfg_led2_pa=uch_data; break;
+    case REG_MODE_CONFIG:
+      if(uch_data&0x40)   // RESET returns all registers to their power-on values
+        uch_cfg_fifo=uch_cfg_spo2=uch_cfg_led1_pa=uch_cfg_led2_pa=0;
+      break;
+    }
 //    uint8_t  buff[2];
 //    buff[0] = uch_addr;
 //    buff[1] = uch_data;
@@ -105,6 +121,44 @@ int maxim_max30102_read_reg(uint8_t uch_addr, uint8_t *puch_data)
     return 1;
 }
 
+/**
+* \brief        Decode one FIFO sample
+* \par          Details
+*               This function converts the 6 FIFO bytes of one SpO2 mode sample into
+*               18-bit red and IR LED readings
+*
+* \param[in]    *puch_sample   - MAX30102_BYTES_PER_SAMPLE bytes read from REG_FIFO_DATA
+* \param[out]   *pun_red_led   - pointer that stores the red LED reading data
+* \param[out]   *pun_ir_led    - pointer that stores the IR LED reading data
+*/
+static void maxim_max30102_decode_sample(const uint8_t *puch_sample, uint32_t *pun_red_led, uint32_t *pun_ir_led)
+{
+  uint32_t un_temp;
+
+  *pun_ir_led=0;
+  *pun_red_led=0;
+
+  un_temp=puch_sample[0];
+  un_temp<<=16;
+  *pun_red_led+=un_temp;
+  un_temp=puch_sample[1];
+  un_temp<<=8;
+  *pun_red_led+=un_temp;
+  un_temp=puch_sample[2];
+  *pun_red_led+=un_temp;
+  un_temp=puch_sample[3];
+  un_temp<<=16;
+  *pun_ir_led+=un_temp;
+  un_temp=puch_sample[4];
+  un_temp<<=8;
+  *pun_ir_led+=un_temp;
+  un_temp=puch_sample[5];
+  *pun_ir_led+=un_temp;
+
+  *pun_red_led&=0x03FFFF;  //Mask MSB [23:18]
+  *pun_ir_led&=0x03FFFF;  //Mask MSB [23:18]
+}
+
 void maxim_max30102_i2c_setup( int (*rd)( uint8_t addr, uint16_t count, uint8_t* ptr ), void (*wr)( uint8_t addr, uint16_t count, uint8_t* ptr ))
 {
     _i2c_read = rd;
@@ -115,7 +169,7 @@ void maxim_max30102_i2c_setup( int (*rd)( uint8_t addr, uint16_t count, uint8_t*
 /**
 * \brief        Initialize the MAX30102
 * \par          Details
-*               This function initializes the MAX30102
+*               This function initializes the MAX30102 for the default sampling frequency FS
 *
 * \param        None
 *
@@ -123,6 +177,31 @@ void maxim_max30102_i2c_setup( int (*rd)( uint8_t addr, uint16_t count, uint8_t*
 */
 int maxim_max30102_init()
 {
+  return maxim_max30102_init_sample_rate(FS);
+}
+
+/**
+* \brief        Initialize the MAX30102 for a given sampling frequency
+* \par          Details
+*               This function initializes the MAX30102 so that the FIFO delivers n_fs samples
+*               per second. The ADC runs at 4*n_fs and the FIFO averages 4 samples, as in the
+*               default 25 sps setup.
+*
+* \param[in]    n_fs    - FIFO sample rate in sps: 25, 50 or 100
+*
+* \retval       1 on success, 0 if n_fs is not supported
+*/
+int maxim_max30102_init_sample_rate(int32_t n_fs)
+{
+  uint8_t uch_spo2_config;
+
+  switch(n_fs) {
+    case 25:  uch_spo2_config=0x27; break;  // SPO2_ADC range = 4096nA, SPO2 sample rate (100 Hz), LED pulseWidth (411uS)
+    case 50:  uch_spo2_config=0x2b; break;  // SPO2_ADC range = 4096nA, SPO2 sample rate (200 Hz), LED pulseWidth (411uS)
+    case 100: uch_spo2_config=0x2f; break;  // SPO2_ADC range = 4096nA, SPO2 sample rate (400 Hz), LED pulseWidth (411uS)
+    default:  return 0;
+  }
+
   if(!maxim_max30102_write_reg(REG_INTR_ENABLE_1,0xc0)) // INTR setting
     return 0;
   if(!maxim_max30102_write_reg(REG_INTR_ENABLE_2,0x00))
@@ -137,7 +216,7 @@ int maxim_max30102_init()
     return 0;
   if(!maxim_max30102_write_reg(REG_MODE_CONFIG,0x03))   //0x02 for Red only, 0x03 for SpO2 mode 0x07 multimode LED
     return 0;
-  if(!maxim_max30102_write_reg(REG_SPO2_CONFIG,0x27))  // SPO2_ADC range = 4096nA, SPO2 sample rate (100 Hz), LED pulseWidth (411uS)
+  if(!maxim_max30102_write_reg(REG_SPO2_CONFIG,uch_spo2_config))
     return 0;
   
   if(!maxim_max30102_write_reg(REG_LED1_PA,0x24))   //Choose value for ~ 7mA for LED1
@@ -161,40 +240,204 @@ int maxim_max30102_init()
 */
 int maxim_max30102_read_fifo(uint32_t *pun_red_led, uint32_t *pun_ir_led)
 {
-  uint32_t un_temp;
   uint8_t uch_temp;
-  uint8_t tmp[6];
+  uint8_t tmp[MAX30102_BYTES_PER_SAMPLE];
   uint8_t addr = REG_FIFO_DATA;
 
-  *pun_ir_led=0;
-  *pun_red_led=0;
   maxim_max30102_read_reg(REG_INTR_STATUS_1, &uch_temp);
   maxim_max30102_read_reg(REG_INTR_STATUS_2, &uch_temp);
 
-    _i2c_read(addr, 6, tmp);
+    _i2c_read(addr, MAX30102_BYTES_PER_SAMPLE, tmp);
 //  i2c_write(i2c_handle, MAX30101_SAD, &addr, 1, I2C_NO_STOP);
 //  i2c_read(i2c_handle, MAX30101_SAD, tmp, 6);
 
-  un_temp=tmp[0];
+  maxim_max30102_decode_sample(tmp, pun_red_led, pun_ir_led);
+  return 1;
+}
 
-  un_temp<<=16;
-  *pun_red_led+=un_temp;
-  un_temp=tmp[1];
-  un_temp<<=8;
-  *pun_red_led+=un_temp;
-  un_temp=tmp[2];
-  *pun_red_led+=un_temp;
-  un_temp=tmp[3];
-  un_temp<<=16;
-  *pun_ir_led+=un_temp;
-  un_temp=tmp[4];
-  un_temp<<=8;
-  *pun_ir_led+=un_temp;
-  un_temp=tmp[5];
-  *pun_ir_led+=un_temp;
+/**
+* \brief        Read all samples waiting in the MAX30102 FIFO register
+* \par          Details
+*               This function counts the samples waiting in the FIFO using FIFO_WR_PTR and
+*               FIFO_RD_PTR, and reads up to n_max of them in a single I2C transaction.
+*               The interrupt status registers and the FIFO pointers are adjacent and the
+*               register address auto-increments, so they are fetched in one read as well.
+*
+* \param[out]   *pun_red_led   - array that stores the red LED reading data
+* \param[out]   *pun_ir_led    - array that stores the IR LED reading data
+* \param[in]    n_max          - capacity of both arrays, in samples
+* \param[out]   *pn_count      - number of samples read
+*
+* \retval       1 on success
+*/
+int maxim_max30102_read_fifo_burst(uint32_t *pun_red_led, uint32_t *pun_ir_led, size_t n_max, size_t *pn_count)
+{
+  uint8_t auch_regs[REG_FIFO_RD_PTR+1];  // INTR_STATUS_1 .. FIFO_RD_PTR
+  uint8_t auch_fifo[MAX30102_FIFO_DEPTH*MAX30102_BYTES_PER_SAMPLE];
+  size_t n_samples, k;
 
-  *pun_red_led&=0x03FFFF;  //Mask MSB [23:18]
-  *pun_ir_led&=0x03FFFF;  //Mask MSB [23:18]
+  *pn_count=0;
+  // Reading the status registers also clears the A_FULL and PPG_RDY interrupts
+  if(_i2c_read(REG_INTR_STATUS_1, sizeof(auch_regs), auch_regs) < 0)
+    return 0;
+
+  if(auch_regs[REG_OVF_COUNTER]!=0) {
+    n_samples=MAX30102_FIFO_DEPTH;  // FIFO overflowed, so it is full
+    un_overflow_count+=auch_regs[REG_OVF_COUNTER];
+    }
+  else
+    n_samples=(auch_regs[REG_FIFO_WR_PTR]-auch_regs[REG_FIFO_RD_PTR])&(MAX30102_FIFO_DEPTH-1);
+  if(n_samples>n_max)
+    n_samples=n_max;
+  if(n_samples==0)
+    return 1;
+
+  if(_i2c_read(REG_FIFO_DATA, (uint16_t)(n_samples*MAX30102_BYTES_PER_SAMPLE), auch_fifo) < 0)
+    return 0;
+
+  for(k=0; k<n_samples; ++k)
+    maxim_max30102_decode_sample(auch_fifo+k*MAX30102_BYTES_PER_SAMPLE, pun_red_led+k, pun_ir_led+k);
+  *pn_count=n_samples;
+  return 1;
+}
+
+/**
+* \brief        Number of samples lost to FIFO overflows
+* \par          Details
+*               Sums OVF_COUNTER as seen by maxim_max30102_read_fifo_burst since the last call.
+*               OVF_COUNTER saturates at 0x1F, so a longer stall is undercounted.
+*
+* \retval       Number of lost samples
+*/
+uint32_t maxim_max30102_take_overflow_count(void)
+{
+  uint32_t un_count=un_overflow_count;
+  un_overflow_count=0;
+  return un_count;
+}
+
+/**
+* \brief        Current sensor configuration
+* \par          Details
+*               Decodes the configuration registers as last written through
+*               maxim_max30102_write_reg, so no I2C transfer is needed
+*
+* \param[out]   *pcfg  - sample averaging, ADC range, LED pulse width and LED currents
+*/
+void maxim_max30102_get_config(max30102_config *pcfg)
+{
+  static const int32_t an_pulse_width_us[4]={69, 118, 215, 411};
+  int32_t n_smp_ave=uch_cfg_fifo>>5;
+  pcfg->n_sample_average=1<<(n_smp_ave<5 ? n_smp_ave : 5);  // 5 to 7 all average 32 samples
+  pcfg->n_adc_range_na=2048<<((uch_cfg_spo2>>5)&0x03);
+  pcfg->n_pulse_width_us=an_pulse_width_us[uch_cfg_spo2&0x03];
+  pcfg->n_red_led_ua=uch_cfg_led1_pa*200;  // 0.2 mA per step
+  pcfg->n_ir_led_ua=uch_cfg_led2_pa*200;
+}
+
+/**
+* \brief        Set the LED pulse amplitudes
+* \par          Details
+*               Sets REG_LED1_PA and REG_LED2_PA, 0.2 mA per step up to 51 mA
+*
+* \param[in]    uch_red_pa  - red LED pulse amplitude
+* \param[in]    uch_ir_pa   - IR LED pulse amplitude
+*
+* \retval       1 on success
+*/
+int maxim_max30102_set_led_pa(uint8_t uch_red_pa, uint8_t uch_ir_pa)
+{
+  if(!maxim_max30102_write_reg(REG_LED1_PA,uch_red_pa))
+    return 0;
+  return maxim_max30102_write_reg(REG_LED2_PA,uch_ir_pa);
+}
+
+/**
+* \brief        Set the ADC full scale range
+* \par          Details
+*               Changes SPO2_ADC_RGE in REG_SPO2_CONFIG and keeps the sample rate and the LED
+*               pulse width. The register is not read back; the value last written is modified.
+*
+* \param[in]    n_range_na  - ADC full scale in nA: 2048, 4096, 8192 or 16384
+*
+* \retval       1 on success, 0 if n_range_na is not supported
+*/
+int maxim_max30102_set_adc_range(int32_t n_range_na)
+{
+  uint8_t uch_range;
+
+  switch(n_range_na) {
+    case 2048:  uch_range=0x00; break;
+    case 4096:  uch_range=0x20; break;
+    case 8192:  uch_range=0x40; break;
+    case 16384: uch_range=0x60; break;
+    default:    return 0;
+  }
+  return maxim_max30102_write_reg(REG_SPO2_CONFIG,(uint8_t)((uch_cfg_spo2&~0x60)|uch_range));
+}
+
+/**
+* \brief        Empty the FIFO
+* \par          Details
+*               Clears the FIFO pointers and the overflow counter, so the next sample read is
+*               the first one taken after this call
+*
+* \retval       1 on success
+*/
+int maxim_max30102_clear_fifo(void)
+{
+  if(!maxim_max30102_write_reg(REG_FIFO_WR_PTR,0x00))
+    return 0;
+  if(!maxim_max30102_write_reg(REG_OVF_COUNTER,0x00))
+    return 0;
+  return maxim_max30102_write_reg(REG_FIFO_RD_PTR,0x00);
+}
+
+/**
+* \brief        Wait for an object in front of the sensor
+* \par          Details
+*               Enables the proximity function only: the sensor samples with the pilot LED
+*               (REG_PILOT_PA) until the IR level exceeds the threshold, then raises PROX_INT on
+*               the INT pin and enters the configured SpO2 mode. Call it after
+*               maxim_max30102_init_sample_rate; that call enables the FIFO interrupts again.
+*               The sensor is woken if it was shut down.
+*
+* \param[in]    uch_threshold  - IR level in steps of MAX30102_PROX_THRESH_COUNTS
+*
+* \retval       1 on success
+*/
+int maxim_max30102_enable_proximity(uint8_t uch_threshold)
+{
+  uint8_t uch_temp;
+
+  if(!maxim_max30102_write_reg(REG_PROX_INT_THRESH,uch_threshold))
+    return 0;
+  if(!maxim_max30102_write_reg(REG_INTR_ENABLE_1,0x10))  // PROX_INT_EN only
+    return 0;
+  // Reading the status clears an interrupt left from before
+  if(!maxim_max30102_read_reg(REG_INTR_STATUS_1,&uch_temp))
+    return 0;
+  max301024_shut_down(0);
+  return 1;
+}
+
+/**
+* \brief        Check for the proximity interrupt
+* \par          Details
+*               Reads and so clears REG_INTR_STATUS_1. Once it reports PROX_INT the sensor is
+*               sampling in SpO2 mode.
+*
+* \param[out]   *pn_detected  - 1 if an object exceeded the threshold, 0 if not
+*
+* \retval       1 on success
+*/
+int maxim_max30102_read_proximity(int *pn_detected)
+{
+  uint8_t uch_temp;
+
+  if(_i2c_read(REG_INTR_STATUS_1, 1, &uch_temp) < 0)
+    return 0;
+  *pn_detected=(uch_temp&0x10)!=0;
   return 1;
 }
 
@@ -61,6 +61,7 @@
 *******************************************************************************
 */
 #include <stdint.h>
+#include <stddef.h>
 
 #ifndef MAX30102_H_
 #define MAX30102_H_
@@ -93,12 +94,39 @@
 #define REG_REV_ID          0xFE
 #define REG_PART_ID         0xFF
 
+#define MAX30102_FIFO_DEPTH          32  // FIFO holds 32 samples
+#define MAX30102_FIFO_A_FULL_SAMPLES 17  // samples in the FIFO when A_FULL fires, see REG_FIFO_CONFIG in maxim_max30102_init
+#define MAX30102_BYTES_PER_SAMPLE    6   // 3 bytes red + 3 bytes IR in SpO2 mode
+#define MAX30102_PROX_THRESH_COUNTS  1024 // ADC counts per step of REG_PROX_INT_THRESH, its 8 MSBs
+
+/*
+ * Sensor configuration
+ * The settings that shape the samples, as returned by maxim_max30102_get_config.
+ * LED1 is the red LED and LED2 the IR LED.
+ */
+typedef struct {
+    int32_t n_sample_average;   // samples averaged into one FIFO sample, 1 to 32
+    int32_t n_adc_range_na;     // ADC full scale in nA, 2048 to 16384
+    int32_t n_pulse_width_us;   // LED pulse width in us, 69 to 411
+    int32_t n_red_led_ua;       // red LED current in uA
+    int32_t n_ir_led_ua;        // IR LED current in uA
+} max30102_config;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 int     maxim_max30102_init(void);
+int     maxim_max30102_init_sample_rate(int32_t n_fs);
 int     maxim_max30102_read_fifo(uint32_t *pun_red_led, uint32_t *pun_ir_led);
+int     maxim_max30102_read_fifo_burst(uint32_t *pun_red_led, uint32_t *pun_ir_led, size_t n_max, size_t *pn_count);
+uint32_t maxim_max30102_take_overflow_count(void);
+void    maxim_max30102_get_config(max30102_config *pcfg);
+int     maxim_max30102_set_led_pa(uint8_t uch_red_pa, uint8_t uch_ir_pa);
+int     maxim_max30102_set_adc_range(int32_t n_range_na);
+int     maxim_max30102_clear_fifo(void);
+int     maxim_max30102_enable_proximity(uint8_t uch_threshold);
+int     maxim_max30102_read_proximity(int *pn_detected);
 int     maxim_max30102_write_reg(uint8_t uch_addr, uint8_t uch_data);
 int     maxim_max30102_read_reg(uint8_t uch_addr, uint8_t *puch_data);
 int     maxim_max30102_reset(void);
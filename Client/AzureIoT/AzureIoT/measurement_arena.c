@@ -0,0 +1,34 @@
+#include <stdint.h>
+#include <applibs/log.h>
+#include "measurement_arena.h"
+
+static _Alignas(MEASUREMENT_ARENA_ALIGNMENT) uint8_t measurementArena[MEASUREMENT_ARENA_SIZE];
+static size_t measurementArenaUsed = 0;
+static size_t measurementArenaHighWaterMark = 0;
+
+void ResetMeasurementArena(void)
+{
+    measurementArenaUsed = 0;
+}
+
+void *AllocateFromMeasurementArena(size_t size)
+{
+    size_t footprint = MEASUREMENT_ARENA_FOOTPRINT(size);
+    if (footprint > MEASUREMENT_ARENA_SIZE - measurementArenaUsed) {
+        Log_Debug("ERROR: Measurement arena exhausted: %zu bytes requested, %zu of %zu in use.\n",
+                  size, measurementArenaUsed, (size_t)MEASUREMENT_ARENA_SIZE);
+        return NULL;
+    }
+
+    void *block = &measurementArena[measurementArenaUsed];
+    measurementArenaUsed += footprint;
+    if (measurementArenaUsed > measurementArenaHighWaterMark) {
+        measurementArenaHighWaterMark = measurementArenaUsed;
+    }
+    return block;
+}
+
+size_t GetMeasurementArenaHighWaterMark(void)
+{
+    return measurementArenaHighWaterMark;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <stddef.h>
+
+/// <summary>
+///     Size of the statically allocated measurement arena. It holds the raw sample buffers and
+///     the algorithm scratch space of one measurement, so the memory a measurement may use is
+///     fixed at build time rather than growing the stack with the configured window.
+/// </summary>
+#define MEASUREMENT_ARENA_SIZE (16 * 1024)
+
+/// <summary>
+///     Alignment of every block handed out by the arena.
+/// </summary>
+#define MEASUREMENT_ARENA_ALIGNMENT 8
+
+/// <summary>
+///     Number of arena bytes an allocation of the given size takes up, including alignment.
+/// </summary>
+#define MEASUREMENT_ARENA_FOOTPRINT(size) \
+    (((size) + MEASUREMENT_ARENA_ALIGNMENT - 1) & ~(size_t)(MEASUREMENT_ARENA_ALIGNMENT - 1))
+
+/// <summary>
+///     Releases all blocks of the arena at once. Blocks handed out before must no longer be used.
+/// </summary>
+void ResetMeasurementArena(void);
+
+/// <summary>
+///     Hands out a block from the arena. There is no individual free; see ResetMeasurementArena.
+/// </summary>
+/// <param name="size">Size of the block in bytes</param>
+/// <returns>A block aligned to MEASUREMENT_ARENA_ALIGNMENT, or NULL if the arena is exhausted</returns>
+void *AllocateFromMeasurementArena(size_t size);
+
+/// <summary>
+///     Returns the largest number of arena bytes in use at any time since startup.
+/// </summary>
+size_t GetMeasurementArenaHighWaterMark(void);
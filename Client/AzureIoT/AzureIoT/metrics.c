@@ -0,0 +1,126 @@
+#include <time.h>
+#include "format_buffer.h"
+#include "metrics.h"
+
+typedef struct {
+    uint32_t count;
+    uint64_t sumNanoseconds;
+    uint64_t maxNanoseconds;
+    uint32_t histogram[METRICS_HISTOGRAM_BUCKETS];
+} MetricsTimerState;
+
+static const char *const timerNames[MetricTimer_Count] = {"I2cRead", "I2cWrite", "Window",
+                                                          "SendToConfirm", "DoWork"};
+static const char *const counterNames[MetricCounter_Count] = {"Samples", "FifoOverflows",
+                                                              "Windows", "InvalidWindows"};
+
+static MetricsTimerState timers[MetricTimer_Count];
+static uint32_t counters[MetricCounter_Count];
+static uint64_t periodStart = 0;
+
+uint64_t GetMetricsTimestamp(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void RecordNanoseconds(MetricTimer timer, uint64_t nanoseconds)
+{
+    MetricsTimerState *state = &timers[timer];
+    state->count++;
+    state->sumNanoseconds += nanoseconds;
+    if (nanoseconds > state->maxNanoseconds) {
+        state->maxNanoseconds = nanoseconds;
+    }
+
+    uint64_t microseconds = nanoseconds / 1000;
+    int bucket = 0;
+    while (microseconds > 1 && bucket < METRICS_HISTOGRAM_BUCKETS - 1) {
+        microseconds >>= 1;
+        bucket++;
+    }
+    state->histogram[bucket]++;
+}
+
+void RecordMetricsDuration(MetricTimer timer, uint64_t start)
+{
+    RecordNanoseconds(timer, GetMetricsTimestamp() - start);
+}
+
+void AddToMetricsCounter(MetricCounter counter, uint32_t n)
+{
+    counters[counter] += n;
+}
+
+/// <summary>
+///     Upper bound in microseconds of the bucket that holds the 95th percentile, capped by the
+///     maximum.
+/// </summary>
+static uint64_t Percentile95Microseconds(const MetricsTimerState *state)
+{
+    uint64_t maxMicroseconds = state->maxNanoseconds / 1000;
+    uint32_t rank = state->count - state->count / 20;
+    uint32_t seen = 0;
+    for (int bucket = 0; bucket < METRICS_HISTOGRAM_BUCKETS; bucket++) {
+        seen += state->histogram[bucket];
+        if (seen >= rank) {
+            uint64_t bound = (uint64_t)2 << bucket;
+            return bound < maxMicroseconds ? bound : maxMicroseconds;
+        }
+    }
+    return maxMicroseconds;
+}
+
+int FormatMetricsSnapshot(char *buffer, size_t bufferSize)
+{
+    if (bufferSize == 0) {
+        return -1;
+    }
+
+    uint64_t now = GetMetricsTimestamp();
+    double seconds = (double)(now - periodStart) / 1e9;
+    int offset = AppendFormatted(buffer, bufferSize, 0, "{\"Metrics\":{\"PeriodSeconds\":%u",
+                                 (unsigned int)seconds);
+
+    for (int i = 0; i < MetricCounter_Count; i++) {
+        offset = AppendFormatted(buffer, bufferSize, offset, ",\"%s\":%u", counterNames[i],
+                                 counters[i]);
+    }
+    offset = AppendFormatted(buffer, bufferSize, offset, ",\"SamplesPerSecond\":%.1f",
+                             seconds > 0 ? counters[MetricCounter_Samples] / seconds : 0.0);
+
+    for (int i = 0; i < MetricTimer_Count; i++) {
+        const MetricsTimerState *state = &timers[i];
+        uint64_t mean = state->count > 0 ? state->sumNanoseconds / state->count / 1000 : 0;
+        offset = AppendFormatted(
+            buffer, bufferSize, offset,
+            ",\"%s\":{\"Count\":%u,\"MeanUs\":%llu,\"P95Us\":%llu,\"MaxUs\":%llu,\"Histogram\":[",
+            timerNames[i], state->count, (unsigned long long)mean,
+            (unsigned long long)(state->count > 0 ? Percentile95Microseconds(state) : 0),
+            (unsigned long long)(state->maxNanoseconds / 1000));
+
+        int last = METRICS_HISTOGRAM_BUCKETS - 1;
+        while (last >= 0 && state->histogram[last] == 0) {
+            last--;
+        }
+        for (int bucket = 0; bucket <= last; bucket++) {
+            offset = AppendFormatted(buffer, bufferSize, offset, "%s%u", bucket == 0 ? "" : ",",
+                                     state->histogram[bucket]);
+        }
+        offset = AppendFormatted(buffer, bufferSize, offset, "]}");
+    }
+
+    return AppendFormatted(buffer, bufferSize, offset, "}}");
+}
+
+void ResetMetrics(void)
+{
+    for (int i = 0; i < MetricTimer_Count; i++) {
+        timers[i] = (MetricsTimerState){0};
+    }
+    for (int i = 0; i < MetricCounter_Count; i++) {
+        counters[i] = 0;
+    }
+    periodStart = GetMetricsTimestamp();
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/// <summary>
+///     Durations measured with METRICS_NOW and METRICS_RECORD_DURATION.
+/// </summary>
+typedef enum {
+    MetricTimer_I2cRead,       // Read_i2c transaction
+    MetricTimer_I2cWrite,      // Write_i2c transaction
+    MetricTimer_Window,        // rf_stream_estimate of one window
+    MetricTimer_SendToConfirm, // telemetry message handed to IoTHubClient until confirmed, timed
+                               // from the send time in the confirmation context of the message
+    MetricTimer_DoWork,        // IoTHubDeviceClient_LL_DoWork
+    MetricTimer_Count
+} MetricTimer;
+
+/// <summary>
+///     Events counted with METRICS_ADD.
+/// </summary>
+typedef enum {
+    MetricCounter_Samples,          // samples read from the MAX30102 FIFO
+    MetricCounter_FifoOverflows,    // samples lost to MAX30102 FIFO overflows (REG_OVF_COUNTER)
+    MetricCounter_Windows,          // windows estimated
+    MetricCounter_InvalidWindows,   // windows without a valid heart rate or SpO2
+    MetricCounter_Count
+} MetricCounter;
+
+/// <summary>
+///     Number of histogram buckets per timer. Bucket k counts durations from 2^k to 2^(k+1)
+///     microseconds, the first one everything shorter and the last one everything longer.
+/// </summary>
+#define METRICS_HISTOGRAM_BUCKETS 20
+
+/// <summary>
+///     Size of a buffer that holds the snapshot formatted by FormatMetricsSnapshot.
+/// </summary>
+#define METRICS_SNAPSHOT_SIZE 2048
+
+#ifdef METRICS_ENABLED
+/// <summary>
+///     The instrumentation macros. Unless METRICS_ENABLED is defined they compile to nothing,
+///     so the hot paths carry no cost in a build without metrics.
+/// </summary>
+#define METRICS_NOW() GetMetricsTimestamp()
+#define METRICS_RECORD_DURATION(timer, start) RecordMetricsDuration((timer), (start))
+#define METRICS_ADD(counter, n) AddToMetricsCounter((counter), (n))
+#else
+#define METRICS_NOW() ((uint64_t)0)
+#define METRICS_RECORD_DURATION(timer, start) ((void)(start))
+#define METRICS_ADD(counter, n) ((void)0)
+#endif
+
+/// <summary>
+///     Returns the monotonic clock in nanoseconds.
+/// </summary>
+uint64_t GetMetricsTimestamp(void);
+
+/// <summary>
+///     Records the time elapsed since start, a value returned by GetMetricsTimestamp.
+/// </summary>
+void RecordMetricsDuration(MetricTimer timer, uint64_t start);
+
+/// <summary>
+///     Adds n to a counter.
+/// </summary>
+void AddToMetricsCounter(MetricCounter counter, uint32_t n);
+
+/// <summary>
+///     Formats the metrics gathered since the last ResetMetrics as a Device Twin reported
+///     property "Metrics": counters, samples per second and, per timer, the number of
+///     measurements, mean, 95th percentile (upper bucket bound) and maximum in microseconds and
+///     the histogram up to its last non-empty bucket.
+/// </summary>
+/// <param name="buffer">Buffer for the JSON document, METRICS_SNAPSHOT_SIZE bytes suffice</param>
+/// <param name="bufferSize">Size of the buffer in bytes</param>
+/// <returns>Length of the document, or -1 if the buffer is too small</returns>
+int FormatMetricsSnapshot(char *buffer, size_t bufferSize);
+
+/// <summary>
+///     Clears all counters and timers and starts a new metrics period.
+/// </summary>
+void ResetMetrics(void);
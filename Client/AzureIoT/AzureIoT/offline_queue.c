@@ -0,0 +1,326 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <applibs/log.h>
+#include <applibs/storage.h>
+#include "offline_queue.h"
+
+#define OFFLINE_QUEUE_HEADER_MAGIC 0x314C514Fu // "OQL1"
+#define OFFLINE_QUEUE_RECORD_MAGIC 0x4345524Fu // "OREC"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t slotSize;
+    uint32_t slotCount;
+    uint32_t deliveredSequence;
+    uint32_t checksum;
+} OfflineQueueHeader;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t length;
+    uint32_t checksum;
+} OfflineQueueRecordHeader;
+
+_Static_assert(sizeof(OfflineQueueHeader) <= OFFLINE_QUEUE_HEADER_SIZE,
+               "OfflineQueueHeader does not fit OFFLINE_QUEUE_HEADER_SIZE");
+_Static_assert(sizeof(OfflineQueueRecordHeader) == OFFLINE_QUEUE_RECORD_HEADER_SIZE,
+               "OfflineQueueRecordHeader does not match OFFLINE_QUEUE_RECORD_HEADER_SIZE");
+_Static_assert(OFFLINE_QUEUE_DRAIN_BATCH <= 32, "deliveredMask holds 32 messages");
+
+static int queueFd = -1;
+// Messages up to deliveredSequence are delivered, persistedSequence is the value in the file
+// header and lastSequence is the newest message.
+static uint32_t deliveredSequence = 0;
+static uint32_t persistedSequence = 0;
+static uint32_t lastSequence = 0;
+// Next message for GetNextOfflineMessage. The messages from deliveredSequence + 1 to
+// nextSequence - 1 have been returned by it. Bit 0 of the masks is deliveredSequence + 1:
+// deliveredMask holds the messages confirmed out of order and inFlightMask those still waiting
+// for their confirmation. A message in that range with neither bit set was not delivered and
+// is returned again, so only the failed messages are sent twice.
+static uint32_t nextSequence = 1;
+static uint32_t deliveredMask = 0;
+static uint32_t inFlightMask = 0;
+static uint8_t slotBuffer[OFFLINE_QUEUE_SLOT_SIZE];
+
+/// <summary>
+///     FNV-1a hash, continued from the given value.
+/// </summary>
+static uint32_t Checksum(uint32_t hash, const void *data, size_t length)
+{
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t RecordChecksum(uint32_t sequence, uint32_t length, const void *message)
+{
+    uint32_t hash = Checksum(2166136261u, &sequence, sizeof(sequence));
+    hash = Checksum(hash, &length, sizeof(length));
+    return Checksum(hash, message, length);
+}
+
+static off_t SlotOffset(uint32_t sequence)
+{
+    return (off_t)OFFLINE_QUEUE_HEADER_SIZE +
+           (off_t)(sequence % OFFLINE_QUEUE_SLOT_COUNT) * OFFLINE_QUEUE_SLOT_SIZE;
+}
+
+/// <summary>
+///     Reads up to size bytes at the given offset of the queue file. The file only grows as far
+///     as it has been written, so reading a slot that was never used returns fewer bytes.
+/// </summary>
+/// <returns>Number of bytes read, or -1 on error</returns>
+static ssize_t ReadAt(off_t offset, void *data, size_t size)
+{
+    if (lseek(queueFd, offset, SEEK_SET) == -1) {
+        return -1;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(queueFd, (uint8_t *)data + done, size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += (size_t)n;
+    }
+    return (ssize_t)done;
+}
+
+/// <summary>
+///     Writes size bytes at the given offset of the queue file.
+/// </summary>
+/// <returns>true if all bytes were written</returns>
+static bool WriteAt(off_t offset, const void *data, size_t size)
+{
+    if (lseek(queueFd, offset, SEEK_SET) == -1) {
+        return false;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = write(queueFd, (const uint8_t *)data + done, size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            Log_Debug("ERROR: Could not write the offline queue: %s (%d).\n", strerror(errno),
+                      errno);
+            return false;
+        }
+        done += (size_t)n;
+    }
+    return true;
+}
+
+/// <summary>
+///     Records deliveredSequence in the file header.
+/// </summary>
+static void PersistDeliveredSequence(void)
+{
+    OfflineQueueHeader header = {.magic = OFFLINE_QUEUE_HEADER_MAGIC,
+                                 .slotSize = OFFLINE_QUEUE_SLOT_SIZE,
+                                 .slotCount = OFFLINE_QUEUE_SLOT_COUNT,
+                                 .deliveredSequence = deliveredSequence};
+    header.checksum = Checksum(2166136261u, &header, offsetof(OfflineQueueHeader, checksum));
+    if (WriteAt(0, &header, sizeof(header))) {
+        persistedSequence = deliveredSequence;
+    }
+}
+
+/// <summary>
+///     Reads the record header of a slot.
+/// </summary>
+/// <returns>true if the slot holds a record written for this slot layout</returns>
+static bool ReadRecordHeader(uint32_t slot, OfflineQueueRecordHeader *record)
+{
+    off_t offset = (off_t)OFFLINE_QUEUE_HEADER_SIZE + (off_t)slot * OFFLINE_QUEUE_SLOT_SIZE;
+    return ReadAt(offset, record, sizeof(*record)) == (ssize_t)sizeof(*record) &&
+           record->magic == OFFLINE_QUEUE_RECORD_MAGIC && record->sequence != 0 &&
+           record->sequence % OFFLINE_QUEUE_SLOT_COUNT == slot &&
+           record->length <= OFFLINE_QUEUE_MAX_MESSAGE_SIZE;
+}
+
+/// <summary>
+///     Bit of a message after deliveredSequence in deliveredMask and inFlightMask.
+/// </summary>
+static uint32_t SequenceBit(uint32_t sequence)
+{
+    return 1u << (sequence - deliveredSequence - 1);
+}
+
+/// <summary>
+///     Marks a message as delivered and moves deliveredSequence past all messages delivered
+///     in order.
+/// </summary>
+static void MarkDelivered(uint32_t sequence)
+{
+    deliveredMask |= SequenceBit(sequence);
+    inFlightMask &= ~SequenceBit(sequence);
+    while (deliveredMask & 1u) {
+        deliveredMask >>= 1;
+        inFlightMask >>= 1;
+        deliveredSequence++;
+    }
+    if (nextSequence <= deliveredSequence) {
+        nextSequence = deliveredSequence + 1;
+    }
+}
+
+int OpenOfflineQueue(void)
+{
+    queueFd = Storage_OpenMutableFile();
+    if (queueFd < 0) {
+        Log_Debug("ERROR: Could not open mutable storage: %s (%d).\n", strerror(errno), errno);
+        return -1;
+    }
+
+    OfflineQueueHeader header;
+    deliveredSequence = 0;
+    if (ReadAt(0, &header, sizeof(header)) == (ssize_t)sizeof(header) &&
+        header.magic == OFFLINE_QUEUE_HEADER_MAGIC && header.slotSize == OFFLINE_QUEUE_SLOT_SIZE &&
+        header.slotCount == OFFLINE_QUEUE_SLOT_COUNT &&
+        header.checksum ==
+            Checksum(2166136261u, &header, offsetof(OfflineQueueHeader, checksum))) {
+        deliveredSequence = header.deliveredSequence;
+    }
+    persistedSequence = deliveredSequence;
+
+    lastSequence = deliveredSequence;
+    for (uint32_t slot = 0; slot < OFFLINE_QUEUE_SLOT_COUNT; slot++) {
+        OfflineQueueRecordHeader record;
+        if (ReadRecordHeader(slot, &record) && record.sequence > lastSequence) {
+            lastSequence = record.sequence;
+        }
+    }
+    // Older messages were overwritten by newer ones while the ring was full.
+    if (lastSequence - deliveredSequence > OFFLINE_QUEUE_SLOT_COUNT) {
+        deliveredSequence = lastSequence - OFFLINE_QUEUE_SLOT_COUNT;
+    }
+    nextSequence = deliveredSequence + 1;
+    deliveredMask = 0;
+    inFlightMask = 0;
+
+    Log_Debug("INFO: Offline queue holds %zu undelivered messages.\n", GetOfflineQueueLength());
+    return 0;
+}
+
+void CloseOfflineQueue(void)
+{
+    if (queueFd < 0) {
+        return;
+    }
+    if (deliveredSequence != persistedSequence) {
+        PersistDeliveredSequence();
+    }
+    close(queueFd);
+    queueFd = -1;
+}
+
+bool AppendToOfflineQueue(const void *message, size_t length, uint32_t *sequence)
+{
+    if (queueFd < 0 || length > OFFLINE_QUEUE_MAX_MESSAGE_SIZE) {
+        return false;
+    }
+
+    uint32_t newSequence = lastSequence + 1;
+    if (newSequence - deliveredSequence > OFFLINE_QUEUE_SLOT_COUNT) {
+        Log_Debug("WARNING: Offline queue full, dropping message %u.\n", deliveredSequence + 1);
+        MarkDelivered(deliveredSequence + 1);
+    }
+
+    OfflineQueueRecordHeader record = {.magic = OFFLINE_QUEUE_RECORD_MAGIC,
+                                       .sequence = newSequence,
+                                       .length = (uint32_t)length,
+                                       .checksum = RecordChecksum(newSequence, (uint32_t)length,
+                                                                  message)};
+    // Header and body go out in a single write
+    memcpy(slotBuffer, &record, sizeof(record));
+    memcpy(slotBuffer + sizeof(record), message, length);
+    if (!WriteAt(SlotOffset(newSequence), slotBuffer, sizeof(record) + length)) {
+        return false;
+    }
+
+    lastSequence = newSequence;
+    *sequence = newSequence;
+    return true;
+}
+
+bool GetNextOfflineMessage(void *buffer, size_t size, size_t *length, uint32_t *sequence)
+{
+    if (queueFd < 0) {
+        return false;
+    }
+
+    for (;;) {
+        // A message that failed goes out again before the next new one
+        uint32_t candidate = deliveredSequence + 1;
+        while (candidate < nextSequence &&
+               ((deliveredMask | inFlightMask) & SequenceBit(candidate)) != 0) {
+            candidate++;
+        }
+        if (candidate == nextSequence) {
+            if (nextSequence > lastSequence ||
+                nextSequence - deliveredSequence > OFFLINE_QUEUE_DRAIN_BATCH) {
+                return false;
+            }
+            nextSequence++;
+        }
+
+        OfflineQueueRecordHeader record;
+        ssize_t n = ReadAt(SlotOffset(candidate), slotBuffer, sizeof(slotBuffer));
+        memcpy(&record, slotBuffer, sizeof(record));
+        if (n < (ssize_t)sizeof(record) || record.magic != OFFLINE_QUEUE_RECORD_MAGIC ||
+            record.sequence != candidate || record.length > (size_t)n - sizeof(record) ||
+            record.checksum !=
+                RecordChecksum(candidate, record.length, slotBuffer + sizeof(record))) {
+            Log_Debug("WARNING: Offline queue message %u is damaged, skipping it.\n", candidate);
+            MarkDelivered(candidate);
+            continue;
+        }
+        if (record.length > size) {
+            MarkDelivered(candidate);
+            continue;
+        }
+
+        memcpy(buffer, slotBuffer + sizeof(record), record.length);
+        *length = record.length;
+        *sequence = candidate;
+        inFlightMask |= SequenceBit(candidate);
+        return true;
+    }
+}
+
+void AcknowledgeOfflineMessage(uint32_t sequence, bool delivered)
+{
+    if (sequence <= deliveredSequence || sequence > lastSequence ||
+        sequence - deliveredSequence > OFFLINE_QUEUE_DRAIN_BATCH) {
+        return;
+    }
+
+    if (!delivered) {
+        inFlightMask &= ~SequenceBit(sequence);
+        return;
+    }
+
+    MarkDelivered(sequence);
+    // Bound the header writes to one per drained batch
+    if (deliveredSequence - persistedSequence >= OFFLINE_QUEUE_DRAIN_BATCH ||
+        (deliveredSequence != persistedSequence && deliveredSequence + 1 == nextSequence)) {
+        PersistDeliveredSequence();
+    }
+}
+
+size_t GetOfflineQueueLength(void)
+{
+    return (size_t)(lastSequence - deliveredSequence);
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// <summary>
+///     Persistent store-and-forward queue of telemetry messages in the mutable storage file of
+///     the application (see MutableStorage in app_manifest.json).
+///
+///     The file starts with a small header that records the sequence number of the last message
+///     known to be delivered, followed by OFFLINE_QUEUE_SLOT_COUNT fixed-size slots used as a
+///     ring: message n lives in slot n % OFFLINE_QUEUE_SLOT_COUNT, so appending is a single write
+///     and needs no index. Each slot carries its sequence number and a checksum, which lets
+///     OpenOfflineQueue find the pending messages again after a reset and skip a slot that was
+///     torn by a power loss. When the ring is full the oldest undelivered message is overwritten.
+///
+///     Messages are drained at most OFFLINE_QUEUE_DRAIN_BATCH at a time and the header is
+///     rewritten at most once per drained batch, which bounds the flash writes to one per
+///     appended message plus one per batch.
+/// </summary>
+#define OFFLINE_QUEUE_SLOT_SIZE 2048
+#define OFFLINE_QUEUE_SLOT_COUNT 31
+#define OFFLINE_QUEUE_HEADER_SIZE 64
+#define OFFLINE_QUEUE_RECORD_HEADER_SIZE 16
+#define OFFLINE_QUEUE_MAX_MESSAGE_SIZE (OFFLINE_QUEUE_SLOT_SIZE - OFFLINE_QUEUE_RECORD_HEADER_SIZE)
+#define OFFLINE_QUEUE_DRAIN_BATCH 8
+
+/// <summary>
+///     Opens the mutable storage file and recovers the messages that were not delivered before.
+/// </summary>
+/// <returns>0 on success, -1 if mutable storage is not available</returns>
+int OpenOfflineQueue(void);
+
+/// <summary>
+///     Records the delivery state and closes the mutable storage file.
+/// </summary>
+void CloseOfflineQueue(void);
+
+/// <summary>
+///     Appends a message to the queue.
+/// </summary>
+/// <param name="message">Message body</param>
+/// <param name="length">Length of the message body, at most OFFLINE_QUEUE_MAX_MESSAGE_SIZE</param>
+/// <param name="sequence">Receives the sequence number assigned to the message</param>
+/// <returns>false if the queue is not open, the message is too long or the write failed</returns>
+bool AppendToOfflineQueue(const void *message, size_t length, uint32_t *sequence);
+
+/// <summary>
+///     Returns the next message to send, unless OFFLINE_QUEUE_DRAIN_BATCH messages are already
+///     waiting for AcknowledgeOfflineMessage.
+/// </summary>
+/// <param name="buffer">Buffer for the message body</param>
+/// <param name="size">Size of the buffer, OFFLINE_QUEUE_MAX_MESSAGE_SIZE bytes suffice</param>
+/// <param name="length">Receives the length of the message body</param>
+/// <param name="sequence">Receives the sequence number of the message</param>
+/// <returns>false if there is nothing to send at the moment</returns>
+bool GetNextOfflineMessage(void *buffer, size_t size, size_t *length, uint32_t *sequence);
+
+/// <summary>
+///     Reports the outcome of sending a message returned by GetNextOfflineMessage. A message that
+///     was not delivered is returned by GetNextOfflineMessage again, before the messages not sent
+///     yet; the other messages in flight are not.
+/// </summary>
+/// <param name="sequence">Sequence number of the message</param>
+/// <param name="delivered">true if IoT Hub confirmed the message</param>
+void AcknowledgeOfflineMessage(uint32_t sequence, bool delivered);
+
+/// <summary>
+///     Returns the number of messages not delivered yet.
+/// </summary>
+size_t GetOfflineQueueLength(void);
@@ -3,6 +3,8 @@
     https://github.com/kgabis/parson at commit id 4f3eaa6
     Patched to avoid any usage of fopen(), and removed implicit
     cast warnings by making them explicit.
+    Patched to parse strings of explicit length, optionally into an arena.
+    Patched to look up object keys by cached hash.
 */
 
 /*
@@ -55,9 +57,11 @@
 
 #define SIZEOF_TOKEN(a) (sizeof(a) - 1)
 #define SKIP_CHAR(str) ((*str)++)
-#define SKIP_WHITESPACES(str)                 \
-    while (isspace((unsigned char)(**str))) { \
-        SKIP_CHAR(str);                       \
+/* Current character of the parser, '\0' at the end of the input */
+#define PEEK(str, end) (*(str) < (end) ? **(str) : '\0')
+#define SKIP_WHITESPACES(str, end)                  \
+    while (isspace((unsigned char)PEEK(str, end))) { \
+        SKIP_CHAR(str);                             \
     }
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
@@ -67,6 +71,9 @@
 static JSON_Malloc_Function parson_malloc = malloc;
 static JSON_Free_Function parson_free = free;
 
+/* Arena of the running json_parse_string_n_arena, see arena_malloc */
+static JSON_Arena *parson_arena = NULL;
+
 #define IS_CONT(b) (((unsigned char)(b)&0xC0) == 0x80) /* is utf-8 continuation byte */
 
 /* Type definitions */
@@ -88,6 +95,7 @@ struct json_value_t {
 struct json_object_t {
     JSON_Value *wrapping_value;
     char **names;
+    unsigned long *hashes; /* hash_string of each name, compared before the name itself */
     JSON_Value **values;
     size_t count;
     size_t capacity;
@@ -110,6 +118,7 @@ static int num_bytes_in_utf8_sequence(unsigned char c);
 static int verify_utf8_sequence(const unsigned char *string, int *len);
 static int is_valid_utf8(const char *string, size_t string_len);
 static int is_decimal(const char *string, size_t length);
+static size_t hash_string(const char *string, size_t n, unsigned long *hash);
 
 /* JSON Object */
 static JSON_Object *json_object_init(JSON_Value *wrapping_value);
@@ -119,6 +128,8 @@ static JSON_Status json_object_addn(JSON_Object *object, const char *name, size_
 static JSON_Status json_object_resize(JSON_Object *object, size_t new_capacity);
 static JSON_Value *json_object_getn_value(const JSON_Object *object, const char *name,
                                           size_t name_len);
+static int json_object_getn_index(const JSON_Object *object, const char *name, size_t name_len,
+                                  size_t *index);
 static JSON_Status json_object_remove_internal(JSON_Object *object, const char *name,
                                                int free_value);
 static JSON_Status json_object_dotremove_internal(JSON_Object *object, const char *name,
@@ -134,18 +145,23 @@ static void json_array_free(JSON_Array *array);
 /* JSON Value */
 static JSON_Value *json_value_init_string_no_copy(char *string);
 
+/* Arena */
+static void *arena_malloc(size_t size);
+static void arena_free(void *ptr);
+
 /* Parser */
-static JSON_Status skip_quotes(const char **string);
-static int parse_utf16(const char **unprocessed, char **processed);
+static JSON_Status skip_quotes(const char **string, const char *end);
+static int parse_utf16(const char **unprocessed, const char *end, char **processed);
 static char *process_string(const char *input, size_t len);
-static char *get_quoted_string(const char **string);
-static JSON_Value *parse_object_value(const char **string, size_t nesting);
-static JSON_Value *parse_array_value(const char **string, size_t nesting);
-static JSON_Value *parse_string_value(const char **string);
-static JSON_Value *parse_boolean_value(const char **string);
-static JSON_Value *parse_number_value(const char **string);
-static JSON_Value *parse_null_value(const char **string);
-static JSON_Value *parse_value(const char **string, size_t nesting);
+static char *get_quoted_string(const char **string, const char *end);
+static JSON_Value *parse_object_value(const char **string, const char *end, size_t nesting);
+static JSON_Value *parse_array_value(const char **string, const char *end, size_t nesting);
+static JSON_Value *parse_string_value(const char **string, const char *end);
+static JSON_Value *parse_boolean_value(const char **string, const char *end);
+static JSON_Value *parse_number_value(const char **string, const char *end);
+static JSON_Value *parse_null_value(const char **string, const char *end);
+static JSON_Value *parse_value(const char **string, const char *end, size_t nesting);
+static JSON_Value *parse_string_n(const char *string, size_t length);
 
 /* Serialization */
 static int json_serialize_to_buffer_r(const JSON_Value *value, char *buf, int level, int is_pretty,
@@ -286,6 +302,18 @@ static int is_decimal(const char *string, size_t length)
     return 1;
 }
 
+/* djb2 over at most n characters, stopping at the first '\0'. Returns the characters hashed. */
+static size_t hash_string(const char *string, size_t n, unsigned long *hash)
+{
+    size_t i;
+    unsigned long h = 5381;
+    for (i = 0; i < n && string[i] != '\0'; i++) {
+        h = ((h << 5) + h) + (unsigned char)string[i];
+    }
+    *hash = h;
+    return i;
+}
+
 static void remove_comments(char *string, const char *start_token, const char *end_token)
 {
     int in_string = 0, escaped = 0;
@@ -331,6 +359,7 @@ static JSON_Object *json_object_init(JSON_Value *wrapping_value)
     }
     new_obj->wrapping_value = wrapping_value;
     new_obj->names = (char **)NULL;
+    new_obj->hashes = (unsigned long *)NULL;
     new_obj->values = (JSON_Value **)NULL;
     new_obj->capacity = 0;
     new_obj->count = 0;
@@ -366,6 +395,7 @@ static JSON_Status json_object_addn(JSON_Object *object, const char *name, size_
     if (object->names[index] == NULL) {
         return JSONFailure;
     }
+    hash_string(object->names[index], name_len, &object->hashes[index]);
     value->parent = json_object_get_wrapping_value(object);
     object->values[index] = value;
     object->count++;
@@ -375,6 +405,7 @@ static JSON_Status json_object_addn(JSON_Object *object, const char *name, size_
 static JSON_Status json_object_resize(JSON_Object *object, size_t new_capacity)
 {
     char **temp_names = NULL;
+    unsigned long *temp_hashes = NULL;
     JSON_Value **temp_values = NULL;
 
     if ((object->names == NULL && object->values != NULL) ||
@@ -385,18 +416,27 @@ static JSON_Status json_object_resize(JSON_Object *object, size_t new_capacity)
     if (temp_names == NULL) {
         return JSONFailure;
     }
+    temp_hashes = (unsigned long *)parson_malloc(new_capacity * sizeof(unsigned long));
+    if (temp_hashes == NULL) {
+        parson_free(temp_names);
+        return JSONFailure;
+    }
     temp_values = (JSON_Value **)parson_malloc(new_capacity * sizeof(JSON_Value *));
     if (temp_values == NULL) {
         parson_free(temp_names);
+        parson_free(temp_hashes);
         return JSONFailure;
     }
     if (object->names != NULL && object->values != NULL && object->count > 0) {
         memcpy(temp_names, object->names, object->count * sizeof(char *));
+        memcpy(temp_hashes, object->hashes, object->count * sizeof(unsigned long));
         memcpy(temp_values, object->values, object->count * sizeof(JSON_Value *));
     }
     parson_free(object->names);
+    parson_free(object->hashes);
     parson_free(object->values);
     object->names = temp_names;
+    object->hashes = temp_hashes;
     object->values = temp_values;
     object->capacity = new_capacity;
     return JSONSuccess;
@@ -405,42 +445,52 @@ static JSON_Status json_object_resize(JSON_Object *object, size_t new_capacity)
 static JSON_Value *json_object_getn_value(const JSON_Object *object, const char *name,
                                           size_t name_len)
 {
-    size_t i, name_length;
-    for (i = 0; i < json_object_get_count(object); i++) {
-        name_length = strlen(object->names[i]);
-        if (name_length != name_len) {
-            continue;
-        }
-        if (strncmp(object->names[i], name, name_len) == 0) {
-            return object->values[i];
+    size_t index;
+    if (!json_object_getn_index(object, name, name_len, &index)) {
+        return NULL;
+    }
+    return object->values[index];
+}
+
+/* Names are stored up to their first '\0', so a name_len with an earlier '\0' never matches.
+ * Otherwise equal hashes and equal first name_len characters leave only the terminator to check. */
+static int json_object_getn_index(const JSON_Object *object, const char *name, size_t name_len,
+                                  size_t *index)
+{
+    size_t i;
+    unsigned long hash;
+    if (object == NULL || hash_string(name, name_len, &hash) != name_len) {
+        return 0;
+    }
+    for (i = 0; i < object->count; i++) {
+        if (object->hashes[i] == hash && strncmp(object->names[i], name, name_len) == 0 &&
+            object->names[i][name_len] == '\0') {
+            *index = i;
+            return 1;
         }
     }
-    return NULL;
+    return 0;
 }
 
 static JSON_Status json_object_remove_internal(JSON_Object *object, const char *name,
                                                int free_value)
 {
     size_t i = 0, last_item_index = 0;
-    if (object == NULL || json_object_get_value(object, name) == NULL) {
+    if (object == NULL || name == NULL || !json_object_getn_index(object, name, strlen(name), &i)) {
         return JSONFailure;
     }
     last_item_index = json_object_get_count(object) - 1;
-    for (i = 0; i < json_object_get_count(object); i++) {
-        if (strcmp(object->names[i], name) == 0) {
-            parson_free(object->names[i]);
-            if (free_value) {
-                json_value_free(object->values[i]);
-            }
-            if (i != last_item_index) { /* Replace key value pair with one from the end */
-                object->names[i] = object->names[last_item_index];
-                object->values[i] = object->values[last_item_index];
-            }
-            object->count -= 1;
-            return JSONSuccess;
-        }
+    parson_free(object->names[i]);
+    if (free_value) {
+        json_value_free(object->values[i]);
     }
-    return JSONFailure; /* No execution path should end here */
+    if (i != last_item_index) { /* Replace key value pair with one from the end */
+        object->names[i] = object->names[last_item_index];
+        object->hashes[i] = object->hashes[last_item_index];
+        object->values[i] = object->values[last_item_index];
+    }
+    object->count -= 1;
+    return JSONSuccess;
 }
 
 static JSON_Status json_object_dotremove_internal(JSON_Object *object, const char *name,
@@ -468,6 +518,7 @@ static void json_object_free(JSON_Object *object)
         json_value_free(object->values[i]);
     }
     parson_free(object->names);
+    parson_free(object->hashes);
     parson_free(object->values);
     parson_free(object);
 }
@@ -543,18 +594,37 @@ static JSON_Value *json_value_init_string_no_copy(char *string)
 }
 
 /* Parser */
-static JSON_Status skip_quotes(const char **string)
+/* Arena */
+static void *arena_malloc(size_t size)
+{
+    /* Keeps every allocation aligned for any of the parson types */
+    size_t alignment = sizeof(double) > sizeof(void *) ? sizeof(double) : sizeof(void *);
+    size_t start = (parson_arena->used + alignment - 1) & ~(alignment - 1);
+    if (start > parson_arena->size || size > parson_arena->size - start) {
+        return NULL;
+    }
+    parson_arena->used = start + size;
+    return parson_arena->buffer + start;
+}
+
+static void arena_free(void *ptr)
+{
+    (void)ptr; /* released all at once by json_arena_reset */
+}
+
+/* Parser */
+static JSON_Status skip_quotes(const char **string, const char *end)
 {
-    if (**string != '\"') {
+    if (PEEK(string, end) != '\"') {
         return JSONFailure;
     }
     SKIP_CHAR(string);
-    while (**string != '\"') {
-        if (**string == '\0') {
+    while (PEEK(string, end) != '\"') {
+        if (PEEK(string, end) == '\0') {
             return JSONFailure;
-        } else if (**string == '\\') {
+        } else if (PEEK(string, end) == '\\') {
             SKIP_CHAR(string);
-            if (**string == '\0') {
+            if (PEEK(string, end) == '\0') {
                 return JSONFailure;
             }
         }
@@ -564,13 +634,16 @@ static JSON_Status skip_quotes(const char **string)
     return JSONSuccess;
 }
 
-static int parse_utf16(const char **unprocessed, char **processed)
+static int parse_utf16(const char **unprocessed, const char *end, char **processed)
 {
     unsigned int cp, lead, trail;
     int parse_succeeded = 0;
     char *processed_ptr = *processed;
     const char *unprocessed_ptr = *unprocessed;
     unprocessed_ptr++; /* skips u */
+    if (end - unprocessed_ptr < 4) {
+        return JSONFailure;
+    }
     parse_succeeded = parse_utf16_hex(unprocessed_ptr, &cp);
     if (!parse_succeeded) {
         return JSONFailure;
@@ -590,7 +663,8 @@ static int parse_utf16(const char **unprocessed, char **processed)
         lead = cp;
         unprocessed_ptr +=
             4; /* should always be within the buffer, otherwise previous sscanf would fail */
-        if (*unprocessed_ptr++ != '\\' || *unprocessed_ptr++ != 'u') {
+        if (end - unprocessed_ptr < 6 || *unprocessed_ptr++ != '\\' ||
+            *unprocessed_ptr++ != 'u') {
             return JSONFailure;
         }
         parse_succeeded = parse_utf16_hex(unprocessed_ptr, &trail);
@@ -655,7 +729,7 @@ static char *process_string(const char *input, size_t len)
                 *output_ptr = '\t';
                 break;
             case 'u':
-                if (parse_utf16(&input_ptr, &output_ptr) == JSONFailure) {
+                if (parse_utf16(&input_ptr, input + len, &output_ptr) == JSONFailure) {
                     goto error;
                 }
                 break;
@@ -674,7 +748,9 @@ static char *process_string(const char *input, size_t len)
     *output_ptr = '\0';
     /* resize to new length */
     final_size = (size_t)(output_ptr - output) + 1;
-    /* todo: don't resize if final_size == initial_size */
+    if (final_size == initial_size || parson_malloc == arena_malloc) {
+        return output; /* an arena would keep both copies */
+    }
     resized_output = (char *)parson_malloc(final_size);
     if (resized_output == NULL) {
         goto error;
@@ -689,11 +765,11 @@ error:
 
 /* Return processed contents of a string between quotes and
    skips passed argument to a matching quote. */
-static char *get_quoted_string(const char **string)
+static char *get_quoted_string(const char **string, const char *end)
 {
     const char *string_start = *string;
     size_t string_len = 0;
-    JSON_Status status = skip_quotes(string);
+    JSON_Status status = skip_quotes(string, end);
     if (status != JSONSuccess) {
         return NULL;
     }
@@ -701,22 +777,22 @@ static char *get_quoted_string(const char **string)
     return process_string(string_start + 1, string_len);
 }
 
-static JSON_Value *parse_value(const char **string, size_t nesting)
+static JSON_Value *parse_value(const char **string, const char *end, size_t nesting)
 {
     if (nesting > MAX_NESTING) {
         return NULL;
     }
-    SKIP_WHITESPACES(string);
-    switch (**string) {
+    SKIP_WHITESPACES(string, end);
+    switch (PEEK(string, end)) {
     case '{':
-        return parse_object_value(string, nesting + 1);
+        return parse_object_value(string, end, nesting + 1);
     case '[':
-        return parse_array_value(string, nesting + 1);
+        return parse_array_value(string, end, nesting + 1);
     case '\"':
-        return parse_string_value(string);
+        return parse_string_value(string, end);
     case 'f':
     case 't':
-        return parse_boolean_value(string);
+        return parse_boolean_value(string, end);
     case '-':
     case '0':
     case '1':
@@ -728,15 +804,15 @@ static JSON_Value *parse_value(const char **string, size_t nesting)
     case '7':
     case '8':
     case '9':
-        return parse_number_value(string);
+        return parse_number_value(string, end);
     case 'n':
-        return parse_null_value(string);
+        return parse_null_value(string, end);
     default:
         return NULL;
     }
 }
 
-static JSON_Value *parse_object_value(const char **string, size_t nesting)
+static JSON_Value *parse_object_value(const char **string, const char *end, size_t nesting)
 {
     JSON_Value *output_value = NULL, *new_value = NULL;
     JSON_Object *output_object = NULL;
@@ -745,31 +821,31 @@ static JSON_Value *parse_object_value(const char **string, size_t nesting)
     if (output_value == NULL) {
         return NULL;
     }
-    if (**string != '{') {
+    if (PEEK(string, end) != '{') {
         json_value_free(output_value);
         return NULL;
     }
     output_object = json_value_get_object(output_value);
     SKIP_CHAR(string);
-    SKIP_WHITESPACES(string);
-    if (**string == '}') { /* empty object */
+    SKIP_WHITESPACES(string, end);
+    if (PEEK(string, end) == '}') { /* empty object */
         SKIP_CHAR(string);
         return output_value;
     }
-    while (**string != '\0') {
-        new_key = get_quoted_string(string);
+    while (PEEK(string, end) != '\0') {
+        new_key = get_quoted_string(string, end);
         if (new_key == NULL) {
             json_value_free(output_value);
             return NULL;
         }
-        SKIP_WHITESPACES(string);
-        if (**string != ':') {
+        SKIP_WHITESPACES(string, end);
+        if (PEEK(string, end) != ':') {
             parson_free(new_key);
             json_value_free(output_value);
             return NULL;
         }
         SKIP_CHAR(string);
-        new_value = parse_value(string, nesting);
+        new_value = parse_value(string, end, nesting);
         if (new_value == NULL) {
             parson_free(new_key);
             json_value_free(output_value);
@@ -782,16 +858,17 @@ static JSON_Value *parse_object_value(const char **string, size_t nesting)
             return NULL;
         }
         parson_free(new_key);
-        SKIP_WHITESPACES(string);
-        if (**string != ',') {
+        SKIP_WHITESPACES(string, end);
+        if (PEEK(string, end) != ',') {
             break;
         }
         SKIP_CHAR(string);
-        SKIP_WHITESPACES(string);
+        SKIP_WHITESPACES(string, end);
     }
-    SKIP_WHITESPACES(string);
-    if (**string != '}' || /* Trim object after parsing is over */
-        json_object_resize(output_object, json_object_get_count(output_object)) == JSONFailure) {
+    SKIP_WHITESPACES(string, end);
+    if (PEEK(string, end) != '}' || /* Trim object after parsing is over, except in an arena */
+        (parson_malloc != arena_malloc &&
+         json_object_resize(output_object, json_object_get_count(output_object)) == JSONFailure)) {
         json_value_free(output_value);
         return NULL;
     }
@@ -799,7 +876,7 @@ static JSON_Value *parse_object_value(const char **string, size_t nesting)
     return output_value;
 }
 
-static JSON_Value *parse_array_value(const char **string, size_t nesting)
+static JSON_Value *parse_array_value(const char **string, const char *end, size_t nesting)
 {
     JSON_Value *output_value = NULL, *new_array_value = NULL;
     JSON_Array *output_array = NULL;
@@ -807,19 +884,19 @@ static JSON_Value *parse_array_value(const char **string, size_t nesting)
     if (output_value == NULL) {
         return NULL;
     }
-    if (**string != '[') {
+    if (PEEK(string, end) != '[') {
         json_value_free(output_value);
         return NULL;
     }
     output_array = json_value_get_array(output_value);
     SKIP_CHAR(string);
-    SKIP_WHITESPACES(string);
-    if (**string == ']') { /* empty array */
+    SKIP_WHITESPACES(string, end);
+    if (PEEK(string, end) == ']') { /* empty array */
         SKIP_CHAR(string);
         return output_value;
     }
-    while (**string != '\0') {
-        new_array_value = parse_value(string, nesting);
+    while (PEEK(string, end) != '\0') {
+        new_array_value = parse_value(string, end, nesting);
         if (new_array_value == NULL) {
             json_value_free(output_value);
             return NULL;
@@ -829,16 +906,17 @@ static JSON_Value *parse_array_value(const char **string, size_t nesting)
             json_value_free(output_value);
             return NULL;
         }
-        SKIP_WHITESPACES(string);
-        if (**string != ',') {
+        SKIP_WHITESPACES(string, end);
+        if (PEEK(string, end) != ',') {
             break;
         }
         SKIP_CHAR(string);
-        SKIP_WHITESPACES(string);
+        SKIP_WHITESPACES(string, end);
     }
-    SKIP_WHITESPACES(string);
-    if (**string != ']' || /* Trim array after parsing is over */
-        json_array_resize(output_array, json_array_get_count(output_array)) == JSONFailure) {
+    SKIP_WHITESPACES(string, end);
+    if (PEEK(string, end) != ']' || /* Trim array after parsing is over, except in an arena */
+        (parson_malloc != arena_malloc &&
+         json_array_resize(output_array, json_array_get_count(output_array)) == JSONFailure)) {
         json_value_free(output_value);
         return NULL;
     }
@@ -846,10 +924,10 @@ static JSON_Value *parse_array_value(const char **string, size_t nesting)
     return output_value;
 }
 
-static JSON_Value *parse_string_value(const char **string)
+static JSON_Value *parse_string_value(const char **string, const char *end)
 {
     JSON_Value *value = NULL;
-    char *new_string = get_quoted_string(string);
+    char *new_string = get_quoted_string(string, end);
     if (new_string == NULL) {
         return NULL;
     }
@@ -861,37 +939,51 @@ static JSON_Value *parse_string_value(const char **string)
     return value;
 }
 
-static JSON_Value *parse_boolean_value(const char **string)
+static JSON_Value *parse_boolean_value(const char **string, const char *end)
 {
     size_t true_token_size = SIZEOF_TOKEN("true");
     size_t false_token_size = SIZEOF_TOKEN("false");
-    if (strncmp("true", *string, true_token_size) == 0) {
+    size_t remaining = (size_t)(end - *string);
+    if (remaining >= true_token_size && strncmp("true", *string, true_token_size) == 0) {
         *string += true_token_size;
         return json_value_init_boolean(1);
-    } else if (strncmp("false", *string, false_token_size) == 0) {
+    } else if (remaining >= false_token_size &&
+               strncmp("false", *string, false_token_size) == 0) {
         *string += false_token_size;
         return json_value_init_boolean(0);
     }
     return NULL;
 }
 
-static JSON_Value *parse_number_value(const char **string)
+static JSON_Value *parse_number_value(const char **string, const char *end)
 {
-    char *end;
+    /* strtod must not read past end, so it gets a terminated copy of the number */
+    char num_buf[NUM_BUF_SIZE];
+    char *number_end;
+    size_t len = 0;
     double number = 0;
+    while (*string + len < end && (*string)[len] != '\0' &&
+           strchr("+-.0123456789eE", (*string)[len]) != NULL) {
+        len++;
+    }
+    if (len >= NUM_BUF_SIZE) {
+        return NULL;
+    }
+    memcpy(num_buf, *string, len);
+    num_buf[len] = '\0';
     errno = 0;
-    number = strtod(*string, &end);
-    if (errno || !is_decimal(*string, (size_t)(end - *string))) {
+    number = strtod(num_buf, &number_end);
+    if (errno || !is_decimal(num_buf, (size_t)(number_end - num_buf))) {
         return NULL;
     }
-    *string = end;
+    *string += number_end - num_buf;
     return json_value_init_number(number);
 }
 
-static JSON_Value *parse_null_value(const char **string)
+static JSON_Value *parse_null_value(const char **string, const char *end)
 {
     size_t token_size = SIZEOF_TOKEN("null");
-    if (strncmp("null", *string, token_size) == 0) {
+    if ((size_t)(end - *string) >= token_size && strncmp("null", *string, token_size) == 0) {
         *string += token_size;
         return json_value_init_null();
     }
@@ -1214,15 +1306,63 @@ static int append_string(char *buf, const char *string)
 #undef APPEND_INDENT
 
 /* Parser API */
+static JSON_Value *parse_string_n(const char *string, size_t length)
+{
+    const char *end = string + length;
+    if (length >= 3 && string[0] == '\xEF' && string[1] == '\xBB' && string[2] == '\xBF') {
+        string = string + 3; /* Support for UTF-8 BOM */
+    }
+    return parse_value(&string, end, 0);
+}
+
 JSON_Value *json_parse_string(const char *string)
 {
     if (string == NULL) {
         return NULL;
     }
-    if (string[0] == '\xEF' && string[1] == '\xBB' && string[2] == '\xBF') {
-        string = string + 3; /* Support for UTF-8 BOM */
+    return parse_string_n(string, strlen(string));
+}
+
+JSON_Value *json_parse_string_n(const char *string, size_t length)
+{
+    if (string == NULL) {
+        return NULL;
     }
-    return parse_value((const char **)&string, 0);
+    return parse_string_n(string, length);
+}
+
+void json_arena_init(JSON_Arena *arena, void *buffer, size_t size)
+{
+    arena->buffer = (char *)buffer;
+    arena->size = size;
+    arena->used = 0;
+}
+
+void json_arena_reset(JSON_Arena *arena)
+{
+    arena->used = 0;
+}
+
+JSON_Value *json_parse_string_n_arena(const char *string, size_t length, JSON_Arena *arena)
+{
+    JSON_Malloc_Function heap_malloc = parson_malloc;
+    JSON_Free_Function heap_free = parson_free;
+    JSON_Value *result = NULL;
+    size_t used = arena->used;
+    if (string == NULL) {
+        return NULL;
+    }
+    parson_arena = arena;
+    parson_malloc = arena_malloc;
+    parson_free = arena_free;
+    result = parse_string_n(string, length);
+    parson_malloc = heap_malloc;
+    parson_free = heap_free;
+    parson_arena = NULL;
+    if (result == NULL) {
+        arena->used = used; /* nothing of a failed parse is kept */
+    }
+    return result;
 }
 
 JSON_Value *json_parse_string_with_comments(const char *string)
@@ -1236,7 +1376,8 @@ JSON_Value *json_parse_string_with_comments(const char *string)
     remove_comments(string_mutable_copy, "/*", "*/");
     remove_comments(string_mutable_copy, "//", "\n");
     string_mutable_copy_ptr = string_mutable_copy;
-    result = parse_value((const char **)&string_mutable_copy_ptr, 0);
+    result = parse_value((const char **)&string_mutable_copy_ptr,
+                         string_mutable_copy + strlen(string_mutable_copy), 0);
     parson_free(string_mutable_copy);
     return result;
 }
@@ -1876,20 +2017,14 @@ JSON_Status json_array_append_null(JSON_Array *array)
 JSON_Status json_object_set_value(JSON_Object *object, const char *name, JSON_Value *value)
 {
     size_t i = 0;
-    JSON_Value *old_value;
     if (object == NULL || name == NULL || value == NULL || value->parent != NULL) {
         return JSONFailure;
     }
-    old_value = json_object_get_value(object, name);
-    if (old_value != NULL) { /* free and overwrite old value */
-        json_value_free(old_value);
-        for (i = 0; i < json_object_get_count(object); i++) {
-            if (strcmp(object->names[i], name) == 0) {
-                value->parent = json_object_get_wrapping_value(object);
-                object->values[i] = value;
-                return JSONSuccess;
-            }
-        }
+    if (json_object_getn_index(object, name, strlen(name), &i)) { /* free and overwrite old value */
+        json_value_free(object->values[i]);
+        value->parent = json_object_get_wrapping_value(object);
+        object->values[i] = value;
+        return JSONSuccess;
     }
     /* add new key value pair */
     return json_object_add(object, name, value);
@@ -3,6 +3,7 @@
     https://github.com/kgabis/parson at commit id 4f3eaa6
     Patched to avoid any usage of fopen(), and removed implicit
     cast warnings by making them explicit.
+    Patched to parse strings of explicit length, optionally into an arena.
 */
 
 /*
@@ -66,6 +67,28 @@ void json_set_allocation_functions(JSON_Malloc_Function malloc_fun, JSON_Free_Fu
 /*  Parses first JSON value in a string, returns NULL in case of error */
 JSON_Value *json_parse_string(const char *string);
 
+/*  Parses first JSON value in the first length bytes of a string, which need not be null
+    terminated, returns NULL in case of error */
+JSON_Value *json_parse_string_n(const char *string, size_t length);
+
+/*  Bump allocator for json_parse_string_n_arena. The buffer is owned by the caller. */
+typedef struct json_arena_t {
+    char *buffer;
+    size_t size;
+    size_t used;
+} JSON_Arena;
+
+void json_arena_init(JSON_Arena *arena, void *buffer, size_t size);
+
+/*  Releases all values parsed into the arena at once */
+void json_arena_reset(JSON_Arena *arena);
+
+/*  Like json_parse_string_n, but every value and string is allocated from the arena instead
+    of the heap. Returns NULL in case of error or if the arena is too small; the arena is then
+    left as it was. Values parsed this way must not be freed with json_value_free, nor modified
+    by functions that allocate; they are released with json_arena_reset. */
+JSON_Value *json_parse_string_n_arena(const char *string, size_t length, JSON_Arena *arena);
+
 /*  Parses first JSON value in a string and ignores comments (/ * * / and //),
     returns NULL in case of error */
 JSON_Value *json_parse_string_with_comments(const char *string);
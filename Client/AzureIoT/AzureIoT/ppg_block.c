@@ -0,0 +1,78 @@
+#include <string.h>
+#include "ppg_block.h"
+
+static void PutUint16(uint8_t *p, uint16_t value)
+{
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+}
+
+static void PutUint32(uint8_t *p, uint32_t value)
+{
+    PutUint16(p, (uint16_t)value);
+    PutUint16(p + 2, (uint16_t)(value >> 16));
+}
+
+/// <summary>
+///     Writes the zigzag varint of a channel delta.
+/// </summary>
+/// <returns>Number of bytes written, at most five</returns>
+static size_t PutDelta(uint8_t *p, uint32_t value, uint32_t previous)
+{
+    int32_t delta = (int32_t)(value - previous);
+    uint32_t zigzag = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+    size_t n = 0;
+    while (zigzag >= 0x80) {
+        p[n++] = (uint8_t)(zigzag | 0x80);
+        zigzag >>= 7;
+    }
+    p[n++] = (uint8_t)zigzag;
+    return n;
+}
+
+bool BeginPpgBlock(PpgBlock *block, uint8_t *buffer, size_t capacity, const char *deviceId,
+                   uint32_t sequence, uint16_t sampleRate)
+{
+    size_t deviceIdLength = strnlen(deviceId, PPG_BLOCK_MAX_DEVICE_ID_LENGTH);
+    if (capacity < PPG_BLOCK_HEADER_SIZE + deviceIdLength) {
+        return false;
+    }
+
+    buffer[0] = 'P';
+    buffer[1] = 'G';
+    buffer[2] = PPG_BLOCK_VERSION;
+    buffer[3] = (uint8_t)deviceIdLength;
+    PutUint32(buffer + 4, sequence);
+    PutUint16(buffer + 8, sampleRate);
+    PutUint16(buffer + 10, 0);
+    memcpy(buffer + PPG_BLOCK_HEADER_SIZE, deviceId, deviceIdLength);
+
+    block->buffer = buffer;
+    block->capacity = capacity;
+    block->length = PPG_BLOCK_HEADER_SIZE + deviceIdLength;
+    block->sampleCount = 0;
+    block->previousIr = 0;
+    block->previousRed = 0;
+    return true;
+}
+
+bool AddToPpgBlock(PpgBlock *block, uint32_t ir, uint32_t red)
+{
+    if (block->sampleCount == UINT16_MAX ||
+        block->capacity - block->length < PPG_BLOCK_MAX_SAMPLE_SIZE) {
+        return false;
+    }
+
+    block->length += PutDelta(block->buffer + block->length, ir, block->previousIr);
+    block->length += PutDelta(block->buffer + block->length, red, block->previousRed);
+    block->previousIr = ir;
+    block->previousRed = red;
+    block->sampleCount++;
+    return true;
+}
+
+size_t FinishPpgBlock(PpgBlock *block)
+{
+    PutUint16(block->buffer + 10, block->sampleCount);
+    return block->length;
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// <summary>
+///     Binary block of raw PPG samples, sent as a telemetry message with content type
+///     PPG_BLOCK_CONTENT_TYPE and content encoding PPG_BLOCK_CONTENT_ENCODING.
+///
+///     Layout, multi-byte fields little endian:
+///         offset 0   2 bytes   magic 'P' 'G'
+///         offset 2   1 byte    format version, PPG_BLOCK_VERSION
+///         offset 3   1 byte    device id length n, at most PPG_BLOCK_MAX_DEVICE_ID_LENGTH
+///         offset 4   4 bytes   sequence number, incremented per block by the sender
+///         offset 8   2 bytes   sample rate in samples per second
+///         offset 10  2 bytes   number of samples in the block
+///         offset 12  n bytes   IoT Hub device id, not null terminated, may be empty
+///         offset 12+n          samples
+///     Each sample is the IR value followed by the red value. Every value is stored as the
+///     difference to the previous value of the same channel (to 0 for the first sample),
+///     zigzag mapped to an unsigned number, (d << 1) ^ (d >> 31), and written as a base-128
+///     varint, low 7 bits first with the top bit set on all but the last byte. The 18-bit
+///     MAX30102 samples change slowly, so most values take one or two bytes instead of four.
+/// </summary>
+#define PPG_BLOCK_VERSION 1
+#define PPG_BLOCK_CONTENT_TYPE "application%2Foctet-stream"
+#define PPG_BLOCK_CONTENT_ENCODING "ppg-delta-varint-v1"
+#define PPG_BLOCK_HEADER_SIZE 12
+#define PPG_BLOCK_MAX_DEVICE_ID_LENGTH 128 // An Azure Sphere device id
+#define PPG_BLOCK_MAX_SAMPLE_SIZE 10 // Two values of at most five varint bytes each
+
+/// <summary>
+///     Buffer size that always holds a block of the given number of samples.
+/// </summary>
+#define PPG_BLOCK_MAX_SIZE(samples) \
+    (PPG_BLOCK_HEADER_SIZE + PPG_BLOCK_MAX_DEVICE_ID_LENGTH + (samples) * PPG_BLOCK_MAX_SAMPLE_SIZE)
+
+/// <summary>
+///     Encoder state of one block. See BeginPpgBlock.
+/// </summary>
+typedef struct {
+    uint8_t *buffer;
+    size_t capacity;
+    size_t length;
+    uint16_t sampleCount;
+    uint32_t previousIr;
+    uint32_t previousRed;
+} PpgBlock;
+
+/// <summary>
+///     Starts a new block in the given buffer and writes its header.
+/// </summary>
+/// <param name="block">Encoder state</param>
+/// <param name="buffer">Buffer for the encoded block</param>
+/// <param name="capacity">Size of the buffer in bytes, see PPG_BLOCK_MAX_SIZE</param>
+/// <param name="deviceId">Null terminated device id, truncated to PPG_BLOCK_MAX_DEVICE_ID_LENGTH</param>
+/// <param name="sequence">Sequence number of the block</param>
+/// <param name="sampleRate">Sample rate in samples per second</param>
+/// <returns>false if the buffer cannot hold the header</returns>
+bool BeginPpgBlock(PpgBlock *block, uint8_t *buffer, size_t capacity, const char *deviceId,
+                   uint32_t sequence, uint16_t sampleRate);
+
+/// <summary>
+///     Appends one IR and red sample pair to the block.
+/// </summary>
+/// <returns>false if the block is full and the sample was not added</returns>
+bool AddToPpgBlock(PpgBlock *block, uint32_t ir, uint32_t red);
+
+/// <summary>
+///     Completes the header of the block.
+/// </summary>
+/// <returns>Length of the encoded block in bytes</returns>
+size_t FinishPpgBlock(PpgBlock *block);
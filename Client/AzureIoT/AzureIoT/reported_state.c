@@ -0,0 +1,117 @@
+#include <stddef.h>
+#include "parson.h"
+#include "reported_state.h"
+
+// Properties set since the last MarkReportedStateSent, and the values sent before
+static JSON_Value *pendingProperties = NULL;
+static JSON_Value *sentProperties = NULL;
+
+/// <summary>
+///     Returns the object behind the value, creating an empty object first if needed.
+/// </summary>
+static JSON_Object *GetOrCreateObject(JSON_Value **value)
+{
+    if (*value == NULL) {
+        *value = json_value_init_object();
+    }
+    return json_value_get_object(*value);
+}
+
+/// <summary>
+///     Records the property unless it equals the value sent before. Takes ownership of value.
+/// </summary>
+static bool SetReportedValue(const char *name, JSON_Value *value)
+{
+    if (name == NULL || value == NULL) {
+        json_value_free(value);
+        return false;
+    }
+
+    JSON_Object *pending = GetOrCreateObject(&pendingProperties);
+    if (pending == NULL) {
+        json_value_free(value);
+        return false;
+    }
+
+    JSON_Value *sent = json_object_get_value(json_value_get_object(sentProperties), name);
+    if (sent != NULL && json_value_equals(sent, value)) {
+        // Back to what IoT Hub already has; an earlier pending change is void
+        json_object_remove(pending, name);
+        json_value_free(value);
+        return true;
+    }
+
+    if (json_object_set_value(pending, name, value) != JSONSuccess) {
+        json_value_free(value);
+        return false;
+    }
+    return true;
+}
+
+bool SetReportedBool(const char *name, bool value)
+{
+    return SetReportedValue(name, json_value_init_boolean(value));
+}
+
+bool SetReportedInt(const char *name, int value)
+{
+    return SetReportedValue(name, json_value_init_number(value));
+}
+
+bool SetReportedString(const char *name, const char *value)
+{
+    return SetReportedValue(name, json_value_init_string(value));
+}
+
+bool MergeReportedState(const char *json)
+{
+    JSON_Value *root = json_parse_string(json);
+    JSON_Object *object = json_value_get_object(root);
+    if (object == NULL) {
+        json_value_free(root);
+        return false;
+    }
+
+    bool merged = true;
+    for (size_t i = 0; i < json_object_get_count(object); i++) {
+        merged &= SetReportedValue(json_object_get_name(object, i),
+                                   json_value_deep_copy(json_object_get_value_at(object, i)));
+    }
+    json_value_free(root);
+    return merged;
+}
+
+bool IsReportedStatePending(void)
+{
+    return json_object_get_count(json_value_get_object(pendingProperties)) > 0;
+}
+
+char *FormatReportedState(void)
+{
+    if (!IsReportedStatePending()) {
+        return NULL;
+    }
+    return json_serialize_to_string(pendingProperties);
+}
+
+void MarkReportedStateSent(void)
+{
+    JSON_Object *pending = json_value_get_object(pendingProperties);
+    JSON_Object *sent = GetOrCreateObject(&sentProperties);
+    for (size_t i = 0; sent != NULL && i < json_object_get_count(pending); i++) {
+        const char *name = json_object_get_name(pending, i);
+        JSON_Value *copy = json_value_deep_copy(json_object_get_value_at(pending, i));
+        if (copy == NULL || json_object_set_value(sent, name, copy) != JSONSuccess) {
+            // Without the sent value the property is simply sent again next time
+            json_value_free(copy);
+            json_object_remove(sent, name);
+        }
+    }
+    json_object_clear(pending);
+}
+
+void ForgetReportedState(void)
+{
+    json_value_free(sentProperties);
+    sentProperties = NULL;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <stdbool.h>
+
+/// <summary>
+///     Accumulates Device Twin reported properties into a single JSON patch, so properties set
+///     during one pass of the Azure timer reach IoT Hub in one reported state update and one
+///     twin version. A property set again before the patch is sent keeps only its latest value,
+///     and a property set to the value IoT Hub last accepted is not sent again. Values are
+///     escaped by parson, so names and strings of any length are reported in full.
+/// </summary>
+
+/// <summary>
+///     Sets a boolean reported property.
+/// </summary>
+/// <returns>false if the property could not be recorded</returns>
+bool SetReportedBool(const char *name, bool value);
+
+/// <summary>
+///     Sets an integer reported property.
+/// </summary>
+/// <returns>false if the property could not be recorded</returns>
+bool SetReportedInt(const char *name, int value);
+
+/// <summary>
+///     Sets a string reported property.
+/// </summary>
+/// <returns>false if the property could not be recorded</returns>
+bool SetReportedString(const char *name, const char *value);
+
+/// <summary>
+///     Sets every member of a JSON object as a reported property.
+/// </summary>
+/// <param name="json">A JSON object, e.g. {"Metrics":{...}}</param>
+/// <returns>false if the text is not a JSON object or a member could not be recorded</returns>
+bool MergeReportedState(const char *json);
+
+/// <summary>
+///     Returns true when properties are waiting to be sent.
+/// </summary>
+bool IsReportedStatePending(void);
+
+/// <summary>
+///     Formats the waiting properties as one JSON patch. The properties stay pending until
+///     MarkReportedStateSent.
+/// </summary>
+/// <returns>The patch, to be freed with json_free_serialized_string, or NULL if nothing is
+/// pending or formatting failed</returns>
+char *FormatReportedState(void);
+
+/// <summary>
+///     Records that the patch returned by the last FormatReportedState was handed to
+///     IoTHubClient and clears the pending properties.
+/// </summary>
+void MarkReportedStateSent(void);
+
+/// <summary>
+///     Forgets the values IoT Hub accepted, so every property is sent again the next time it is
+///     set. Called when IoT Hub rejects a reported state update.
+/// </summary>
+void ForgetReportedState(void);
@@ -0,0 +1,137 @@
+/*
+ * Vector kernels behind rf_linear_regression_beta, rf_autocorrelation,
+ * rf_autocorrelation_sequence, rf_rms and rf_Pcorrelation.
+ *
+ * One implementation is selected at compile time:
+ * - NEON (Cortex-A7 with -mfpu=neon*), when the compiler defines __ARM_NEON
+ * - CMSIS-DSP (Cortex-M4F), when ARM_MATH_CM4 is defined and arm_math.h is on the include path
+ * - portable C otherwise, or when RF_KERNELS_PORTABLE is defined
+ * The portable kernels keep four partial sums, the same lane layout as the NEON kernels, so
+ * the compiler can vectorize them without -ffast-math on other targets (SSE, AVX) too.
+ * Results of the three variants differ from each other, and from a plain sequential sum,
+ * only by floating point rounding.
+ */
+#include <stdint.h>
+
+#ifndef RF_KERNELS_H_
+#define RF_KERNELS_H_
+
+#if !defined(RF_KERNELS_PORTABLE) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define RF_KERNELS_NEON 1
+#include <arm_neon.h>
+#elif !defined(RF_KERNELS_PORTABLE) && defined(ARM_MATH_CM4)
+#define RF_KERNELS_CMSIS 1
+#include "arm_math.h"
+#endif
+
+#ifdef RF_KERNELS_NEON
+// Sum of the four lanes
+static inline float rf_kernel_hsum(float32x4_t v_sum)
+{
+    float32x2_t v_half=vadd_f32(vget_low_f32(v_sum), vget_high_f32(v_sum));
+    return vget_lane_f32(vpadd_f32(v_half, v_half), 0);
+}
+#endif
+
+/**
+* \brief        Scalar product
+* \retval       sum(pn_x[i]*pn_y[i]) for i=0 to n_size-1
+*/
+static inline float rf_kernel_dot(const float *pn_x, const float *pn_y, int32_t n_size)
+{
+    int32_t i=0;
+    float sum;
+#if defined(RF_KERNELS_NEON)
+    float32x4_t v_sum=vdupq_n_f32(0.0f);
+    for(; i+4<=n_size; i+=4)
+        v_sum=vmlaq_f32(v_sum, vld1q_f32(pn_x+i), vld1q_f32(pn_y+i));
+    sum=rf_kernel_hsum(v_sum);
+#elif defined(RF_KERNELS_CMSIS)
+    arm_dot_prod_f32((float32_t *)pn_x, (float32_t *)pn_y, (uint32_t)n_size, &sum);
+    i=n_size;
+#else
+    float s0=0.0f, s1=0.0f, s2=0.0f, s3=0.0f;
+    for(; i+4<=n_size; i+=4) {
+        s0+=pn_x[i]*pn_y[i];
+        s1+=pn_x[i+1]*pn_y[i+1];
+        s2+=pn_x[i+2]*pn_y[i+2];
+        s3+=pn_x[i+3]*pn_y[i+3];
+        }
+    sum=(s0+s1)+(s2+s3);
+#endif
+    for(; i<n_size; ++i)
+        sum+=pn_x[i]*pn_y[i];
+    return sum;
+}
+
+/**
+* \brief        Sum of squares
+* \retval       sum(pn_x[i]^2) for i=0 to n_size-1
+*/
+static inline float rf_kernel_sumsq(const float *pn_x, int32_t n_size)
+{
+#if defined(RF_KERNELS_CMSIS)
+    float sum;
+    arm_power_f32((float32_t *)pn_x, (uint32_t)n_size, &sum);
+    return sum;
+#else
+    return rf_kernel_dot(pn_x, pn_x, n_size);
+#endif
+}
+
+/**
+* \brief        Scalar product with a ramp
+* \par          Details
+*               The ramp values are computed from the integer index, so there is no float loop
+*               counter to accumulate rounding errors or to keep the loop from vectorizing.
+*               CMSIS-DSP has no such kernel; the M4 uses the portable one.
+* \retval       sum((f_x0+i)*pn_x[i]) for i=0 to n_size-1
+*/
+static inline float rf_kernel_ramp_dot(const float *pn_x, int32_t n_size, float f_x0)
+{
+    int32_t i=0;
+    float sum;
+#if defined(RF_KERNELS_NEON)
+    static const float af_lane[4]={0.0f, 1.0f, 2.0f, 3.0f};
+    float32x4_t v_sum=vdupq_n_f32(0.0f);
+    float32x4_t v_ramp=vaddq_f32(vdupq_n_f32(f_x0), vld1q_f32(af_lane));
+    const float32x4_t v_step=vdupq_n_f32(4.0f);
+    for(; i+4<=n_size; i+=4) {
+        v_sum=vmlaq_f32(v_sum, v_ramp, vld1q_f32(pn_x+i));
+        v_ramp=vaddq_f32(v_ramp, v_step);
+        }
+    sum=rf_kernel_hsum(v_sum);
+#else
+    float s0=0.0f, s1=0.0f, s2=0.0f, s3=0.0f;
+    for(; i+4<=n_size; i+=4) {
+        s0+=(f_x0+(float)i)*pn_x[i];
+        s1+=(f_x0+(float)(i+1))*pn_x[i+1];
+        s2+=(f_x0+(float)(i+2))*pn_x[i+2];
+        s3+=(f_x0+(float)(i+3))*pn_x[i+3];
+        }
+    sum=(s0+s1)+(s2+s3);
+#endif
+    for(; i<n_size; ++i)
+        sum+=(f_x0+(float)i)*pn_x[i];
+    return sum;
+}
+
+/**
+* \brief        Scaled vector accumulation
+* \par          Details
+*               pn_y[i] += f_a*pn_x[i] for i=0 to n_size-1. No reduction, so it vectorizes on any
+*               target. CMSIS-DSP has no in-place variant; the M4 uses the portable one.
+* \retval       None
+*/
+static inline void rf_kernel_axpy(float *pn_y, const float *pn_x, float f_a, int32_t n_size)
+{
+    int32_t i=0;
+#if defined(RF_KERNELS_NEON)
+    for(; i+4<=n_size; i+=4)
+        vst1q_f32(pn_y+i, vmlaq_n_f32(vld1q_f32(pn_y+i), vld1q_f32(pn_x+i), f_a));
+#endif
+    for(; i<n_size; ++i)
+        pn_y[i]+=f_a*pn_x[i];
+}
+
+#endif /* RF_KERNELS_H_ */
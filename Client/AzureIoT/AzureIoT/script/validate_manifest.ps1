@@ -1,10 +1,16 @@
 # Copyright (c) Microsoft Corporation. All rights reserved.
 # Licensed under the MIT License.
 
+# The manifest of the AzureIoT project by default
+param([string]$ManifestPath = "")
+
 Write-Output "Validating project app_manifest.json"
 
 $scriptPath =Split-Path $PSCommandPath -Parent 
-$manifestFile = Join-Path $scriptPath "..\app_manifest.json" -Resolve -ErrorAction SilentlyContinue
+if ($ManifestPath -eq "") {
+    $ManifestPath = Join-Path $scriptPath "..\app_manifest.json"
+}
+$manifestFile = Resolve-Path $ManifestPath -ErrorAction SilentlyContinue
 if ($manifestFile -eq $null) {
     Write-Output "Cannot find the app_manifest.json"
     return 1
@@ -0,0 +1,71 @@
+#include "format_buffer.h"
+#include "telemetry_batch.h"
+
+void ClearTelemetryBatch(TelemetryBatch *batch)
+{
+    batch->count = 0;
+}
+
+bool AddToTelemetryBatch(TelemetryBatch *batch, const TelemetryReading *reading)
+{
+    if (IsTelemetryBatchFull(batch)) {
+        return false;
+    }
+    batch->windows[batch->count++] = *reading;
+    return true;
+}
+
+bool IsTelemetryBatchFull(const TelemetryBatch *batch)
+{
+    return batch->count >= TELEMETRY_BATCH_MAX_WINDOWS;
+}
+
+bool GetTelemetryBatchAverage(const TelemetryBatch *batch, TelemetryReading *average)
+{
+    if (batch->count == 0) {
+        return false;
+    }
+
+    int64_t heartRateSum = 0;
+    float spo2Sum = 0.0f, ratioSum = 0.0f, correlSum = 0.0f;
+    for (size_t i = 0; i < batch->count; i++) {
+        heartRateSum += batch->windows[i].heartRate;
+        spo2Sum += batch->windows[i].spo2;
+        ratioSum += batch->windows[i].ratio;
+        correlSum += batch->windows[i].correl;
+    }
+    float count = (float)batch->count;
+
+    average->heartRate = (int32_t)(heartRateSum / (int64_t)batch->count);
+    average->spo2 = spo2Sum / count;
+    average->ratio = ratioSum / count;
+    average->correl = correlSum / count;
+    average->timestamp = batch->windows[batch->count - 1].timestamp;
+    return true;
+}
+
+int FormatTelemetryBatch(const TelemetryBatch *batch, char *buffer, size_t bufferSize)
+{
+    TelemetryReading average;
+    if (bufferSize == 0 || !GetTelemetryBatchAverage(batch, &average)) {
+        return -1;
+    }
+
+    int offset = AppendFormatted(
+        buffer, bufferSize, 0,
+        "{\"Heart_rate\":%d,\"SpO2\":%.2f,\"Ratio\":%.4f,\"Correl\":%.4f,\"Timestamp\":%lld,"
+        "\"Windows\":[",
+        (int)average.heartRate, average.spo2, average.ratio, average.correl,
+        (long long)average.timestamp);
+
+    for (size_t i = 0; i < batch->count; i++) {
+        const TelemetryReading *reading = &batch->windows[i];
+        offset = AppendFormatted(
+            buffer, bufferSize, offset,
+            "%s{\"Heart_rate\":%d,\"SpO2\":%.2f,\"Ratio\":%.4f,\"Correl\":%.4f,\"Timestamp\":%lld}",
+            i == 0 ? "" : ",", (int)reading->heartRate, reading->spo2, reading->ratio,
+            reading->correl, (long long)reading->timestamp);
+    }
+
+    return AppendFormatted(buffer, bufferSize, offset, "]}");
+}
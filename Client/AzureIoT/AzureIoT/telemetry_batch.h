@@ -0,0 +1,68 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/// <summary>
+///     Largest number of measurement windows one telemetry message carries.
+/// </summary>
+#define TELEMETRY_BATCH_MAX_WINDOWS 16
+
+/// <summary>
+///     Size of a buffer that holds a full batch formatted by FormatTelemetryBatch.
+/// </summary>
+#define TELEMETRY_BATCH_MESSAGE_SIZE (128 + TELEMETRY_BATCH_MAX_WINDOWS * 96)
+
+/// <summary>
+///     One valid heart rate and SpO2 estimate, as returned by the RF algorithm for one window.
+/// </summary>
+typedef struct {
+    int32_t heartRate;
+    float spo2;
+    float ratio;
+    float correl;
+    time_t timestamp; // Wall clock time of the estimate, in seconds since the epoch
+} TelemetryReading;
+
+/// <summary>
+///     Readings collected for a single telemetry message.
+/// </summary>
+typedef struct {
+    TelemetryReading windows[TELEMETRY_BATCH_MAX_WINDOWS];
+    size_t count;
+} TelemetryBatch;
+
+/// <summary>
+///     Removes all readings from the batch.
+/// </summary>
+void ClearTelemetryBatch(TelemetryBatch *batch);
+
+/// <summary>
+///     Appends a reading to the batch.
+/// </summary>
+/// <returns>false if the batch is full and the reading was not added</returns>
+bool AddToTelemetryBatch(TelemetryBatch *batch, const TelemetryReading *reading);
+
+/// <summary>
+///     Returns true when no further reading fits into the batch.
+/// </summary>
+bool IsTelemetryBatchFull(const TelemetryBatch *batch);
+
+/// <summary>
+///     Averages heart rate, SpO2, ratio and correlation over all windows of the batch, with the
+///     timestamp of the latest window.
+/// </summary>
+/// <returns>false if the batch is empty</returns>
+bool GetTelemetryBatchAverage(const TelemetryBatch *batch, TelemetryReading *average);
+
+/// <summary>
+///     Formats the batch as one JSON telemetry message with numeric values. The top-level
+///     Heart_rate, SpO2, Ratio, Correl and Timestamp are those of GetTelemetryBatchAverage;
+///     the Windows array holds the individual readings.
+/// </summary>
+/// <param name="batch">A batch with at least one reading</param>
+/// <param name="buffer">Buffer for the message, TELEMETRY_BATCH_MESSAGE_SIZE bytes suffice</param>
+/// <param name="bufferSize">Size of the buffer in bytes</param>
+/// <returns>Length of the message, or -1 if the batch is empty or the buffer too small</returns>
+int FormatTelemetryBatch(const TelemetryBatch *batch, char *buffer, size_t bufferSize);
@@ -0,0 +1,64 @@
+#include <math.h>
+#include <stdlib.h>
+#include "telemetry_filter.h"
+
+// Normal ranges at rest; readings outside them are always sent
+#define SPO2_ALARM_LEVEL 90.0f
+#define HEART_RATE_ALARM_LOW 40
+#define HEART_RATE_ALARM_HIGH 130
+// Changes from the last reading sent that are always sent
+#define HEART_RATE_SIGNIFICANT_CHANGE 20
+#define SPO2_SIGNIFICANT_CHANGE 4.0f
+
+void InitTelemetryFilter(TelemetryFilter *filter, const TelemetryFilterConfig *config)
+{
+    filter->config = *config;
+    filter->hasSent = false;
+    filter->lastHeartRate = 0;
+    filter->lastSpo2 = 0.0f;
+    filter->lastSendTime = 0;
+}
+
+TelemetryFilterDecision FilterTelemetry(const TelemetryFilter *filter, int32_t heartRate,
+                                        float spo2, time_t now)
+{
+    if (!filter->hasSent) {
+        return TelemetryFilter_First;
+    }
+
+    int32_t heartRateChange = abs(heartRate - filter->lastHeartRate);
+    float spo2Change = fabsf(spo2 - filter->lastSpo2);
+    if (spo2 < SPO2_ALARM_LEVEL || heartRate < HEART_RATE_ALARM_LOW ||
+        heartRate > HEART_RATE_ALARM_HIGH || heartRateChange >= HEART_RATE_SIGNIFICANT_CHANGE ||
+        spo2Change >= SPO2_SIGNIFICANT_CHANGE) {
+        return TelemetryFilter_Significant;
+    }
+    // A deadband of 0 still drops a reading equal to the last one
+    if (heartRateChange > filter->config.heartRateDeadband ||
+        spo2Change > (float)filter->config.spo2Deadband) {
+        return TelemetryFilter_Changed;
+    }
+    if (IsTelemetryHeartbeatDue(filter, now)) {
+        return TelemetryFilter_Heartbeat;
+    }
+    return TelemetryFilter_Suppress;
+}
+
+void MarkTelemetryReadingSent(TelemetryFilter *filter, int32_t heartRate, float spo2,
+                              time_t now)
+{
+    filter->hasSent = true;
+    filter->lastHeartRate = heartRate;
+    filter->lastSpo2 = spo2;
+    filter->lastSendTime = now;
+}
+
+bool IsTelemetryHeartbeatDue(const TelemetryFilter *filter, time_t now)
+{
+    return now - filter->lastSendTime >= filter->config.heartbeatSeconds;
+}
+
+void MarkTelemetrySent(TelemetryFilter *filter, time_t now)
+{
+    filter->lastSendTime = now;
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/// <summary>
+///     Report-on-change filter for the averaged reading of a measurement. A reading within the
+///     deadband of the last one sent is redundant and is dropped, unless it is clinically
+///     significant or heartbeatSeconds have passed since the last send. A significant reading
+///     lies outside the normal range (SpO2 below 90 %, heart rate below 40 or above 130 BPM) or
+///     has moved by 20 BPM or 4 SpO2 points or more; it is sent whatever the deadband.
+/// </summary>
+typedef struct {
+    int32_t heartRateDeadband; // BPM; 0 only drops readings equal to the last one sent
+    int32_t spo2Deadband;      // SpO2 percentage points
+    int32_t heartbeatSeconds;  // longest time between two messages
+} TelemetryFilterConfig;
+
+#define TELEMETRY_FILTER_CONFIG_DEFAULT {2, 1, 60 * 60}
+
+/// <summary>
+///     Why FilterTelemetry lets a reading through, or not.
+/// </summary>
+typedef enum {
+    TelemetryFilter_Suppress,    // within the deadband of the last reading sent
+    TelemetryFilter_First,       // nothing sent yet
+    TelemetryFilter_Changed,     // outside the deadband
+    TelemetryFilter_Significant, // abnormal value or sudden change
+    TelemetryFilter_Heartbeat    // unchanged, but heartbeatSeconds have passed
+} TelemetryFilterDecision;
+
+typedef struct {
+    TelemetryFilterConfig config;
+    bool hasSent;
+    int32_t lastHeartRate;
+    float lastSpo2;
+    time_t lastSendTime; // of the last message of any kind, in the clock passed as now
+} TelemetryFilter;
+
+void InitTelemetryFilter(TelemetryFilter *filter, const TelemetryFilterConfig *config);
+
+/// <summary>
+///     Decides whether a reading is sent. Nothing is recorded; once the reading has been sent
+///     or stored for sending, MarkTelemetryReadingSent makes it the last one sent.
+/// </summary>
+/// <param name="now">Current time in seconds of a monotonic clock</param>
+TelemetryFilterDecision FilterTelemetry(const TelemetryFilter *filter, int32_t heartRate,
+                                        float spo2, time_t now);
+
+/// <summary>
+///     Records a reading as the last one sent.
+/// </summary>
+void MarkTelemetryReadingSent(TelemetryFilter *filter, int32_t heartRate, float spo2,
+                              time_t now);
+
+/// <summary>
+///     Returns true when nothing has been sent for heartbeatSeconds.
+/// </summary>
+bool IsTelemetryHeartbeatDue(const TelemetryFilter *filter, time_t now);
+
+/// <summary>
+///     Records a message without a reading, such as a device heartbeat, as sent.
+/// </summary>
+void MarkTelemetrySent(TelemetryFilter *filter, time_t now);
@@ -0,0 +1,99 @@
+#include <string.h>
+#include "max30102.h"
+#include "mock_max30102_i2c.h"
+
+#define MOCK_REGISTER_COUNT 256
+
+static uint8_t registers[MOCK_REGISTER_COUNT];
+static uint8_t fifo[MAX30102_FIFO_DEPTH][MAX30102_BYTES_PER_SAMPLE];
+static size_t fifoCount = 0;        // samples in the FIFO; WR_PTR == RD_PTR when empty or full
+static size_t fifoBytePosition = 0; // byte of the sample at FIFO_RD_PTR read so far
+static MockMax30102Stats stats;
+
+void MockMax30102_Reset(void)
+{
+    memset(registers, 0, sizeof(registers));
+    memset(fifo, 0, sizeof(fifo));
+    fifoCount = 0;
+    fifoBytePosition = 0;
+    memset(&stats, 0, sizeof(stats));
+    registers[REG_REV_ID] = 0x03;
+    registers[REG_PART_ID] = 0x15;
+}
+
+void MockMax30102_PushSample(uint32_t red, uint32_t ir)
+{
+    if (fifoCount == MAX30102_FIFO_DEPTH) {
+        if (registers[REG_OVF_COUNTER] < 0x1f) {
+            registers[REG_OVF_COUNTER]++;
+        }
+        return;
+    }
+
+    uint8_t *slot = fifo[registers[REG_FIFO_WR_PTR]];
+    slot[0] = (uint8_t)(red >> 16);
+    slot[1] = (uint8_t)(red >> 8);
+    slot[2] = (uint8_t)red;
+    slot[3] = (uint8_t)(ir >> 16);
+    slot[4] = (uint8_t)(ir >> 8);
+    slot[5] = (uint8_t)ir;
+    registers[REG_FIFO_WR_PTR] =
+        (uint8_t)((registers[REG_FIFO_WR_PTR] + 1) & (MAX30102_FIFO_DEPTH - 1));
+    fifoCount++;
+    // A_FULL, set once the FIFO holds MAX30102_FIFO_A_FULL_SAMPLES samples
+    if (fifoCount >= MAX30102_FIFO_A_FULL_SAMPLES) {
+        registers[REG_INTR_STATUS_1] |= 0x80;
+    }
+}
+
+MockMax30102Stats MockMax30102_GetStats(void)
+{
+    return stats;
+}
+
+int MockMax30102_Read(uint8_t addr, uint16_t count, uint8_t *ptr)
+{
+    stats.readTransactions++;
+    stats.bytesRead += count;
+
+    for (uint16_t i = 0; i < count; i++) {
+        if (addr == REG_FIFO_DATA) {
+            if (fifoCount == 0) {
+                ptr[i] = 0;
+                continue;
+            }
+            ptr[i] = fifo[registers[REG_FIFO_RD_PTR]][fifoBytePosition++];
+            if (fifoBytePosition == MAX30102_BYTES_PER_SAMPLE) {
+                // A complete sample was popped, which also clears OVF_COUNTER
+                fifoBytePosition = 0;
+                registers[REG_FIFO_RD_PTR] =
+                    (uint8_t)((registers[REG_FIFO_RD_PTR] + 1) & (MAX30102_FIFO_DEPTH - 1));
+                registers[REG_OVF_COUNTER] = 0;
+                fifoCount--;
+            }
+            continue;
+        }
+
+        ptr[i] = registers[addr];
+        // Reading the interrupt status clears it
+        if (addr == REG_INTR_STATUS_1 || addr == REG_INTR_STATUS_2) {
+            registers[addr] = 0;
+        }
+        addr++;
+    }
+    return (int)count;
+}
+
+void MockMax30102_Write(uint8_t addr, uint16_t count, uint8_t *ptr)
+{
+    stats.writeTransactions++;
+    for (uint16_t i = 0; i < count; i++) {
+        registers[addr] = ptr[i];
+        // The driver clears the FIFO pointers during initialization
+        if (addr == REG_FIFO_WR_PTR || addr == REG_FIFO_RD_PTR || addr == REG_OVF_COUNTER) {
+            fifoCount = 0;
+            fifoBytePosition = 0;
+        }
+        addr++;
+    }
+}
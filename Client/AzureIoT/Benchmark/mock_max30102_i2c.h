@@ -0,0 +1,46 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/// <summary>
+///     Host model of the MAX30102 as seen through the I2C callbacks of
+///     maxim_max30102_i2c_setup. It keeps the register file and a 32-sample FIFO with
+///     FIFO_WR_PTR, FIFO_RD_PTR and OVF_COUNTER, so the driver runs unchanged against recorded
+///     samples. Register reads auto-increment except on FIFO_DATA, where every
+///     MAX30102_BYTES_PER_SAMPLE bytes pop one sample, as on the device.
+/// </summary>
+
+/// <summary>
+///     I2C traffic seen by the mock since the last MockMax30102_Reset.
+/// </summary>
+typedef struct {
+    size_t readTransactions;
+    size_t writeTransactions;
+    size_t bytesRead;
+} MockMax30102Stats;
+
+/// <summary>
+///     Clears the registers, the FIFO and the statistics.
+/// </summary>
+void MockMax30102_Reset(void);
+
+/// <summary>
+///     Adds a sample to the FIFO, as the sensor does once per sample period. With FIFO rollover
+///     off, a sample that finds the FIFO full is lost and counted in OVF_COUNTER.
+/// </summary>
+void MockMax30102_PushSample(uint32_t red, uint32_t ir);
+
+/// <summary>
+///     Returns the I2C traffic since the last reset.
+/// </summary>
+MockMax30102Stats MockMax30102_GetStats(void);
+
+/// <summary>
+///     I2C read callback for maxim_max30102_i2c_setup.
+/// </summary>
+int MockMax30102_Read(uint8_t addr, uint16_t count, uint8_t *ptr);
+
+/// <summary>
+///     I2C write callback for maxim_max30102_i2c_setup.
+/// </summary>
+void MockMax30102_Write(uint8_t addr, uint16_t count, uint8_t *ptr);
@@ -0,0 +1,788 @@
+// Host replay and benchmark harness for algorithm_by_RF. Replays red/IR traces through the
+// MAX30102 driver and a mock of its I2C bus, then runs every variant of the algorithm over the
+// same windows and reports the time per window, heap allocations, stack usage and the error of
+// the estimates against the reference heart rate and SpO2 of the trace. See README.md.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "algorithm_by_RF.h"
+#include "algorithm_by_RF_q.h"
+#include "max30102.h"
+#include "mock_max30102_i2c.h"
+#include "ppg_block.h"
+
+// Stack given to each variant run; the untouched part of it is the headroom.
+#define BENCH_STACK_SIZE (256 * 1024)
+#define BENCH_STACK_PATTERN 0xa5
+// A variant with at least 90 % valid windows and a heart rate MAE above this fails the run
+#define BENCH_WRONG_HR_BPM 20
+// How far the other variants may stray from the legacy one over the same windows
+#define BENCH_LEGACY_VALID_PERCENT 5.0
+#define BENCH_LEGACY_HR_BPM 2.0
+#define BENCH_LEGACY_SPO2_PERCENT 1.0
+
+// The sensor produces 18-bit samples.
+#define SAMPLE_MASK 0x3ffffu
+
+/// <summary>
+///     A recorded or synthetic trace. Reference values are NAN where the trace has none.
+/// </summary>
+typedef struct {
+    char name[64];
+    int32_t fs;
+    size_t count;
+    size_t capacity;
+    uint32_t *red;
+    uint32_t *ir;
+    float *referenceHr;
+    float *referenceSpo2;
+} Trace;
+
+typedef enum {
+    Variant_Legacy,            // rf_heart_rate_and_oxygen_saturation, FS and ST only
+    Variant_HillClimb,         // rf_process, RF_PERIODICITY_HILL_CLIMB
+    Variant_Sequence,          // rf_process, RF_PERIODICITY_SEQUENCE
+    Variant_StreamHillClimb,   // rf_stream, RF_PERIODICITY_HILL_CLIMB
+    Variant_StreamSequence,    // rf_stream, RF_PERIODICITY_SEQUENCE
+    Variant_FixedPoint,        // rf_q_process
+    Variant_Count
+} Variant;
+
+static const char *const variantNames[Variant_Count] = {
+    "legacy", "hill-climb", "sequence", "stream-hill-climb", "stream-sequence", "fixed-point"};
+
+/// <summary>
+///     Results of one variant over one trace.
+/// </summary>
+typedef struct {
+    bool skipped;
+    size_t windows;
+    size_t validWindows;
+    uint64_t totalNanoseconds;
+    uint64_t maxNanoseconds;
+    size_t allocations;
+    size_t stackBytes;
+    double hrErrorSum;
+    size_t hrErrorCount;
+    double spo2ErrorSum;
+    size_t spo2ErrorCount;
+} VariantResult;
+
+/// <summary>
+///     What a variant thread runs: the decoded samples, the window length and the variant.
+/// </summary>
+typedef struct {
+    Variant variant;
+    const Trace *trace;
+    uint32_t *red;
+    uint32_t *ir;
+    int32_t st;
+    size_t repeats;
+    void *scratch;
+    VariantResult *result;
+    // Algorithm state, kept off the measured stack
+    rf_context ctx;
+    rf_q_context qctx;
+    rf_stream stream;
+} VariantJob;
+
+// Allocation counting through the linker's --wrap, enabled only while a variant runs.
+static volatile bool countAllocations = false;
+static volatile size_t allocationCount = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size)
+{
+    if (countAllocations) {
+        allocationCount++;
+    }
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    if (countAllocations) {
+        allocationCount++;
+    }
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    if (countAllocations) {
+        allocationCount++;
+    }
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr)
+{
+    __real_free(ptr);
+}
+
+static uint64_t GetNanoseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static bool AddToTrace(Trace *trace, uint32_t red, uint32_t ir, float hr, float spo2)
+{
+    if (trace->count == trace->capacity) {
+        size_t capacity = trace->capacity ? trace->capacity * 2 : 4096;
+        uint32_t *newRed = realloc(trace->red, capacity * sizeof(uint32_t));
+        if (newRed == NULL) {
+            return false;
+        }
+        trace->red = newRed;
+        uint32_t *newIr = realloc(trace->ir, capacity * sizeof(uint32_t));
+        if (newIr == NULL) {
+            return false;
+        }
+        trace->ir = newIr;
+        float *newHr = realloc(trace->referenceHr, capacity * sizeof(float));
+        if (newHr == NULL) {
+            return false;
+        }
+        trace->referenceHr = newHr;
+        float *newSpo2 = realloc(trace->referenceSpo2, capacity * sizeof(float));
+        if (newSpo2 == NULL) {
+            return false;
+        }
+        trace->referenceSpo2 = newSpo2;
+        trace->capacity = capacity;
+    }
+    trace->red[trace->count] = red;
+    trace->ir[trace->count] = ir;
+    trace->referenceHr[trace->count] = hr;
+    trace->referenceSpo2[trace->count] = spo2;
+    trace->count++;
+    return true;
+}
+
+static void FreeTrace(Trace *trace)
+{
+    free(trace->red);
+    free(trace->ir);
+    free(trace->referenceHr);
+    free(trace->referenceSpo2);
+    memset(trace, 0, sizeof(*trace));
+}
+
+/// <summary>
+///     Reads the zigzag varint of a channel delta, see ppg_block.h.
+/// </summary>
+/// <returns>false if the block ends inside the varint</returns>
+static bool GetDelta(const uint8_t **p, const uint8_t *end, uint32_t *value)
+{
+    uint32_t zigzag = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (*p == end) {
+            return false;
+        }
+        uint8_t byte = *(*p)++;
+        zigzag |= (uint32_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            *value += (zigzag >> 1) ^ (0u - (zigzag & 1));
+            return true;
+        }
+    }
+    return false;
+}
+
+/// <summary>
+///     Loads a raw capture: the PPG blocks of a capture written one after the other, as sent
+///     by the device while "CaptureRawTrace" is set. Captures have no reference values.
+/// </summary>
+static bool LoadPpgCapture(FILE *file, const char *path, Trace *trace)
+{
+    static uint8_t block[PPG_BLOCK_MAX_SIZE(UINT16_MAX)];
+    uint32_t expectedSequence = 0;
+    size_t blocks = 0;
+    size_t gaps = 0;
+
+    for (;;) {
+        size_t n = fread(block, 1, PPG_BLOCK_HEADER_SIZE, file);
+        if (n == 0) {
+            break;
+        }
+        if (n != PPG_BLOCK_HEADER_SIZE || block[0] != 'P' || block[1] != 'G' ||
+            block[2] != PPG_BLOCK_VERSION) {
+            fprintf(stderr, "ERROR: %s: no PPG block header at block %zu\n", path, blocks);
+            return false;
+        }
+        uint32_t sequence = (uint32_t)block[4] | (uint32_t)block[5] << 8 |
+                            (uint32_t)block[6] << 16 | (uint32_t)block[7] << 24;
+        int32_t rate = block[8] | block[9] << 8;
+        size_t count = (size_t)(block[10] | block[11] << 8);
+        if (blocks > 0 && sequence != expectedSequence) {
+            gaps++;
+        }
+        expectedSequence = sequence + 1;
+        if (blocks == 0) {
+            trace->fs = rate;
+        } else if (rate != trace->fs) {
+            fprintf(stderr, "ERROR: %s: block %u changes the rate to %d Hz\n", path, sequence,
+                    rate);
+            return false;
+        }
+
+        // The varints are not self-delimiting per block, so decode them from the rest of the
+        // file and seek back to the end of the block
+        long samplesOffset = ftell(file) + block[3];
+        fseek(file, samplesOffset, SEEK_SET);
+        size_t available = fread(block, 1, count * PPG_BLOCK_MAX_SAMPLE_SIZE, file);
+        const uint8_t *p = block;
+        const uint8_t *end = block + available;
+        uint32_t ir = 0, red = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (!GetDelta(&p, end, &ir) || !GetDelta(&p, end, &red) ||
+                !AddToTrace(trace, red, ir, NAN, NAN)) {
+                fprintf(stderr, "ERROR: %s: block %u is truncated\n", path, sequence);
+                return false;
+            }
+        }
+        fseek(file, samplesOffset + (long)(p - block), SEEK_SET);
+        blocks++;
+    }
+
+    if (gaps > 0) {
+        printf("%s: %zu gaps in the block sequence, windows across them mix unrelated samples\n",
+               path, gaps);
+    }
+    return true;
+}
+
+/// <summary>
+///     Loads a trace file: a raw capture, see LoadPpgCapture, or one sample per line, "red ir [hr spo2]" separated by blanks or
+///     commas. Lines starting with '#' are comments, except "# fs=<Hz>" which gives the sample
+///     rate (FS if absent).
+/// </summary>
+static bool LoadTrace(const char *path, Trace *trace)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: cannot open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    memset(trace, 0, sizeof(*trace));
+    const char *base = strrchr(path, '/');
+    snprintf(trace->name, sizeof(trace->name), "%s", base ? base + 1 : path);
+    trace->fs = FS;
+
+    int first = fgetc(file);
+    ungetc(first, file);
+    if (first == 'P') {
+        bool loaded = LoadPpgCapture(file, path, trace);
+        fclose(file);
+        return loaded;
+    }
+
+    char line[256];
+    size_t lineNumber = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file) != NULL) {
+        lineNumber++;
+        char *text = line + strspn(line, " \t");
+        if (*text == '#') {
+            int fs;
+            if (sscanf(text, "# fs=%d", &fs) == 1) {
+                trace->fs = fs;
+            }
+            continue;
+        }
+        for (char *c = text; *c != '\0'; c++) {
+            if (*c == ',') {
+                *c = ' ';
+            }
+        }
+
+        double fields[4];
+        int n = sscanf(text, "%lf %lf %lf %lf", &fields[0], &fields[1], &fields[2], &fields[3]);
+        if (n <= 0) {
+            continue; // blank line
+        }
+        if (n != 2 && n != 4) {
+            fprintf(stderr, "ERROR: %s:%zu: expected \"red ir [hr spo2]\"\n", path, lineNumber);
+            ok = false;
+            break;
+        }
+        ok = AddToTrace(trace, (uint32_t)fields[0], (uint32_t)fields[1],
+                        n == 4 ? (float)fields[2] : NAN, n == 4 ? (float)fields[3] : NAN);
+    }
+    fclose(file);
+    return ok;
+}
+
+/// <summary>
+///     Generates a trace with a given heart rate and SpO2: a pulse with its second harmonic on
+///     a drifting baseline plus noise. The red amplitude follows from the ratio R that the
+///     algorithm maps to the SpO2, -45.060*R^2 + 30.354*R + 94.845.
+/// </summary>
+static bool SynthesizeTrace(Trace *trace, int32_t fs, int seconds, double hr, double spo2)
+{
+    memset(trace, 0, sizeof(*trace));
+    snprintf(trace->name, sizeof(trace->name), "synthetic-%.0fbpm-%.0f%%", hr, spo2);
+    trace->fs = fs;
+
+    const double a = 45.060, b = 30.354, c = 94.845;
+    double ratio = (b + sqrt(b * b + 4 * a * (c - spo2))) / (2 * a);
+    const double acIr = 500, dcIr = 100000, dcRed = 80000;
+    double acRed = ratio * acIr * dcRed / dcIr;
+
+    unsigned int seed = 1;
+    for (int i = 0; i < fs * seconds; i++) {
+        double t = (double)i / fs;
+        double phase = 2 * M_PI * hr / 60 * t;
+        double wave = sin(phase) + 0.4 * sin(2 * phase + 0.5);
+        seed = seed * 1103515245u + 12345u;
+        double noise = ((seed >> 16) & 0x7fff) / 32768.0 - 0.5;
+        if (!AddToTrace(trace, (uint32_t)(dcRed + 300 * t + acRed * wave + 20 * noise),
+                        (uint32_t)(dcIr + 500 * t + acIr * wave + 20 * noise), (float)hr,
+                        (float)spo2)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// <summary>
+///     Replays the trace through the mock sensor and the driver, draining the FIFO in bursts as
+///     the app does on A_FULL, and checks the decoded samples against the trace.
+/// </summary>
+/// <returns>true if every sample was read back unchanged</returns>
+static bool ReplayAcquisition(const Trace *trace, uint32_t *red, uint32_t *ir)
+{
+    MockMax30102_Reset();
+    maxim_max30102_i2c_setup(MockMax30102_Read, MockMax30102_Write);
+    if (!maxim_max30102_init_sample_rate(trace->fs)) {
+        printf("  acquisition: %d Hz is not a MAX30102 sample rate, sensor kept at its default\n",
+               trace->fs);
+    }
+    MockMax30102Stats setup = MockMax30102_GetStats();
+
+    size_t read = 0;
+    bool ok = true;
+    for (size_t i = 0; i < trace->count && ok; i++) {
+        MockMax30102_PushSample(trace->red[i] & SAMPLE_MASK, trace->ir[i] & SAMPLE_MASK);
+        // Drain on A_FULL, and once more after the last sample
+        if ((i + 1) % MAX30102_FIFO_A_FULL_SAMPLES == 0 || i + 1 == trace->count) {
+            size_t count = 0;
+            ok = maxim_max30102_read_fifo_burst(red + read, ir + read, trace->count - read,
+                                                &count);
+            read += count;
+        }
+    }
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < read; i++) {
+        if (red[i] != (trace->red[i] & SAMPLE_MASK) || ir[i] != (trace->ir[i] & SAMPLE_MASK)) {
+            mismatches++;
+        }
+    }
+
+    MockMax30102Stats stats = MockMax30102_GetStats();
+    size_t transactions = stats.readTransactions - setup.readTransactions;
+    printf("  acquisition: %zu of %zu samples, %zu mismatches, %u overflows, "
+           "%.3f I2C reads/sample, %.2f bytes/sample\n",
+           read, trace->count, mismatches, maxim_max30102_take_overflow_count(),
+           read ? (double)transactions / read : 0.0,
+           read ? (double)(stats.bytesRead - setup.bytesRead) / read : 0.0);
+    return ok && read == trace->count && mismatches == 0;
+}
+
+/// <summary>
+///     Adds the estimate of the window ending before sample end to the error sums.
+/// </summary>
+static void ScoreWindow(VariantResult *result, const Trace *trace, size_t end, bool hrValid,
+                        int32_t hr, bool spo2Valid, float spo2)
+{
+    result->windows++;
+    if (!hrValid || !spo2Valid) {
+        return;
+    }
+    result->validWindows++;
+
+    float referenceHr = trace->referenceHr[end - 1];
+    float referenceSpo2 = trace->referenceSpo2[end - 1];
+    if (!isnan(referenceHr)) {
+        result->hrErrorSum += fabs((double)hr - referenceHr);
+        result->hrErrorCount++;
+    }
+    if (!isnan(referenceSpo2)) {
+        result->spo2ErrorSum += fabs((double)spo2 - referenceSpo2);
+        result->spo2ErrorCount++;
+    }
+}
+
+static void AddDuration(VariantResult *result, uint64_t start)
+{
+    uint64_t duration = GetNanoseconds() - start;
+    result->totalNanoseconds += duration;
+    if (duration > result->maxNanoseconds) {
+        result->maxNanoseconds = duration;
+    }
+}
+
+/// <summary>
+///     Runs a variant over the trace, one window per second of samples, as the app does.
+/// </summary>
+static void RunVariant(VariantJob *job)
+{
+    const Trace *trace = job->trace;
+    VariantResult *result = job->result;
+    rf_config cfg;
+    rf_config_default(&cfg);
+    rf_configure(&cfg, trace->fs, job->st);
+    cfg.n_periodicity_search = (job->variant == Variant_Sequence ||
+                                job->variant == Variant_StreamSequence)
+                                   ? RF_PERIODICITY_SEQUENCE
+                                   : RF_PERIODICITY_HILL_CLIMB;
+    size_t n = (size_t)cfg.n_buffer_size;
+    size_t hop = (size_t)trace->fs;
+
+    for (size_t pass = 0; pass < job->repeats; pass++) {
+        // Only the first pass is scored; the others just add timing samples
+        VariantResult discard = {0};
+        VariantResult *score = pass == 0 ? result : &discard;
+
+        float spo2 = 0, ratio = 0, correl = 0;
+        int32_t hr = 0;
+        int8_t spo2Valid = 0, hrValid = 0;
+
+        if (job->variant == Variant_StreamHillClimb || job->variant == Variant_StreamSequence) {
+            rf_stream *stream = &job->stream;
+            rf_stream_init(stream, &cfg, (int32_t)hop, job->scratch);
+            uint64_t start = GetNanoseconds();
+            for (size_t i = 0; i < trace->count; i++) {
+                if (rf_stream_push(stream, job->ir[i], job->red[i])) {
+                    rf_stream_estimate(stream, &spo2, &spo2Valid, &hr, &hrValid, &ratio, &correl);
+                    AddDuration(result, start);
+                    ScoreWindow(score, trace, i + 1, hrValid, hr, spo2Valid, spo2);
+                    start = GetNanoseconds();
+                }
+            }
+            continue;
+        }
+
+        if (job->variant == Variant_FixedPoint) {
+            rf_q_init(&job->qctx, &cfg, job->scratch);
+        } else if (job->variant == Variant_Legacy) {
+            // Every pass starts fresh, as those of the other variants do
+            rf_reset_default_context();
+        } else {
+            rf_init(&job->ctx, &cfg, job->scratch);
+        }
+
+        for (size_t end = n; end <= trace->count; end += hop) {
+            uint32_t *ir = job->ir + end - n;
+            uint32_t *red = job->red + end - n;
+            uint64_t start = GetNanoseconds();
+            if (job->variant == Variant_Legacy) {
+                rf_heart_rate_and_oxygen_saturation(ir, (int32_t)n, red, &spo2, &spo2Valid, &hr,
+                                                    &hrValid, &ratio, &correl);
+            } else if (job->variant == Variant_FixedPoint) {
+                int32_t spo2Q16, ratioQ15, correlQ15;
+                rf_q_process(&job->qctx, ir, (int32_t)n, red, &spo2Q16, &spo2Valid, &hr, &hrValid,
+                             &ratioQ15, &correlQ15);
+                spo2 = (float)spo2Q16 / RF_Q16_ONE;
+            } else {
+                rf_process(&job->ctx, ir, (int32_t)n, red, &spo2, &spo2Valid, &hr, &hrValid, &ratio,
+                           &correl);
+            }
+            AddDuration(result, start);
+            ScoreWindow(score, trace, end, hrValid, hr, spo2Valid, spo2);
+        }
+    }
+}
+
+static void *VariantThread(void *context)
+{
+    VariantJob *job = context;
+    allocationCount = 0;
+    countAllocations = true;
+    if (job->trace != NULL) {
+        RunVariant(job);
+    }
+    countAllocations = false;
+    if (job->result != NULL) {
+        job->result->allocations = allocationCount;
+    }
+    return NULL;
+}
+
+/// <summary>
+///     Runs the job on a thread whose stack is painted with BENCH_STACK_PATTERN beforehand.
+/// </summary>
+/// <returns>Bytes of the stack that were written, or 0 on failure</returns>
+static size_t RunOnPaintedStack(VariantJob *job)
+{
+    unsigned char *stack = NULL;
+    if (posix_memalign((void **)&stack, 4096, BENCH_STACK_SIZE) != 0) {
+        return 0;
+    }
+    memset(stack, BENCH_STACK_PATTERN, BENCH_STACK_SIZE);
+
+    pthread_attr_t attr;
+    pthread_t thread;
+    size_t used = 0;
+    if (pthread_attr_init(&attr) == 0 && pthread_attr_setstack(&attr, stack, BENCH_STACK_SIZE) == 0 &&
+        pthread_create(&thread, &attr, VariantThread, job) == 0) {
+        pthread_join(thread, NULL);
+        // The stack grows down, so the lowest written byte marks the high-water mark
+        size_t untouched = 0;
+        while (untouched < BENCH_STACK_SIZE && stack[untouched] == BENCH_STACK_PATTERN) {
+            untouched++;
+        }
+        used = BENCH_STACK_SIZE - untouched;
+    }
+    pthread_attr_destroy(&attr);
+    free(stack);
+    return used;
+}
+
+static size_t GetScratchSize(Variant variant, const rf_config *cfg)
+{
+    switch (variant) {
+    case Variant_HillClimb:
+    case Variant_Sequence:
+        return rf_scratch_size(cfg);
+    case Variant_StreamHillClimb:
+    case Variant_StreamSequence:
+        return rf_stream_buffer_size(cfg);
+    case Variant_FixedPoint:
+        return rf_q_scratch_size(cfg);
+    default:
+        return 0;
+    }
+}
+
+/// <summary>
+///     Tells if a variant finds as many valid windows as the legacy one and, where the trace has
+///     reference values, about the same errors. The reference values may be off; legacy is not.
+/// </summary>
+static bool AgreesWithLegacy(const VariantResult *r, const VariantResult *legacy)
+{
+    if (r->windows == 0 || legacy->windows == 0) {
+        return r->windows == legacy->windows;
+    }
+    double valid = 100.0 * r->validWindows / r->windows;
+    double legacyValid = 100.0 * legacy->validWindows / legacy->windows;
+    if (fabs(valid - legacyValid) > BENCH_LEGACY_VALID_PERCENT) {
+        return false;
+    }
+    if (r->hrErrorCount == 0 || legacy->hrErrorCount == 0) {
+        return true;
+    }
+    return fabs(r->hrErrorSum / r->hrErrorCount - legacy->hrErrorSum / legacy->hrErrorCount) <=
+               BENCH_LEGACY_HR_BPM &&
+           fabs(r->spo2ErrorSum / r->spo2ErrorCount -
+                legacy->spo2ErrorSum / legacy->spo2ErrorCount) <= BENCH_LEGACY_SPO2_PERCENT;
+}
+
+static void PrintResult(Variant variant, const VariantResult *r, size_t repeats)
+{
+    if (r->skipped) {
+        printf("  %-18s skipped (built for FS=%d and ST=%d only)\n", variantNames[variant], FS, ST);
+        return;
+    }
+    size_t timed = r->windows * repeats;
+    printf("  %-18s %6zu %6.1f%% %10.0f %10llu %7zu %7zu ", variantNames[variant], r->windows,
+           r->windows ? 100.0 * r->validWindows / r->windows : 0.0,
+           timed ? (double)r->totalNanoseconds / timed : 0.0,
+           (unsigned long long)r->maxNanoseconds, r->allocations, r->stackBytes);
+    if (r->hrErrorCount > 0) {
+        printf("%7.2f %7.2f\n", r->hrErrorSum / r->hrErrorCount,
+               r->spo2ErrorSum / r->spo2ErrorCount);
+    } else {
+        printf("%7s %7s\n", "-", "-");
+    }
+}
+
+/// <summary>
+///     Replays one trace and runs all variants over it.
+/// </summary>
+/// <returns>false if the acquisition failed or a variant exceeds a gate</returns>
+static bool BenchmarkTrace(const Trace *trace, int32_t st, size_t repeats, double hrGate,
+                           double spo2Gate)
+{
+    printf("%s: %zu samples at %d Hz, %d s windows\n", trace->name, trace->count, trace->fs, st);
+
+    rf_config cfg;
+    rf_config_default(&cfg);
+    if (!rf_configure(&cfg, trace->fs, st)) {
+        printf("  unsupported configuration, fs 1 to %d Hz and st 1 to %d s\n", RF_MAX_FS,
+               RF_MAX_ST);
+        return false;
+    }
+
+    uint32_t *red = malloc(trace->count * sizeof(uint32_t));
+    uint32_t *ir = malloc(trace->count * sizeof(uint32_t));
+    if (red == NULL || ir == NULL) {
+        free(red);
+        free(ir);
+        return false;
+    }
+    bool ok = ReplayAcquisition(trace, red, ir);
+
+    // The thread's own footprint, so that only the algorithm's stack use is reported
+    static VariantJob baselineJob;
+    size_t baseline = RunOnPaintedStack(&baselineJob);
+
+    printf("  %-18s %6s %7s %10s %10s %7s %7s %7s %7s\n", "variant", "wins", "valid", "mean ns",
+           "max ns", "allocs", "stack", "HR MAE", "SpO2 MAE");
+    bool passed = true;
+    VariantResult legacy = {.skipped = true};
+    for (int v = 0; v < Variant_Count && ok; v++) {
+        VariantResult result = {0};
+        if (v == Variant_Legacy && (trace->fs != FS || st != ST)) {
+            result.skipped = true;
+            PrintResult(v, &result, repeats);
+            continue;
+        }
+
+        void *scratch = NULL;
+        size_t scratchSize = GetScratchSize(v, &cfg);
+        if (scratchSize > 0 && (scratch = malloc(scratchSize)) == NULL) {
+            ok = false;
+            break;
+        }
+        static VariantJob job;
+        job = (VariantJob){.variant = v,
+                           .trace = trace,
+                           .red = red,
+                           .ir = ir,
+                           .st = st,
+                           .repeats = repeats,
+                           .scratch = scratch,
+                           .result = &result};
+        size_t used = RunOnPaintedStack(&job);
+        result.stackBytes = used > baseline ? used - baseline : 0;
+        free(scratch);
+        PrintResult(v, &result, repeats);
+        if (v == Variant_Legacy) {
+            legacy = result;
+        } else if (!legacy.skipped && !AgreesWithLegacy(&result, &legacy)) {
+            printf("  %s disagrees with legacy\n", variantNames[v]);
+            passed = false;
+        }
+
+        // Mostly valid windows with a heart rate this far off are locked on a multiple of the
+        // period, which the validity checks cannot see; never let that pass as a good result
+        if (result.hrErrorCount > 0 && result.validWindows * 10 >= result.windows * 9 &&
+            result.hrErrorSum / result.hrErrorCount > BENCH_WRONG_HR_BPM) {
+            printf("  %s reports valid windows with a wrong heart rate\n", variantNames[v]);
+            passed = false;
+        }
+        if (result.hrErrorCount > 0 &&
+            ((hrGate > 0 && result.hrErrorSum / result.hrErrorCount > hrGate) ||
+             (spo2Gate > 0 && result.spo2ErrorSum / result.spo2ErrorCount > spo2Gate))) {
+            printf("  %s exceeds the error gate\n", variantNames[v]);
+            passed = false;
+        }
+    }
+
+    free(red);
+    free(ir);
+    return ok && passed;
+}
+
+static void PrintUsage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [trace...]\n"
+            "  -s        also run the built-in synthetic traces (default without traces)\n"
+            "  -f <Hz>   sample rate of the synthetic traces (default %d)\n"
+            "  -w <s>    window length in seconds (default %d)\n"
+            "  -r <n>    repeat each run n times for timing (default 1)\n"
+            "  -H <bpm>  fail if a variant's heart rate MAE exceeds this\n"
+            "  -S <%%>    fail if a variant's SpO2 MAE exceeds this\n"
+            "Trace files hold one \"red ir [hr spo2]\" sample per line, \"# fs=<Hz>\" sets the "
+            "rate.\nRaw captures, the PPG blocks sent with CaptureRawTrace, are read as well.\n",
+            program, FS, ST);
+}
+
+int main(int argc, char *argv[])
+{
+    bool synthetic = false;
+    int32_t syntheticFs = FS;
+    int32_t st = ST;
+    size_t repeats = 1;
+    double hrGate = 0, spo2Gate = 0;
+
+    int option;
+    while ((option = getopt(argc, argv, "sf:w:r:H:S:h")) != -1) {
+        switch (option) {
+        case 's':
+            synthetic = true;
+            break;
+        case 'f':
+            syntheticFs = atoi(optarg);
+            break;
+        case 'w':
+            st = atoi(optarg);
+            break;
+        case 'r':
+            repeats = (size_t)atoi(optarg);
+            break;
+        case 'H':
+            hrGate = atof(optarg);
+            break;
+        case 'S':
+            spo2Gate = atof(optarg);
+            break;
+        default:
+            PrintUsage(argv[0]);
+            return option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (repeats == 0) {
+        repeats = 1;
+    }
+    if (optind == argc) {
+        synthetic = true;
+    }
+
+    bool ok = true;
+    if (synthetic) {
+        static const struct {
+            double hr;
+            double spo2;
+        } targets[] = {{48, 97}, {55, 95}, {60, 99}};
+        for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); i++) {
+            Trace trace;
+            if (!SynthesizeTrace(&trace, syntheticFs, 60, targets[i].hr, targets[i].spo2)) {
+                fprintf(stderr, "ERROR: out of memory\n");
+                return EXIT_FAILURE;
+            }
+            ok = BenchmarkTrace(&trace, st, repeats, hrGate, spo2Gate) && ok;
+            FreeTrace(&trace);
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        Trace trace;
+        if (!LoadTrace(argv[i], &trace)) {
+            FreeTrace(&trace);
+            ok = false;
+            continue;
+        }
+        ok = BenchmarkTrace(&trace, st, repeats, hrGate, spo2Gate) && ok;
+        FreeTrace(&trace);
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,326 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "algorithm_by_RF.h"
+#include "hr4_intercore.h"
+#include "led_control.h"
+#include "max30102.h"
+#include "platform.h"
+#include "sample_ring.h"
+
+// HR4 real-time app. The sample timer interrupt fires at a fixed period and only flags that the
+// MAX30102 FIFO is due; the main loop wakes up, drains the FIFO over I2C, runs the streaming RF
+// estimator and the LED control on the samples and sends the results, and the samples when
+// asked to, to the high-level app. All I2C traffic is on the main loop, so no interrupt ever
+// waits for the bus. The FIFO holds MAX30102_FIFO_DEPTH samples, nearly two timer periods, so
+// a read that is late by a period loses nothing.
+//
+// The raw samples go through sampleRing: the acquisition pushes them and the mailbox sender
+// pops them into samples messages, so a mailbox without room for the next message holds up
+// neither the FIFO reads nor the estimates; the samples wait in the ring until it has room.
+
+typedef enum {
+    RtAppState_Idle,
+    RtAppState_Measuring
+} RtAppState;
+
+static RtAppState state = RtAppState_Idle;
+static Hr4StartMessage measurement;
+static rf_config measurementConfig;
+static rf_stream measurementStream;
+// rf_stream_buffer_size of the largest configuration: two uint32_t and one float per sample
+static uint32_t measurementWindowBuffer[3 * RF_MAX_BUFFER_SIZE];
+static LedSettings ledSettings = LED_SETTINGS_DEFAULT;
+static const int MaxLedAdjustmentsPerMeasurement = 3;
+static int ledAdjustmentCount = 0;
+static int32_t estimatesLeft = 0;
+
+// Set by the sample timer interrupt, taken by the main loop
+static _Atomic bool fifoReadDue = false;
+// FIFO samples the sensor lost
+static uint32_t sensorOverflows = 0;
+// Overflows already reported to the high-level app
+static uint32_t reportedOverflows = 0;
+
+// Raw samples on their way to the high-level app, all taken with samplesMessage.sensorConfig
+static SampleRing sampleRing;
+// Filled from sampleRing; kept until the mailbox has taken it
+static Hr4SamplesMessage samplesMessage;
+
+/// <summary>
+///     I2C read callback of the MAX30102 driver.
+/// </summary>
+static int ReadHr4Register(uint8_t addr, uint16_t count, uint8_t *ptr)
+{
+    return I2cWriteThenRead(MAX30101_SAD, &addr, sizeof(addr), ptr, count);
+}
+
+/// <summary>
+///     I2C write callback of the MAX30102 driver.
+/// </summary>
+static void WriteHr4Register(uint8_t addr, uint16_t count, uint8_t *ptr)
+{
+    uint8_t buff[2] = {addr, *ptr};
+    (void)count;
+    I2cWrite(MAX30101_SAD, buff, sizeof(buff));
+}
+
+/// <summary>
+///     Sample timer interrupt: flags the FIFO read for the main loop.
+/// </summary>
+static void SampleTimerHandler(void)
+{
+    atomic_store(&fifoReadDue, true);
+}
+
+/// <summary>
+///     Mailbox sender, the consumer of sampleRing: moves the samples into samplesMessage and
+///     sends every full message, and with flush the last, partial one as well. Without flush a
+///     message the outbound buffer has no room for is kept and sent on a later pass; with flush
+///     it is lost, and its samples are counted as overflows in the next message.
+/// </summary>
+static void SendSamples(bool flush)
+{
+    for (;;) {
+        uint32_t count = samplesMessage.sampleCount;
+        count += (uint32_t)PopFromSampleRing(&sampleRing, &samplesMessage.ir[count],
+                                             &samplesMessage.red[count],
+                                             HR4_SAMPLES_PER_MESSAGE - count);
+        samplesMessage.sampleCount = count;
+        if (count == 0 || (count < HR4_SAMPLES_PER_MESSAGE && !flush)) {
+            return;
+        }
+
+        uint32_t overflows = sensorOverflows + GetSampleRingDropCount(&sampleRing);
+        samplesMessage.overflows = overflows - reportedOverflows;
+        if (SendToHighLevelApp(&samplesMessage, sizeof(samplesMessage))) {
+            reportedOverflows = overflows;
+        } else if (flush) {
+            reportedOverflows = overflows - count;
+        } else {
+            return;
+        }
+        samplesMessage.sampleCount = 0;
+    }
+}
+
+/// <summary>
+///     Sends all samples taken so far and starts the next samples message with the current
+///     sensor configuration.
+/// </summary>
+static void FlushSamples(void)
+{
+    SendSamples(true);
+    samplesMessage.header.type = Hr4Message_Samples;
+    maxim_max30102_get_config(&samplesMessage.sensorConfig);
+}
+
+/// <summary>
+///     Sets the LED currents and the ADC range to ledSettings and clears the FIFO, so the
+///     samples taken with the old settings are dropped.
+/// </summary>
+static void ApplyLedSettings(void)
+{
+    maxim_max30102_set_led_pa(ledSettings.redPulseAmplitude, ledSettings.irPulseAmplitude);
+    maxim_max30102_set_adc_range(ledSettings.adcRangeNanoamps);
+    maxim_max30102_clear_fifo();
+}
+
+/// <summary>
+///     Sends the end of the measurement, with the LED settings it ended with, and powers the
+///     sensor down.
+/// </summary>
+static void StopMeasurement(void)
+{
+    StopSampleTimer();
+    if (measurement.sendSamples) {
+        FlushSamples();
+    }
+    max301024_shut_down(1);
+
+    Hr4DoneMessage done = {.header.type = Hr4Message_Done,
+                           .adcRangeNanoamps = ledSettings.adcRangeNanoamps,
+                           .redPulseAmplitude = ledSettings.redPulseAmplitude,
+                           .irPulseAmplitude = ledSettings.irPulseAmplitude};
+    SendToHighLevelApp(&done, sizeof(done));
+    state = RtAppState_Idle;
+}
+
+/// <summary>
+///     Configures the sensor and the estimator for the requested measurement and starts the
+///     sample timer.
+/// </summary>
+static void StartMeasurement(const Hr4StartMessage *start)
+{
+    if (state == RtAppState_Measuring) {
+        StopMeasurement();
+    }
+    measurement = *start;
+
+    rf_config_default(&measurementConfig);
+    if (!rf_configure(&measurementConfig, measurement.sampleRate, measurement.windowSeconds) ||
+        !maxim_max30102_init_sample_rate(measurementConfig.n_fs)) {
+        rf_config_default(&measurementConfig);
+        maxim_max30102_init();
+    }
+    measurementConfig.n_periodicity_search = RF_PERIODICITY_SEQUENCE;
+    rf_stream_init(&measurementStream, &measurementConfig, measurementConfig.n_fs,
+                   measurementWindowBuffer);
+    // One estimate per second once the window is full
+    estimatesLeft = measurement.runSeconds - measurementConfig.n_st + 1;
+    if (estimatesLeft < 1) {
+        estimatesLeft = 1;
+    }
+
+    ledSettings.redPulseAmplitude = measurement.redPulseAmplitude;
+    ledSettings.irPulseAmplitude = measurement.irPulseAmplitude;
+    ledSettings.adcRangeNanoamps = measurement.adcRangeNanoamps;
+    ledAdjustmentCount = 0;
+
+    atomic_store(&fifoReadDue, false);
+    InitSampleRing(&sampleRing);
+    samplesMessage.sampleCount = 0;
+    reportedOverflows = sensorOverflows;
+    ApplyLedSettings();
+    FlushSamples();
+
+    state = RtAppState_Measuring;
+    StartSampleTimer(MAX30102_FIFO_A_FULL_SAMPLES * (1000000 / (uint32_t)measurementConfig.n_fs),
+                     SampleTimerHandler);
+}
+
+/// <summary>
+///     Corrects the LED currents and the ADC range after an invalid estimate whose signal does
+///     not fit the ADC range, as the high-level app does without the real-time app. The window
+///     and the estimate count start over.
+/// </summary>
+/// <returns>true if the settings changed</returns>
+static bool AdjustLedSettings(void)
+{
+    rf_levels levels;
+    if (ledAdjustmentCount >= MaxLedAdjustmentsPerMeasurement ||
+        !rf_stream_levels(&measurementStream, &levels) ||
+        !UpdateLedSettings(&ledSettings, levels.f_dc_ir, levels.f_ac_ir, levels.f_dc_red,
+                           levels.f_ac_red)) {
+        return false;
+    }
+
+    ledAdjustmentCount++;
+    // The samples so far were taken with the old settings, the next ones are not
+    if (measurement.sendSamples) {
+        SendSamples(true);
+    }
+    ApplyLedSettings();
+    if (measurement.sendSamples) {
+        maxim_max30102_get_config(&samplesMessage.sensorConfig);
+    }
+    rf_stream_init(&measurementStream, &measurementConfig, measurementConfig.n_fs,
+                   measurementWindowBuffer);
+    estimatesLeft = measurement.runSeconds - measurementConfig.n_st + 1;
+    return true;
+}
+
+/// <summary>
+///     Runs the estimator due after the last sample and sends its result.
+/// </summary>
+/// <returns>true if the LED settings changed, which drops the samples not yet processed</returns>
+static bool ProcessWindow(void)
+{
+    Hr4ResultMessage result = {.header.type = Hr4Message_Result};
+    int8_t spo2Valid, heartRateValid;
+    rf_stream_estimate(&measurementStream, &result.spo2, &spo2Valid, &result.heartRate,
+                       &heartRateValid, &result.ratio, &result.correl);
+    result.spo2Valid = (uint8_t)spo2Valid;
+    result.heartRateValid = (uint8_t)heartRateValid;
+    SendToHighLevelApp(&result, sizeof(result));
+
+    if ((!heartRateValid || !spo2Valid) && AdjustLedSettings()) {
+        return true;
+    }
+    if (--estimatesLeft <= 0) {
+        StopMeasurement();
+    }
+    return false;
+}
+
+/// <summary>
+///     Once the sample timer has fired, drains the MAX30102 FIFO and feeds the samples to the
+///     estimator and, as the producer of sampleRing, to the mailbox sender.
+/// </summary>
+static void AcquireSamples(void)
+{
+    if (state != RtAppState_Measuring || !atomic_exchange(&fifoReadDue, false)) {
+        return;
+    }
+
+    uint32_t red[MAX30102_FIFO_DEPTH];
+    uint32_t ir[MAX30102_FIFO_DEPTH];
+    size_t count;
+    if (!maxim_max30102_read_fifo_burst(red, ir, MAX30102_FIFO_DEPTH, &count)) {
+        return;
+    }
+    sensorOverflows += maxim_max30102_take_overflow_count();
+
+    for (size_t i = 0; i < count && state == RtAppState_Measuring; i++) {
+        if (measurement.sendSamples) {
+            PushToSampleRing(&sampleRing, ir[i], red[i]);
+        }
+        // New LED settings drop the rest of the burst, which was taken with the old ones
+        if (rf_stream_push(&measurementStream, ir[i], red[i]) && ProcessWindow()) {
+            break;
+        }
+    }
+}
+
+/// <summary>
+///     Handles the messages of the high-level app.
+/// </summary>
+static void ProcessMessages(void)
+{
+    static union {
+        Hr4MessageHeader header;
+        Hr4StartMessage start;
+        uint8_t bytes[HR4_MESSAGE_MAX_SIZE];
+    } message;
+    size_t length;
+    while (ReceiveFromHighLevelApp(&message, sizeof(message), &length)) {
+        if (length < sizeof(Hr4MessageHeader)) {
+            continue;
+        }
+        switch (message.header.type) {
+        case Hr4Message_Start:
+            if (length >= sizeof(Hr4StartMessage)) {
+                StartMeasurement(&message.start);
+            }
+            break;
+        case Hr4Message_Stop:
+            if (state == RtAppState_Measuring) {
+                StopMeasurement();
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+_Noreturn void RTCoreMain(void)
+{
+    if (!InitPlatform()) {
+        for (;;) {
+            WaitForInterrupt(&fifoReadDue);
+        }
+    }
+    maxim_max30102_i2c_setup(ReadHr4Register, WriteHr4Register);
+    max301024_shut_down(1);
+
+    for (;;) {
+        ProcessMessages();
+        AcquireSamples();
+        if (state == RtAppState_Measuring && measurement.sendSamples) {
+            SendSamples(false);
+        }
+        WaitForInterrupt(&fifoReadDue);
+    }
+}
@@ -0,0 +1,109 @@
+#include "lib/CPUFreq.h"
+#include "lib/GPT.h"
+#include "lib/I2CMaster.h"
+#include "lib/VectorTable.h"
+#include "logical-intercore.h"
+#include "hr4_intercore.h"
+#include "platform.h"
+
+// The HR4 click sits in mikroBUS socket 1 of the MT3620 RDB
+#define HR4_I2C_UNIT MT3620_UNIT_ISU2
+#define SAMPLE_TIMER_UNIT MT3620_UNIT_GPT3
+#define CPU_FREQUENCY_HZ 197600000
+
+static I2CMaster *i2cDriver = NULL;
+static GPT *sampleTimer = NULL;
+static void (*sampleTimerHandler)(void) = NULL;
+
+static IntercoreComm intercore;
+// HR4_HLAPP_COMPONENT_ID
+static const ComponentId highLevelAppId = {
+    .data1 = 0x819255ff,
+    .data2 = 0x8640,
+    .data3 = 0x41fd,
+    .data4 = {0xae, 0xa7, 0xf8, 0x5d, 0x34, 0xc4, 0x91, 0xd5}};
+
+static void SampleTimerCallback(GPT *timer)
+{
+    (void)timer;
+    if (sampleTimerHandler != NULL) {
+        sampleTimerHandler();
+    }
+}
+
+static void IntercoreReceiveCallback(void)
+{
+    // The main loop wakes up from WaitForInterrupt and picks the message up
+}
+
+bool InitPlatform(void)
+{
+    VectorTableInit();
+    CPUFreq_Set(CPU_FREQUENCY_HZ);
+
+    i2cDriver = I2CMaster_Open(HR4_I2C_UNIT);
+    if (i2cDriver == NULL ||
+        I2CMaster_SetBusSpeed(i2cDriver, I2C_BUS_SPEED_STANDARD) != ERROR_NONE) {
+        return false;
+    }
+
+    // Microsecond resolution; the period is set by StartSampleTimer
+    sampleTimer = GPT_Open(SAMPLE_TIMER_UNIT, 1000000, GPT_MODE_REPEAT);
+    if (sampleTimer == NULL) {
+        return false;
+    }
+
+    return SetupIntercoreComm(&intercore, IntercoreReceiveCallback) == Intercore_OK;
+}
+
+int I2cWriteThenRead(uint8_t address, const uint8_t *wrData, size_t wrLength, uint8_t *rdData,
+                     size_t rdLength)
+{
+    if (I2CMaster_WriteThenReadSync(i2cDriver, address, wrData, wrLength, rdData, rdLength) !=
+        ERROR_NONE) {
+        return -1;
+    }
+    return (int)rdLength;
+}
+
+int I2cWrite(uint8_t address, const uint8_t *data, size_t length)
+{
+    if (I2CMaster_WriteSync(i2cDriver, address, data, length) != ERROR_NONE) {
+        return -1;
+    }
+    return (int)length;
+}
+
+void StartSampleTimer(uint32_t periodMicroseconds, void (*handler)(void))
+{
+    sampleTimerHandler = handler;
+    GPT_StartTimeout(sampleTimer, periodMicroseconds, GPT_UNITS_MICROSEC, SampleTimerCallback);
+}
+
+void StopSampleTimer(void)
+{
+    GPT_Stop(sampleTimer);
+    sampleTimerHandler = NULL;
+}
+
+bool SendToHighLevelApp(const void *data, size_t length)
+{
+    return IntercoreSend(&intercore, &highLevelAppId, data, length) == Intercore_OK;
+}
+
+bool ReceiveFromHighLevelApp(void *data, size_t size, size_t *length)
+{
+    ComponentId sender;
+    *length = size;
+    return IntercoreRecv(&intercore, &sender, data, length) == Intercore_OK;
+}
+
+void WaitForInterrupt(const _Atomic bool *pending)
+{
+    // A pending interrupt ends wfi even while masked, and runs once unmasked
+    __asm__ volatile("cpsid i" ::: "memory");
+    if (!atomic_load(pending)) {
+        __asm__ volatile("wfi");
+    }
+    __asm__ volatile("cpsie i" ::: "memory");
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// <summary>
+///     The few MT3620 M4 services the HR4 real-time app needs, so main.c stays independent of
+///     the driver libraries. mt3620_platform.c implements them on the MT3620 M4 drivers (I2C
+///     master, GPT) and the inter-core mailbox library of the Azure Sphere real-time samples;
+///     see README.md.
+/// </summary>
+
+/// <summary>
+///     Sets up the vector table, the HR4 I2C bus, the sample timer and the mailbox.
+/// </summary>
+/// <returns>false if a peripheral could not be opened</returns>
+bool InitPlatform(void);
+
+/// <summary>
+///     Writes wrLength bytes to the I2C device at address, then reads rdLength bytes.
+/// </summary>
+/// <returns>rdLength on success, -1 on failure</returns>
+int I2cWriteThenRead(uint8_t address, const uint8_t *wrData, size_t wrLength, uint8_t *rdData,
+                     size_t rdLength);
+
+/// <summary>
+///     Writes length bytes to the I2C device at address.
+/// </summary>
+/// <returns>length on success, -1 on failure</returns>
+int I2cWrite(uint8_t address, const uint8_t *data, size_t length);
+
+/// <summary>
+///     Calls handler from the timer interrupt every periodMicroseconds until StopSampleTimer.
+///     The handler must not block; the I2C functions wait for the bus and are for the main
+///     loop only.
+/// </summary>
+void StartSampleTimer(uint32_t periodMicroseconds, void (*handler)(void));
+
+void StopSampleTimer(void);
+
+/// <summary>
+///     Queues a message to the high-level app and notifies it.
+/// </summary>
+/// <returns>false if the outbound buffer has no room for the message</returns>
+bool SendToHighLevelApp(const void *data, size_t length);
+
+/// <summary>
+///     Takes the next message of the high-level app, if any.
+/// </summary>
+/// <param name="data">Buffer for the message</param>
+/// <param name="size">Size of the buffer</param>
+/// <param name="length">Receives the length of the message</param>
+/// <returns>false if no message is waiting</returns>
+bool ReceiveFromHighLevelApp(void *data, size_t size, size_t *length);
+
+/// <summary>
+///     Sleeps until the next interrupt, e.g. the sample timer or a mailbox message, unless
+///     *pending is already set. Interrupts are masked while it is checked, so an interrupt that
+///     sets it just before the sleep still ends it.
+/// </summary>
+void WaitForInterrupt(const _Atomic bool *pending);
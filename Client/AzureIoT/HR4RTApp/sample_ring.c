@@ -0,0 +1,55 @@
+#include "sample_ring.h"
+
+void InitSampleRing(SampleRing *ring)
+{
+    atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->dropped, 0, memory_order_relaxed);
+}
+
+bool PushToSampleRing(SampleRing *ring, uint32_t ir, uint32_t red)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= SAMPLE_RING_CAPACITY) {
+        atomic_store_explicit(&ring->dropped,
+                              atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+        return false;
+    }
+
+    size_t slot = head & (SAMPLE_RING_CAPACITY - 1);
+    ring->ir[slot] = ir;
+    ring->red[slot] = red;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+size_t PopFromSampleRing(SampleRing *ring, uint32_t *ir, uint32_t *red, size_t maxCount)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t count = head - tail;
+    if (count > maxCount) {
+        count = maxCount;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        size_t slot = (tail + i) & (SAMPLE_RING_CAPACITY - 1);
+        ir[i] = ring->ir[slot];
+        red[i] = ring->red[slot];
+    }
+    atomic_store_explicit(&ring->tail, tail + (uint32_t)count, memory_order_release);
+    return count;
+}
+
+void DiscardSampleRing(SampleRing *ring)
+{
+    atomic_store_explicit(&ring->tail, atomic_load_explicit(&ring->head, memory_order_acquire),
+                          memory_order_release);
+}
+
+uint32_t GetSampleRingDropCount(const SampleRing *ring)
+{
+    return atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// <summary>
+///     Lock-free single-producer, single-consumer ring of IR and red sample pairs. The
+///     acquisition of the samples is the only producer and the mailbox sender the only consumer:
+///     the producer alone writes head and the consumer alone writes tail, both free-running
+///     counters, so neither side ever waits for the other, and either may run in an interrupt.
+///     The release store of head publishes the samples written before it, and the release store
+///     of tail hands their slots back.
+/// </summary>
+#define SAMPLE_RING_CAPACITY 256 // power of two; 2.5 s at 100 sps
+
+typedef struct {
+    uint32_t ir[SAMPLE_RING_CAPACITY];
+    uint32_t red[SAMPLE_RING_CAPACITY];
+    _Atomic uint32_t head;    // samples pushed, written by the producer only
+    _Atomic uint32_t tail;    // samples popped, written by the consumer only
+    _Atomic uint32_t dropped; // samples that found the ring full, written by the producer only
+} SampleRing;
+
+/// <summary>
+///     Empties the ring. Neither side may use it meanwhile.
+/// </summary>
+void InitSampleRing(SampleRing *ring);
+
+/// <summary>
+///     Appends a sample pair. Producer only.
+/// </summary>
+/// <returns>false if the ring is full; the sample is counted in dropped</returns>
+bool PushToSampleRing(SampleRing *ring, uint32_t ir, uint32_t red);
+
+/// <summary>
+///     Removes up to maxCount of the oldest sample pairs. Consumer only.
+/// </summary>
+/// <returns>Number of sample pairs removed</returns>
+size_t PopFromSampleRing(SampleRing *ring, uint32_t *ir, uint32_t *red, size_t maxCount);
+
+/// <summary>
+///     Discards the samples pushed so far. Consumer only.
+/// </summary>
+void DiscardSampleRing(SampleRing *ring);
+
+/// <summary>
+///     Returns the number of samples dropped since InitSampleRing. Either side.
+/// </summary>
+uint32_t GetSampleRingDropCount(const SampleRing *ring);
@@ -0,0 +1,51 @@
+﻿using Newtonsoft.Json;
+
+namespace EHRIoTFunctionApp
+{
+    // The parts of the IoT Central data export payload PublishReading uses; everything else is skipped
+    // by the serializer.
+    public class IoTCentralExport
+    {
+        [JsonProperty("device")]
+        public ExportedDevice Device { get; set; }
+    }
+
+    public class ExportedDevice
+    {
+        [JsonProperty("deviceId")]
+        public string DeviceId { get; set; }
+
+        [JsonProperty("measurements")]
+        public ExportedMeasurements Measurements { get; set; }
+
+        [JsonProperty("properties")]
+        public ExportedProperties Properties { get; set; }
+    }
+
+    public class ExportedMeasurements
+    {
+        [JsonProperty("telemetry")]
+        public ExportedTelemetry Telemetry { get; set; }
+    }
+
+    public class ExportedTelemetry
+    {
+        [JsonProperty("SpO2")]
+        public double? SpO2 { get; set; }
+
+        [JsonProperty("Heart_rate")]
+        public double? HeartRate { get; set; }
+    }
+
+    public class ExportedProperties
+    {
+        [JsonProperty("device")]
+        public ExportedDeviceProperties Device { get; set; }
+    }
+
+    public class ExportedDeviceProperties
+    {
+        [JsonProperty("nprId_property")]
+        public string NprId { get; set; }
+    }
+}
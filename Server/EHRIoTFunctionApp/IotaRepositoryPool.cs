@@ -0,0 +1,37 @@
+﻿using System;
+using System.Threading;
+using RestSharp;
+using Tangle.Net.Repository;
+
+namespace EHRIoTFunctionApp
+{
+    // Repositories shared by all invocations of the function app instance, so a reading does not
+    // pay for a new client and connection to the node. Concurrent invocations are spread over the
+    // pool round robin.
+    public static class IotaRepositoryPool
+    {
+        static string s_defaultNodeUri = "https://nodes.devnet.thetangle.org:443";
+
+        static Lazy<RestIotaRepository[]> s_repositories = new Lazy<RestIotaRepository[]>(CreateRepositories, LazyThreadSafetyMode.ExecutionAndPublication);
+        static int s_nextRepository = -1;
+
+        public static RestIotaRepository GetRepository()
+        {
+            var repositories = s_repositories.Value;
+            var index = (uint)Interlocked.Increment(ref s_nextRepository) % (uint)repositories.Length;
+            return repositories[index];
+        }
+
+        private static RestIotaRepository[] CreateRepositories()
+        {
+            // The node can be set in the application settings, devnet by default.
+            var nodeUri = Environment.GetEnvironmentVariable("IotaNodeUri") ?? s_defaultNodeUri;
+            var repositories = new RestIotaRepository[Math.Max(2, Environment.ProcessorCount)];
+            for (int i = 0; i < repositories.Length; i++)
+            {
+                repositories[i] = new RestIotaRepository(new RestClient(nodeUri));
+            }
+            return repositories;
+        }
+    }
+}
@@ -0,0 +1,73 @@
+﻿using System;
+using System.Security.Cryptography;
+using System.Text;
+using System.Threading;
+using System.Threading.Tasks;
+using Microsoft.WindowsAzure.Storage;
+using Microsoft.WindowsAzure.Storage.Blob;
+
+namespace EHRIoTFunctionApp
+{
+    // Ranges of key indexes leased to one function app instance, so instances scaled out or
+    // restarted never derive the same addresses of a patient. The next free key index of each
+    // patient is kept in a blob of the function app's storage account and moved past every
+    // leased range with optimistic concurrency: an instance that lost the race to another reads
+    // the blob again. Indexes leased but not used before a restart are skipped, never reused.
+    public static class KeyIndexLeases
+    {
+        static string s_containerName = "key-index-leases";
+
+        static Lazy<CloudBlobContainer> s_container = new Lazy<CloudBlobContainer>(CreateContainer, LazyThreadSafetyMode.ExecutionAndPublication);
+
+        // Returns the first of count key indexes leased for the patient. The first lease of a
+        // patient starts at firstUnusedKeyIndex, which is only called when there is no blob yet.
+        public static async Task<int> LeaseAsync(string nprId, int count, Func<int> firstUnusedKeyIndex)
+        {
+            var blob = s_container.Value.GetBlockBlobReference(GetBlobName(nprId));
+            while (true)
+            {
+                int start;
+                AccessCondition condition;
+                try
+                {
+                    start = int.Parse(await blob.DownloadTextAsync());
+                    condition = AccessCondition.GenerateIfMatchCondition(blob.Properties.ETag);
+                }
+                catch (StorageException e) when (e.RequestInformation?.HttpStatusCode == 404)
+                {
+                    start = firstUnusedKeyIndex();
+                    condition = AccessCondition.GenerateIfNotExistsCondition();
+                }
+
+                try
+                {
+                    await blob.UploadTextAsync((start + count).ToString(), Encoding.UTF8, condition, null, null);
+                    return start;
+                }
+                catch (StorageException e) when (e.RequestInformation?.HttpStatusCode == 409 || e.RequestInformation?.HttpStatusCode == 412)
+                {
+                    // Another instance leased a range in between.
+                }
+            }
+        }
+
+        // The blob is named after a hash, so the storage account holds no patient ids.
+        private static string GetBlobName(string nprId)
+        {
+            using (var sha256 = SHA256.Create())
+            {
+                var hash = sha256.ComputeHash(Encoding.UTF8.GetBytes(nprId));
+                return BitConverter.ToString(hash).Replace("-", string.Empty).ToLowerInvariant();
+            }
+        }
+
+        private static CloudBlobContainer CreateContainer()
+        {
+            // The storage account of the function app, which also holds the readings queue.
+            var account = CloudStorageAccount.Parse(Environment.GetEnvironmentVariable("AzureWebJobsStorage"));
+            var container = account.CreateCloudBlobClient().GetContainerReference(s_containerName);
+            container.CreateIfNotExistsAsync().GetAwaiter().GetResult();
+            return container;
+        }
+    }
+}
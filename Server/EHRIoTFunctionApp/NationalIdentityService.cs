@@ -1,9 +1,8 @@
 ﻿using System;
+using System.Collections.Concurrent;
 using System.Collections.Generic;
 using System.Text;
-using Tangle.Net.Cryptography;
 using Tangle.Net.Entity;
-using Tangle.Net.Repository;
 
 namespace EHRIoTFunctionApp
 {
@@ -17,20 +16,24 @@ namespace EHRIoTFunctionApp
 
         static Dictionary<string, Seed> s_nationalPatientRegistrySeedVault = new Dictionary<string, Seed> { [s_sampleNprId1] = s_sampleNprSeed1, [s_sampleNprId2] = s_sampleNprSeed2 };
 
-        public static List<Address> GetTangleAddressesFromNprId(RestIotaRepository repository, string nprId, int numberOfAddressesNeeded)
+        static ConcurrentDictionary<string, PatientAddressPool> s_patientAddressPools = new ConcurrentDictionary<string, PatientAddressPool>();
+
+        public static bool IsRegistered(string nprId)
         {
-            List<Address> addresses = new List<Address>();
+            return s_nationalPatientRegistrySeedVault.ContainsKey(nprId);
+        }
 
+        public static List<Address> GetTangleAddressesFromNprId(string nprId, int numberOfAddressesNeeded)
+        {
             // Assert if patient id is in our hard-coded registry.
-            if (!s_nationalPatientRegistrySeedVault.ContainsKey(nprId))
+            if (!s_nationalPatientRegistrySeedVault.TryGetValue(nprId, out var patientSeed))
             {
-                return addresses;
+                return new List<Address>();
             }
 
-            // Get patient seed, request new addresses and return.
-            var patientSeed = s_nationalPatientRegistrySeedVault[nprId];
-            addresses.AddRange(repository.GetNewAddresses(patientSeed, 0, numberOfAddressesNeeded, SecurityLevel.Medium));
-            return addresses;
+            // Take the next unused addresses of the patient's seed from its pool.
+            var pool = s_patientAddressPools.GetOrAdd(nprId, id => new PatientAddressPool(id, patientSeed));
+            return pool.TakeAddresses(numberOfAddressesNeeded);
         }
     }
 }
@@ -0,0 +1,29 @@
+﻿using Newtonsoft.Json;
+using System.Globalization;
+
+namespace EHRIoTFunctionApp
+{
+    // A light-weight openEHR Observation with a single magnitude, rendered to JSON once when created, so
+    // publishing a reading only appends the magnitude between the two halves.
+    public sealed class ObservationTemplate
+    {
+        const string Suffix = "\"}}}}";
+
+        readonly string _prefix;
+
+        public ObservationTemplate(string archetypeId, string observationCodeId, string valueCodeId)
+        {
+            _prefix =
+                "{\"archetype_node_id\":" + JsonConvert.ToString(archetypeId) +
+                ",\"events\":{\"archetype_node_id\":" + JsonConvert.ToString(observationCodeId) +
+                ",\"data\":{\"archetype_node_id\":" + JsonConvert.ToString(valueCodeId) +
+                ",\"value\":{\"magnitude\":\"";
+        }
+
+        // The magnitude is kept a string, as before, and always formatted with a '.' decimal separator.
+        public string Render(double magnitude)
+        {
+            return _prefix + magnitude.ToString("R", CultureInfo.InvariantCulture) + Suffix;
+        }
+    }
+}
@@ -0,0 +1,109 @@
+﻿using System;
+using System.Collections.Concurrent;
+using System.Collections.Generic;
+using System.Threading;
+using System.Threading.Tasks;
+using Tangle.Net.Cryptography;
+using Tangle.Net.Entity;
+
+namespace EHRIoTFunctionApp
+{
+    // Unused Tangle addresses of one patient, derived ahead of the readings that need them.
+    // Key indexes are leased in ranges from KeyIndexLeases, shared by all instances of the
+    // function app, and the addresses of a range are derived locally and handed out in order, so
+    // the cost of a reading does not grow with the patient's history. The pool is topped up in
+    // the background when it runs low.
+    public class PatientAddressPool
+    {
+        const int PoolSize = 16;
+        const int RefillThreshold = 4;
+
+        readonly string _nprId;
+        readonly Seed _seed;
+        readonly AddressGenerator _addressGenerator = new AddressGenerator();
+        readonly ConcurrentQueue<Address> _addresses = new ConcurrentQueue<Address>();
+        // Guards _addressGenerator, _nextKeyIndex and _leaseEnd.
+        readonly object _deriveLock = new object();
+        // Next key index to derive, up to the end of the leased range.
+        int _nextKeyIndex;
+        int _leaseEnd;
+        int _refilling;
+
+        public PatientAddressPool(string nprId, Seed seed)
+        {
+            _nprId = nprId;
+            _seed = seed;
+        }
+
+        public List<Address> TakeAddresses(int count)
+        {
+            var addresses = new List<Address>(count);
+            while (addresses.Count < count)
+            {
+                if (_addresses.TryDequeue(out var address))
+                {
+                    addresses.Add(address);
+                    continue;
+                }
+
+                // Only when the background refill has fallen behind.
+                Refill(count - addresses.Count);
+            }
+
+            if (_addresses.Count < RefillThreshold)
+            {
+                StartBackgroundRefill();
+            }
+            return addresses;
+        }
+
+        public void StartBackgroundRefill()
+        {
+            if (Interlocked.CompareExchange(ref _refilling, 1, 0) != 0)
+            {
+                return;
+            }
+
+            Task.Run(() =>
+            {
+                try
+                {
+                    Refill(PoolSize);
+                }
+                catch (Exception)
+                {
+                    // The next reading refills synchronously and reports the error.
+                }
+                finally
+                {
+                    Volatile.Write(ref _refilling, 0);
+                }
+            });
+        }
+
+        private void Refill(int count)
+        {
+            lock (_deriveLock)
+            {
+                var target = Math.Max(count, PoolSize);
+                while (_addresses.Count < target)
+                {
+                    if (_nextKeyIndex == _leaseEnd)
+                    {
+                        var leaseSize = Math.Max(target - _addresses.Count, PoolSize);
+                        _nextKeyIndex = KeyIndexLeases.LeaseAsync(_nprId, leaseSize, FindFirstUnusedKeyIndex).GetAwaiter().GetResult();
+                        _leaseEnd = _nextKeyIndex + leaseSize;
+                    }
+                    _addresses.Enqueue(_addressGenerator.GetAddress(_seed, SecurityLevel.Medium, _nextKeyIndex++));
+                }
+            }
+        }
+
+        private int FindFirstUnusedKeyIndex()
+        {
+            var repository = IotaRepositoryPool.GetRepository();
+            var addresses = repository.GetNewAddresses(_seed, 0, 1, SecurityLevel.Medium);
+            return addresses[0].KeyIndex;
+        }
+    }
+}
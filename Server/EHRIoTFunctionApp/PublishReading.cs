@@ -4,14 +4,11 @@ using Microsoft.Azure.WebJobs;
 using Microsoft.Azure.WebJobs.Extensions.Http;
 using Microsoft.Extensions.Logging;
 using Newtonsoft.Json;
-using Newtonsoft.Json.Linq;
-using RestSharp;
 using System.Collections.Generic;
 using System.IO;
 using System.Threading.Tasks;
 using Tangle.Net.Cryptography;
 using Tangle.Net.Entity;
-using Tangle.Net.Repository;
 using Tangle.Net.Utils;
 
 namespace EHRIoTFunctionApp
@@ -21,110 +18,103 @@ namespace EHRIoTFunctionApp
         [FunctionName("PublishReading")]
         public static async Task<IActionResult> Run(
             [HttpTrigger(AuthorizationLevel.Function, "post", Route = null)] HttpRequest req,
+            [Queue(ReadingMessage.QueueName)] IAsyncCollector<ReadingMessage> readings,
             ILogger log)
         {
             log.LogInformation("C# HTTP trigger function processed a request.");
 
-            // Get needed parameters from payload.
-            string requestBody = await new StreamReader(req.Body).ReadToEndAsync();
-            dynamic data = JsonConvert.DeserializeObject(requestBody);
-            string deviceId = data?.device.deviceId;
-            dynamic telemetry = data?.device.measurements.telemetry;
-            dynamic properties = data?.device.properties;
-            string nprId = properties.device.nprId_property.ToString();
+            // Get needed parameters from payload, reading it straight from the request stream.
+            IoTCentralExport data;
+            try
+            {
+                data = ReadExport(req.Body);
+            }
+            catch (JsonException)
+            {
+                data = null;
+            }
+            string deviceId = data?.Device?.DeviceId;
+            var telemetry = data?.Device?.Measurements?.Telemetry;
+            string nprId = data?.Device?.Properties?.Device?.NprId;
 
             // Basic validation before proceeding.
-            if (string.IsNullOrEmpty(nprId) || !(telemetry is JObject))
+            if (string.IsNullOrEmpty(nprId) || telemetry == null)
             {
                 return new BadRequestObjectResult("NprId not set on reporting device or reading invalid.");
             }
 
-            // Connect to a node on one of the main networks.
-            var repository = new RestIotaRepository(new RestClient("https://nodes.devnet.thetangle.org:443"));
-
-            // Get addresses from the Tangle on behalf of the patient's wallet for generating new address for posting reading. 
-            // Would be an external trusted service.
-            var tangleAddresses = NationalIdentityService.GetTangleAddressesFromNprId(repository, nprId, ((JObject)telemetry).Count);
+            var reading = new ReadingMessage
+            {
+                NprId = nprId,
+                DeviceId = deviceId,
+                SpO2 = telemetry.SpO2,
+                HeartRate = telemetry.HeartRate
+            };
+
+            // Messages without a reading, such as the device heartbeat, are not published.
+            if (reading.ObservationCount == 0)
+            {
+                return (ActionResult)new OkObjectResult($"No reading from DeviceID: {deviceId}");
+            }
 
-            // Terminate if no addresses created.
-            if (tangleAddresses.Count < 1)
+            // Terminate if the patient has no wallet. Would be an external trusted service.
+            if (!NationalIdentityService.IsRegistered(nprId))
             {
                 return new BadRequestObjectResult("NprId not found or no associated seed.");
             }
 
-            // Create transactions for the Tangle for each type of reading in payload and bundle together.
-            // Finalize and sign.
-            var bundle = CreateTransaction(tangleAddresses, telemetry);
+            // Queue the reading for SubmitReadings, which bundles it with others and sends it to the Tangle.
+            await readings.AddAsync(reading);
 
-            // Send the complete transactions to the Tangle.
-            repository.SendTrytes(bundle.Transactions, depth: 2, minWeightMagnitude: 9);
-
-            string logMessage = $"NPRId: {nprId} - DeviceID: {deviceId} - reading: {telemetry.ToString()} - Bundle hash: {bundle.Hash.Value}";
+            string logMessage = $"NPRId: {nprId} - DeviceID: {deviceId} - SpO2: {reading.SpO2} - Heart rate: {reading.HeartRate} - queued";
             log.LogInformation(logMessage);
 
-            return (ActionResult)new OkObjectResult(logMessage);
+            return new AcceptedResult((string)null, logMessage);
+        }
+
+        // The Functions host has already buffered the body, so the serializer reads it without building an
+        // intermediate string or token tree.
+        private static IoTCentralExport ReadExport(Stream body)
+        {
+            using (var reader = new JsonTextReader(new StreamReader(body)))
+            {
+                return s_serializer.Deserialize<IoTCentralExport>(reader);
+            }
         }
 
-        private static Bundle CreateTransaction(List<Address> addresses, dynamic telemetry)
+        // Adds a transfer with a light-weight openEHR payload for each type of reading, to one of the given
+        // unused addresses each. The bundle is finalized and signed by the caller.
+        public static void AddReadingToBundle(Bundle bundle, List<Address> addresses, ReadingMessage reading)
         {
-            // Iterate over the empty transactions and add a light-weight openEHR payload.
             int currentAddress = 0;
-            var bundle = new Bundle();
 
             // SpO2 reading.
-            if (!string.IsNullOrEmpty(telemetry.SpO2.ToString()))
+            if (reading.SpO2.HasValue)
             {
-                var spO2Payload = CreateArchetypeObservationFromTemplate(
-                    s_pulse_oximetryArchetypeId,
-                    s_pulse_oximetryObservationCodeId,
-                    s_pulse_oximetryValueCodeId,
-                    telemetry.SpO2.ToString());
-
+                var spO2Payload = s_pulse_oximetryTemplate.Render(reading.SpO2.Value);
                 CreateTransferAndAddToBundle(addresses[currentAddress++], bundle, spO2Payload);
             }
 
             // Heart rate reading.
-            if (!string.IsNullOrEmpty(telemetry.Heart_rate.ToString()))
+            if (reading.HeartRate.HasValue)
             {
-                var heartRatePayload = CreateArchetypeObservationFromTemplate(
-                    s_pulseArchetypeId,
-                    s_pulseObservationCodeId,
-                    s_pulseValueCodeId,
-                    telemetry.Heart_rate.ToString());
-
+                var heartRatePayload = s_pulseTemplate.Render(reading.HeartRate.Value);
                 CreateTransferAndAddToBundle(addresses[currentAddress++], bundle, heartRatePayload);
             }
-
-            bundle.Finalize();
-            bundle.Sign();
-            return bundle;
         }
 
-        private static void CreateTransferAndAddToBundle(Address address, Bundle bundle, dynamic payload)
+        private static void CreateTransferAndAddToBundle(Address address, Bundle bundle, string payload)
         {
             bundle.AddTransfer(new Transfer
             {
                 Address = new Address(address.Value),
                 Tag = new Tag("OPENEHR"),
                 Timestamp = Timestamp.UnixSecondsTimestamp,
-                Message = TryteString.FromUtf8String(payload.ToString())
+                Message = TryteString.FromUtf8String(payload)
             });
         }
 
-        // Hard-coded creation of a light-weight openEHR Observation. Would be replaced by a Template repository.
-        private static dynamic CreateArchetypeObservationFromTemplate(string archetypeId, string observationCodeId, string valueCodeId, string magnitude)
-        {
-            dynamic payload = new JObject();
-            payload.archetype_node_id = archetypeId;
-            payload.events = new JObject();
-            payload.events.archetype_node_id = observationCodeId;
-            payload.events.data = new JObject();
-            payload.events.data.archetype_node_id = valueCodeId;
-            payload.events.data.value = new JObject();
-            payload.events.data.value.magnitude = magnitude;
-
-            return payload;
-        }
+        private static JsonSerializer s_serializer = JsonSerializer.CreateDefault();
 
         private static string s_pulse_oximetryArchetypeId = "openEHR-EHR-OBSERVATION.pulse_oximetry.v1";
         private static string s_pulse_oximetryObservationCodeId = "at0000"; // Pulse oximetry
@@ -133,6 +123,12 @@ namespace EHRIoTFunctionApp
         private static string s_pulseArchetypeId = "openEHR-EHR-OBSERVATION.pulse.v1";
         private static string s_pulseObservationCodeId = "at0000"; // Pulse/Heart beat
         private static string s_pulseValueCodeId = "at0004"; // Rate
+
+        // Hard-coded light-weight openEHR Observations. Would be replaced by a Template repository.
+        private static ObservationTemplate s_pulse_oximetryTemplate = new ObservationTemplate(
+            s_pulse_oximetryArchetypeId, s_pulse_oximetryObservationCodeId, s_pulse_oximetryValueCodeId);
+        private static ObservationTemplate s_pulseTemplate = new ObservationTemplate(
+            s_pulseArchetypeId, s_pulseObservationCodeId, s_pulseValueCodeId);
         
         private static string s_bodyTemperatureArchetypeId = "openEHR-EHR-OBSERVATION.body_temperature.v2";
         private static string s_bodyTemperatureObservationCodeId = "at0000"; // Body temperature
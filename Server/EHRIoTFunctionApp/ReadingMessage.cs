@@ -0,0 +1,20 @@
+﻿using Newtonsoft.Json;
+
+namespace EHRIoTFunctionApp
+{
+    // A validated reading waiting in the readings queue for SubmitReadings.
+    public class ReadingMessage
+    {
+        public const string QueueName = "readings";
+        public const string PoisonQueueName = "readings-poison";
+
+        public string NprId { get; set; }
+        public string DeviceId { get; set; }
+        public double? SpO2 { get; set; }
+        public double? HeartRate { get; set; }
+
+        // Number of openEHR observations, and so of Tangle transfers and addresses, the reading takes.
+        [JsonIgnore]
+        public int ObservationCount => (SpO2.HasValue ? 1 : 0) + (HeartRate.HasValue ? 1 : 0);
+    }
+}
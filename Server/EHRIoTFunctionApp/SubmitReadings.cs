@@ -0,0 +1,154 @@
+﻿using Microsoft.Azure.WebJobs;
+using Microsoft.Extensions.Logging;
+using Microsoft.WindowsAzure.Storage.Queue;
+using Newtonsoft.Json;
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Threading;
+using System.Threading.Tasks;
+using Tangle.Net.Entity;
+
+namespace EHRIoTFunctionApp
+{
+    // Takes the readings PublishReading queued during the last window, packs them into shared bundles
+    // and attaches the bundles to the Tangle in parallel, so tip selection and proof-of-work are paid
+    // per bundle instead of per reading and stay out of the webhook request. A reading is removed from
+    // the queue once its bundle has been sent; otherwise it becomes visible again and is retried with
+    // the next window, up to MaxDequeueCount times before it is moved to the poison queue.
+    public static class SubmitReadings
+    {
+        const int MaxReadingsPerRun = 256;
+        const int MaxMessagesPerGet = 32; // Storage queue limit
+        const int MaxTransfersPerBundle = 8;
+        const int MaxParallelSubmissions = 4;
+        const int MaxDequeueCount = 5;
+
+        // Long enough for the bundles of one run to be attached.
+        static TimeSpan s_visibilityTimeout = TimeSpan.FromMinutes(5);
+
+        class PendingBundle
+        {
+            public Bundle Bundle { get; } = new Bundle();
+            public List<CloudQueueMessage> Messages { get; } = new List<CloudQueueMessage>();
+            public List<string> NprIds { get; } = new List<string>();
+            public int TransferCount { get; set; }
+        }
+
+        [FunctionName("SubmitReadings")]
+        public static async Task Run(
+            [TimerTrigger("*/10 * * * * *")] TimerInfo timer,
+            [Queue(ReadingMessage.QueueName)] CloudQueue queue,
+            [Queue(ReadingMessage.PoisonQueueName)] CloudQueue poisonQueue,
+            ILogger log)
+        {
+            var messages = await ReceiveMessagesAsync(queue);
+            if (messages.Count == 0)
+            {
+                return;
+            }
+
+            var bundles = new List<PendingBundle>();
+            var current = new PendingBundle();
+            foreach (var message in messages)
+            {
+                ReadingMessage reading = null;
+                try
+                {
+                    reading = JsonConvert.DeserializeObject<ReadingMessage>(message.AsString);
+                }
+                catch (JsonException)
+                {
+                }
+
+                if (reading == null || message.DequeueCount > MaxDequeueCount)
+                {
+                    await MoveToPoisonQueueAsync(queue, poisonQueue, message, log);
+                    continue;
+                }
+
+                var transferCount = reading.ObservationCount;
+                var addresses = NationalIdentityService.GetTangleAddressesFromNprId(reading.NprId, transferCount);
+                if (transferCount == 0 || addresses.Count < transferCount)
+                {
+                    await MoveToPoisonQueueAsync(queue, poisonQueue, message, log);
+                    continue;
+                }
+
+                if (current.TransferCount + transferCount > MaxTransfersPerBundle)
+                {
+                    bundles.Add(current);
+                    current = new PendingBundle();
+                }
+                PublishReading.AddReadingToBundle(current.Bundle, addresses, reading);
+                current.Messages.Add(message);
+                current.NprIds.Add(reading.NprId);
+                current.TransferCount += transferCount;
+            }
+            if (current.Messages.Count > 0)
+            {
+                bundles.Add(current);
+            }
+
+            using (var throttle = new SemaphoreSlim(MaxParallelSubmissions))
+            {
+                await Task.WhenAll(bundles.Select(bundle => SubmitBundleAsync(bundle, queue, throttle, log)));
+            }
+        }
+
+        private static async Task<List<CloudQueueMessage>> ReceiveMessagesAsync(CloudQueue queue)
+        {
+            var messages = new List<CloudQueueMessage>();
+            if (!await queue.ExistsAsync())
+            {
+                return messages;
+            }
+
+            while (messages.Count < MaxReadingsPerRun)
+            {
+                var received = (await queue.GetMessagesAsync(MaxMessagesPerGet, s_visibilityTimeout, null, null)).ToList();
+                messages.AddRange(received);
+                if (received.Count < MaxMessagesPerGet)
+                {
+                    break;
+                }
+            }
+            return messages;
+        }
+
+        private static async Task SubmitBundleAsync(PendingBundle pending, CloudQueue queue, SemaphoreSlim throttle, ILogger log)
+        {
+            await throttle.WaitAsync();
+            try
+            {
+                // Finalize and sign, then send the complete transactions to the Tangle.
+                pending.Bundle.Finalize();
+                pending.Bundle.Sign();
+                await IotaRepositoryPool.GetRepository().SendTrytesAsync(pending.Bundle.Transactions, depth: 2, minWeightMagnitude: 9);
+                log.LogInformation($"Bundle hash: {pending.Bundle.Hash.Value} - {pending.Messages.Count} readings - NPRIds: {string.Join(", ", pending.NprIds.Distinct())}");
+
+                foreach (var message in pending.Messages)
+                {
+                    await queue.DeleteMessageAsync(message);
+                }
+            }
+            catch (Exception e)
+            {
+                // The readings become visible again after the visibility timeout and are retried.
+                log.LogWarning(e, $"Could not attach a bundle of {pending.Messages.Count} readings, retrying later.");
+            }
+            finally
+            {
+                throttle.Release();
+            }
+        }
+
+        private static async Task MoveToPoisonQueueAsync(CloudQueue queue, CloudQueue poisonQueue, CloudQueueMessage message, ILogger log)
+        {
+            log.LogError($"Reading {message.Id} cannot be published after {message.DequeueCount} attempts: {message.AsString}");
+            await poisonQueue.CreateIfNotExistsAsync();
+            await poisonQueue.AddMessageAsync(new CloudQueueMessage(message.AsString));
+            await queue.DeleteMessageAsync(message);
+        }
+    }
+}